@@ -0,0 +1,174 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Hashtable contention benchmark – N producer threads aggregating
+ * disjoint ids concurrently, the same way @ref aggregate does,
+ * optionally with reader threads copying partial aggregates without locks.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#include "../src/hashtable.h"
+#include "../src/aggregator.h"
+#include "../src/epoch.h"
+#include "../src/error.h"
+
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Number of ids every producer keeps incomplete at once.
+ */
+#define DEFAULT_WINDOW 4096
+
+/**
+ * Benchmark configuration.
+ */
+static unsigned producers = 4, readers = 0, shards = DEFAULT_SHARDS, window = DEFAULT_WINDOW;
+static unsigned long long messages = 3000000;
+/**
+ * Set once every producer is done, and number of entries copied by readers.
+ */
+static atomic_bool done;
+static _Atomic unsigned long long reads;
+
+/**
+ * Produces @ref messages messages, in blocks of @ref window ids, every id gets all its values.
+ * @param index_ptr — pointer to index of producer
+ * @return @p NULL
+ */
+static void *producer(void *index_ptr) {
+    unsigned index = *(unsigned *) index_ptr;
+    unsigned long long sent = 0;
+
+    for (uint_least64_t block = 0; sent < messages; ++block) {
+        for (unsigned round = 0; round < DEFAULT_VALUES_THRESHOLD; ++round) {
+            for (unsigned j = 0; j < window; ++j, ++sent) {
+                /* Ids are disjoint between producers, but share shards */
+                uint_least64_t id = (block * window + j) * producers + index;
+
+                struct hashtable_shard *shard = hashtable_shard(id);
+                ERROR_CHECK(pthread_mutex_lock(&shard->mutex));
+                hashtable_write_begin(shard);
+                struct entry_t *entry;
+                NULL_CHECK(entry = hashtable_get(shard, id));
+                entry->payload[entry->count++] = round;
+                if (entry->count == DEFAULT_VALUES_THRESHOLD)
+                    hashtable_remove(shard, id);
+                hashtable_write_end(shard);
+                ERROR_CHECK(pthread_mutex_unlock(&shard->mutex));
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Copies entries of ids of the first blocks, most of them incomplete, until producers are done.
+ * @param unused — unused
+ * @return @p NULL
+ */
+static void *reader(void *unused) {
+    (void) unused;
+    struct epoch_reader *announcement = epoch_register();
+    _Alignas(struct entry_t) unsigned char buffer[MAX_ENTRY_SIZE];
+    unsigned long long copied = 0;
+    unsigned retries = 0;
+
+    for (uint_least64_t id = 0; !atomic_load_explicit(&done, memory_order_relaxed); ++id) {
+        epoch_enter(announcement);
+        hashtable_read(hashtable_shard(id % (window * producers)), id % (window * producers),
+                       (struct entry_t *) buffer, &retries);
+        epoch_exit(announcement);
+        ++copied;
+    }
+    atomic_fetch_add(&reads, copied);
+    return NULL;
+}
+
+/**
+ * Runs benchmark, prints its configuration and throughput.
+ * @param argc — number of arguments
+ * @param argv — `-p producers -r readers -s shards -n messages-per-producer -k window`
+ * @return @p EXIT_SUCCESS
+ */
+int main(int argc, char *argv[]) {
+    for (int opt; (opt = getopt(argc, argv, "p:r:s:n:k:")) != -1;) {
+        switch (opt) {
+            case 'p':
+                producers = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                readers = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                shards = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                messages = strtoull(optarg, NULL, 10);
+                break;
+            case 'k':
+                window = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p producers] [-r readers] [-s shards] [-n messages] [-k window]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (producers == 0 || window == 0 || shards == 0 || (shards & (shards - 1)) != 0 || shards > HASHTABLE_SIZE) {
+        fprintf(stderr, "Invalid configuration.\n");
+        return EXIT_FAILURE;
+    }
+    init_hashtable(shards, DEFAULT_VALUES_THRESHOLD, 0, NULL);
+
+    pthread_t *threads;
+    unsigned *indices;
+    NULL_CHECK(threads = calloc(producers + readers, sizeof(pthread_t)));
+    NULL_CHECK(indices = calloc(producers, sizeof(unsigned)));
+
+    struct timespec start, end;
+    ERROR_CHECK(clock_gettime(CLOCK_MONOTONIC, &start));
+    for (unsigned i = 0; i < producers; ++i) {
+        indices[i] = i;
+        NON_ZERO_CHECK(pthread_create(&threads[i], NULL, producer, &indices[i]));
+    }
+    for (unsigned i = 0; i < readers; ++i) {
+        NON_ZERO_CHECK(pthread_create(&threads[producers + i], NULL, reader, NULL));
+    }
+    for (unsigned i = 0; i < producers; ++i) {
+        NON_ZERO_CHECK(pthread_join(threads[i], NULL));
+    }
+    ERROR_CHECK(clock_gettime(CLOCK_MONOTONIC, &end));
+    atomic_store(&done, true);
+    for (unsigned i = 0; i < readers; ++i) {
+        NON_ZERO_CHECK(pthread_join(threads[producers + i], NULL));
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double total = (double) messages * producers;
+    printf("producers: %u, readers: %u, shards: %u, messages: %.0f, seconds: %.3f, messages/s: %.0f, reads/s: %.0f\n",
+           producers, readers, shards, total, seconds, total / seconds, atomic_load(&reads) / seconds);
+
+    free(indices);
+    free(threads);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Implementation of id distributions shared by benchmarks.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#include "ids.h"
+#include "../src/error.h"
+
+#include <math.h>
+
+/**
+ * Generates pseudo-random number, xorshift64*.
+ * @param state[in,out] — non-zero generator state
+ * @return random number
+ */
+uint_least64_t random_next(uint_least64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1d;
+}
+
+/**
+ * Initializes distribution of ids.
+ * @param distribution[out] — distribution to initialize
+ * @param kind — kind of distribution
+ * @param cardinality — number of distinct ids, ignored by @ref IDS_SEQUENTIAL
+ * @param skew — exponent of @ref IDS_ZIPF
+ */
+void ids_init(struct id_distribution *distribution, enum id_kind kind, unsigned long cardinality, double skew) {
+    distribution->kind = kind;
+    distribution->cardinality = cardinality;
+    distribution->cdf = NULL;
+
+    if (kind == IDS_ZIPF) {
+        /* Rank r is drawn with probability proportional to 1 / r^skew */
+        NULL_CHECK(distribution->cdf = malloc(cardinality * sizeof(double)));
+        double sum = 0;
+        for (unsigned long rank = 0; rank < cardinality; ++rank)
+            distribution->cdf[rank] = sum += pow(rank + 1, -skew);
+        for (unsigned long rank = 0; rank < cardinality; ++rank)
+            distribution->cdf[rank] /= sum;
+    }
+}
+
+/**
+ * Frees distribution of ids.
+ * @param distribution — initialized distribution
+ */
+void ids_free(struct id_distribution *distribution) {
+    free(distribution->cdf);
+}
+
+/**
+ * Initializes generator of ids.
+ * @param generator[out] — generator to initialize
+ * @param distribution — distribution of generated ids
+ * @param seed — seed, different for every generator
+ */
+void id_generator_init(struct id_generator *generator, const struct id_distribution *distribution,
+                       uint_least64_t seed) {
+    generator->distribution = distribution;
+    generator->state = 0x853c49e6748fea9b * (seed + 1);
+    generator->sequence = 0;
+}
+
+/**
+ * Draws next id.
+ * @param generator[in,out] — generator
+ * @return id
+ */
+uint_least64_t id_next(struct id_generator *generator) {
+    const struct id_distribution *distribution = generator->distribution;
+    unsigned long rank;
+
+    switch (distribution->kind) {
+        case IDS_SEQUENTIAL:
+            return (generator->sequence++ / SEQUENTIAL_BLOCK) * 1000 + 1 +
+                   random_next(&generator->state) % SEQUENTIAL_SPREAD;
+
+        case IDS_UNIFORM:
+            rank = random_next(&generator->state) % distribution->cardinality;
+            break;
+
+        default: {
+            double u = (random_next(&generator->state) >> 11) * (1.0 / 9007199254740992.0);
+            unsigned long low = 0, high = distribution->cardinality - 1;
+            while (low < high) {
+                unsigned long middle = low + (high - low) / 2;
+                if (distribution->cdf[middle] < u)
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+            rank = low;
+        }
+    }
+
+    /* Spread popular ids over the whole key space */
+    return rank * 0x9e3779b97f4a7c15;
+}
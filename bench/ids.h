@@ -0,0 +1,81 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Interface of id distributions shared by benchmarks.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _IDS_H_
+#define _IDS_H_
+
+#include <stdint.h>
+
+/**
+ * Number of consecutive sequential ids sharing a base, and ids per base.
+ */
+#define SEQUENTIAL_BLOCK 1000
+#define SEQUENTIAL_SPREAD 5
+
+/**
+ * Kinds of id distributions.
+ */
+enum id_kind {
+    /** Like `test/generator.py` – a few ids around slowly growing base. */
+    IDS_SEQUENTIAL,
+    /** Uniform over @p cardinality ids, spread over 64 bit space. */
+    IDS_UNIFORM,
+    /** Zipf over @p cardinality ids, spread over 64 bit space. */
+    IDS_ZIPF
+};
+
+/**
+ * Distribution of ids, read only once initialized.
+ */
+struct id_distribution {
+    enum id_kind kind;
+    unsigned long cardinality;
+    /** Cumulative distribution of ranks of @ref IDS_ZIPF. */
+    double *cdf;
+};
+
+/**
+ * Per-thread generator of ids.
+ */
+struct id_generator {
+    const struct id_distribution *distribution;
+    uint_least64_t state;
+    uint_least64_t sequence;
+};
+
+uint_least64_t random_next(uint_least64_t *state);
+
+void ids_init(struct id_distribution *distribution, enum id_kind kind, unsigned long cardinality, double skew);
+
+void ids_free(struct id_distribution *distribution);
+
+void id_generator_init(struct id_generator *generator, const struct id_distribution *distribution,
+                       uint_least64_t seed);
+
+uint_least64_t id_next(struct id_generator *generator);
+
+#endif /* _IDS_H_ */
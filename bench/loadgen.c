@@ -0,0 +1,569 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Load generator – N connections streaming pre-encoded messages as fast as the server takes them.
+ * End-to-end latency is measured with probe ids, sent at a fixed rate over a separate connection
+ * and timed until they appear on server output, read from stdin, eg.
+ * `./aggregation-server -L | ./loadgen -l -c 8 -d 10`.
+ * Pre-encoded messages can also be written to capture files, for replay by the server,
+ * or sent over udp, in datagrams of whole messages.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _GNU_SOURCE
+
+#include "ids.h"
+#include "../src/protocol.h"
+#include "../src/aggregator.h"
+#include "../src/error.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Ids of probes have this bit set, workload ids never do.
+ */
+#define PROBE_ID_BIT ((uint_least64_t) 1 << 62)
+/**
+ * Size of single write of pre-encoded messages.
+ */
+#define WRITE_CHUNK (64 * 1024)
+/**
+ * Number of datagrams sent by a single @p sendmmsg.
+ */
+#define SEND_BATCH 32
+/**
+ * Minimal size of datagram, at least twice as large as any message.
+ */
+#define MIN_DATAGRAM_SIZE 64
+/**
+ * Time, for which probes sent before the end are awaited on output.
+ */
+#define GRACE_PERIOD_MS 1000
+
+/**
+ * Encodings of values.
+ */
+enum value_width {
+    WIDTH_FIXINT, WIDTH_UINT8, WIDTH_UINT16, WIDTH_UINT32, WIDTH_UINT64,
+    /** Every value in random one of the above. */
+    WIDTH_MIXED
+};
+
+/**
+ * Load generator configuration.
+ */
+static struct {
+    const char *host;
+    unsigned port;
+    unsigned connections;
+    unsigned duration_s;
+    /** Number of distinct workload ids. */
+    unsigned long cardinality;
+    /** Zipf exponent of id popularity, zero for uniform ids. */
+    double skew;
+    enum value_width width;
+    /** Size of pre-encoded messages of a connection. */
+    size_t buffer_size;
+    /** Number of values completing an aggregate, the same as the server's. */
+    unsigned threshold;
+    /** Whether latency is measured, reading server output from stdin. */
+    bool latency;
+    /** Probes per second. */
+    unsigned probe_rate;
+    /** Messages per second of all connections together, zero if unlimited. */
+    double rate;
+    /** Prefix of capture files, written instead of sending, @p NULL if messages are sent. */
+    const char *capture;
+    /** Max size of udp datagram, zero if messages are sent over tcp. */
+    size_t datagram_size;
+} config = {
+        .host = "127.0.0.1",
+        .port = 8080,
+        .connections = 4,
+        .duration_s = 10,
+        .cardinality = 1000000,
+        .skew = 0,
+        .width = WIDTH_MIXED,
+        .buffer_size = 4 * 1024 * 1024,
+        .threshold = DEFAULT_VALUES_THRESHOLD,
+        .latency = false,
+        .probe_rate = 1000,
+        .rate = 0,
+        .capture = NULL,
+        .datagram_size = 0
+};
+
+/**
+ * Distribution of workload ids.
+ */
+static struct id_distribution ids;
+
+/**
+ * Set once duration elapsed.
+ */
+static atomic_bool stopping;
+/**
+ * Number of messages sent by all connections.
+ */
+static atomic_ullong sent;
+
+/**
+ * Send times of probes in nanoseconds, indexed by probe number, and their latencies.
+ */
+static uint_least64_t *probe_sent, *probe_latency;
+static atomic_uint probes;
+static atomic_uint probes_received;
+
+/**
+ * Returns current time of monotonic clock.
+ * @return time in nanoseconds
+ */
+static uint_least64_t now_ns() {
+    struct timespec now;
+    ERROR_CHECK(clock_gettime(CLOCK_MONOTONIC, &now));
+    return (uint_least64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Encodes messagepack unsigned int in given width.
+ * @param output[out] — place for at least @ref MSGPACK_MAX_UINT_LENGTH bytes
+ * @param value — value, truncated to the width
+ * @param width — encoding, other than @ref WIDTH_MIXED
+ * @return number of written bytes
+ */
+static size_t encode_width(uint8_t *output, uint_least64_t value, enum value_width width) {
+    static const uint8_t headers[] = {0, MSGPACK_UINT8, MSGPACK_UINT16, MSGPACK_UINT32, MSGPACK_UINT64};
+    if (width == WIDTH_FIXINT) {
+        output[0] = value & 0x7f;
+        return 1;
+    }
+
+    size_t length = (size_t) 1 << (width - WIDTH_UINT8);
+    output[0] = headers[width];
+    for (size_t i = length; i > 0; --i, value >>= 8)
+        output[i] = (uint8_t) value;
+    return 1 + length;
+}
+
+/**
+ * Encodes single message.
+ * @param output[out] — place for at least 32 bytes
+ * @param id — id of message
+ * @param value — value of message
+ * @param width — encoding of value
+ * @return number of written bytes
+ */
+static size_t encode_message(uint8_t *output, uint_least64_t id, uint_least64_t value, enum value_width width) {
+    uint8_t *it = output;
+    *it++ = MSGPACK_FIXMAP | NO_KEYS;
+    it += encode_msgpack_key(it, ID_KEY_NAME, ID_KEY_NAME_LENGTH);
+    it += encode_msgpack_uint(it, id);
+    it += encode_msgpack_key(it, VALUE_KEY_NAME, VALUE_KEY_NAME_LENGTH);
+    it += encode_width(it, value, width);
+    return it - output;
+}
+
+/**
+ * Connects to the server, retrying for a while, so it may be started together with generator.
+ * Udp socket is only bound to the server address, as datagrams need no connection.
+ * @return connected socket
+ */
+static int connect_server() {
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(config.port)};
+    if (inet_pton(AF_INET, config.host, &address.sin_addr) != 1) {
+        fprintf(stderr, "Invalid host %s.\n", config.host);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int attempt = 0;; ++attempt) {
+        int sock;
+        ERROR_CHECK(sock = socket(AF_INET, config.datagram_size > 0 ? SOCK_DGRAM : SOCK_STREAM, 0));
+        if (connect(sock, (struct sockaddr *) &address, sizeof(address)) == 0) {
+            if (config.datagram_size > 0) return sock;
+            int enable = 1;
+            ERROR_CHECK(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)));
+            return sock;
+        }
+        ERROR_CHECK(close(sock));
+        if (attempt == 50) {
+            ERROR("connect")
+        }
+        nanosleep(&(struct timespec) {.tv_nsec = 100000000}, NULL);
+    }
+}
+
+/**
+ * Writes whole buffer to a socket.
+ * @param sock — socket to write to
+ * @param buffer — bytes to write
+ * @param size — number of bytes
+ */
+static void send_all(int sock, const uint8_t *buffer, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(sock, buffer, size);
+        if (written < 0 && errno == EINTR) continue;
+        ERROR_CHECK(written);
+        buffer += written;
+        size -= written;
+    }
+}
+
+/**
+ * Sends non-empty chunks as datagrams, by as few @p sendmmsg as possible.
+ * Datagrams refused while server is not listening yet are sent again.
+ * @param sock — udp socket connected to the server
+ * @param buffer — pre-encoded messages
+ * @param chunk_end — end offsets of chunks
+ * @param first — index of the first chunk to send
+ * @param last — index past the last chunk, at most @ref SEND_BATCH after @p first
+ */
+static void send_datagrams(int sock, uint8_t *buffer, const size_t *chunk_end, size_t first, size_t last) {
+    struct mmsghdr headers[SEND_BATCH];
+    struct iovec iov[SEND_BATCH];
+    unsigned count = 0;
+    for (size_t chunk = first; chunk < last; ++chunk) {
+        size_t begin = chunk == 0 ? 0 : chunk_end[chunk - 1];
+        if (chunk_end[chunk] == begin) continue;
+        iov[count] = (struct iovec) {.iov_base = buffer + begin, .iov_len = chunk_end[chunk] - begin};
+        headers[count] = (struct mmsghdr) {.msg_hdr = {.msg_iov = &iov[count], .msg_iovlen = 1}};
+        ++count;
+    }
+
+    for (unsigned done = 0; done < count;) {
+        int result = sendmmsg(sock, headers + done, count - done, 0);
+        if (result < 0 && (errno == EINTR || errno == ECONNREFUSED)) continue;
+        ERROR_CHECK(result);
+        done += result;
+    }
+}
+
+/**
+ * Streams pre-encoded messages over one connection until duration elapses.
+ * Buffer is cut into chunks at message boundaries, so every write sends whole messages.
+ * Over udp every chunk is a datagram, of at most @ref datagram_size bytes.
+ * @param index_ptr — pointer to index of connection
+ * @return @p NULL
+ */
+static void *connection_thread(void *index_ptr) {
+    struct id_generator generator;
+    id_generator_init(&generator, &ids, *(unsigned *) index_ptr);
+    uint_least64_t state = generator.state;
+    /* Datagram is at least half full, being at least twice as large as any message */
+    size_t chunks = config.buffer_size / (config.datagram_size > 0 ? config.datagram_size / 2 : WRITE_CHUNK) + 1;
+    uint8_t *buffer;
+    size_t *chunk_end, *chunk_messages;
+    NULL_CHECK(buffer = malloc(config.buffer_size + WRITE_CHUNK));
+    NULL_CHECK(chunk_end = calloc(chunks, sizeof(size_t)));
+    NULL_CHECK(chunk_messages = calloc(chunks, sizeof(size_t)));
+
+    /* Pre-encode, so sending costs nothing but syscalls */
+    size_t size = 0;
+    for (size_t chunk = 0; chunk < chunks; ++chunk) {
+        size_t limit = config.datagram_size > 0 ? size + config.datagram_size : (chunk + 1) * WRITE_CHUNK;
+        while (size < limit && size < config.buffer_size) {
+            enum value_width width = config.width == WIDTH_MIXED ? random_next(&state) % WIDTH_MIXED : config.width;
+            size_t length = encode_message(buffer + size, id_next(&generator) & (PROBE_ID_BIT - 1),
+                                           random_next(&state), width);
+            /* Datagram ends before the first message, which would not fit */
+            if (config.datagram_size > 0 && size + length > limit) break;
+            size += length;
+            ++chunk_messages[chunk];
+        }
+        chunk_end[chunk] = size;
+    }
+
+    /* Capture file holds what the connection sends in one pass over the buffer */
+    if (config.capture != NULL) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s.%u", config.capture, *(unsigned *) index_ptr);
+        int fd;
+        ERROR_CHECK(fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        send_all(fd, buffer, size);
+        ERROR_CHECK(close(fd));
+        for (size_t chunk = 0; chunk < chunks; ++chunk)
+            atomic_fetch_add_explicit(&sent, chunk_messages[chunk], memory_order_relaxed);
+        free(chunk_messages);
+        free(chunk_end);
+        free(buffer);
+        return NULL;
+    }
+
+    int sock = connect_server();
+    uint_least64_t start = now_ns(), own_sent = 0;
+    size_t step = config.datagram_size > 0 ? SEND_BATCH : 1;
+    while (!atomic_load_explicit(&stopping, memory_order_relaxed)) {
+        for (size_t chunk = 0; chunk < chunks && !atomic_load_explicit(&stopping, memory_order_relaxed); chunk += step) {
+            size_t last = chunk + step < chunks ? chunk + step : chunks, messages = 0;
+            size_t begin = chunk == 0 ? 0 : chunk_end[chunk - 1];
+            if (config.datagram_size > 0)
+                send_datagrams(sock, buffer, chunk_end, chunk, last);
+            else
+                send_all(sock, buffer + begin, chunk_end[chunk] - begin);
+            for (size_t sent_chunk = chunk; sent_chunk < last; ++sent_chunk)
+                messages += chunk_messages[sent_chunk];
+            atomic_fetch_add_explicit(&sent, messages, memory_order_relaxed);
+            own_sent += messages;
+
+            /* With limited rate, wait until sent messages are due */
+            if (config.rate > 0) {
+                uint_least64_t due = start + (uint_least64_t) (own_sent * 1e9 * config.connections / config.rate);
+                for (uint_least64_t now; (now = now_ns()) < due;)
+                    nanosleep(&(struct timespec) {.tv_sec = (time_t) ((due - now) / 1000000000),
+                                                  .tv_nsec = (long) ((due - now) % 1000000000)}, NULL);
+            }
+        }
+    }
+
+    ERROR_CHECK(close(sock));
+    free(chunk_messages);
+    free(chunk_end);
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Sends complete aggregates of probe ids at @ref probe_rate, recording send times.
+ * @param unused — unused
+ * @return @p NULL
+ */
+static void *probe_thread(void *unused) {
+    (void) unused;
+    int sock = connect_server();
+    uint_least64_t interval = 1000000000 / config.probe_rate, next = now_ns();
+    unsigned limit = config.probe_rate * config.duration_s;
+
+    for (unsigned probe = 0; probe < limit && !atomic_load(&stopping); ++probe) {
+        uint8_t message[32 * MAX_VALUES_THRESHOLD];
+        size_t size = 0;
+        for (unsigned i = 0; i < config.threshold; ++i)
+            size += encode_message(message + size, PROBE_ID_BIT | probe, i, WIDTH_FIXINT);
+
+        next += interval;
+        for (uint_least64_t now; (now = now_ns()) < next;)
+            nanosleep(&(struct timespec) {.tv_nsec = (long) (next - now)}, NULL);
+        probe_sent[probe] = now_ns();
+        atomic_store(&probes, probe + 1);
+        send_all(sock, message, size);
+    }
+
+    ERROR_CHECK(close(sock));
+    return NULL;
+}
+
+/**
+ * Reads server output from stdin, times probes appearing on it.
+ * Text output lines start with `id: X`, other lines are skipped.
+ * @param unused — unused
+ * @return @p NULL at the end of input
+ */
+static void *output_reader_thread(void *unused) {
+    (void) unused;
+    char line[4096];
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        if (strncmp(line, "id: ", 4) != 0)
+            continue;
+        uint_least64_t id = strtoull(line + 4, NULL, 10);
+        if (!(id & PROBE_ID_BIT))
+            continue;
+        uint_least64_t now = now_ns();
+        unsigned probe = (unsigned) (id & ~PROBE_ID_BIT);
+        if (probe < atomic_load(&probes)) {
+            probe_latency[probe] = now - probe_sent[probe];
+            atomic_fetch_add(&probes_received, 1);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Compares latencies, for qsort.
+ */
+static int compare_u64(const void *a, const void *b) {
+    uint_least64_t x = *(const uint_least64_t *) a, y = *(const uint_least64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Prints latency percentiles of received probes.
+ */
+static void print_latency() {
+    unsigned total = atomic_load(&probes), received = 0;
+    uint_least64_t *latencies;
+    NULL_CHECK(latencies = malloc((total + 1) * sizeof(uint_least64_t)));
+    for (unsigned i = 0; i < total; ++i)
+        if (probe_latency[i] != 0)
+            latencies[received++] = probe_latency[i];
+    qsort(latencies, received, sizeof(uint_least64_t), compare_u64);
+
+    printf("probes: %u, lost: %u", total, total - received);
+    if (received > 0) {
+        static const double percentiles[] = {50, 90, 99, 99.9};
+        for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i)
+            printf(", p%g: %.1f us", percentiles[i],
+                   latencies[(size_t) ceil(percentiles[i] / 100 * received) - 1] / 1e3);
+        printf(", max: %.1f us", latencies[received - 1] / 1e3);
+    }
+    printf("\n");
+    free(latencies);
+}
+
+/**
+ * Prints usage information and terminates.
+ * @param name — program name
+ */
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-H host] [-p port] [-c connections] [-d seconds] [-k ids] [-z skew]\n"
+            "          [-v fixint|u8|u16|u32|u64|mixed] [-B bytes] [-R messages] [-n values] [-l] [-r probes]\n"
+            "          [-o prefix] [-u bytes]\n"
+            "  -c  number of connections (default: %u)\n"
+            "  -d  duration of the run in seconds (default: %u)\n"
+            "  -k  number of distinct ids (default: %lu)\n"
+            "  -z  zipf exponent of id popularity, 0 for uniform ids (default: 0)\n"
+            "  -v  encoding of values (default: mixed)\n"
+            "  -B  size of pre-encoded messages per connection (default: %zu)\n"
+            "  -R  messages per second of all connections, sent in chunks of %d bytes (default: unlimited)\n"
+            "  -n  number of values completing an aggregate, as set on the server (default: %u)\n"
+            "  -l  measure latency, reading server text output from stdin\n"
+            "  -r  latency probes per second (default: %u)\n"
+            "  -o  write pre-encoded messages of every connection to file prefix.N instead of sending\n"
+            "  -u  send over udp, in datagrams of at most given size, at least %d bytes;\n"
+            "      lost datagrams are counted as sent\n",
+            name, config.connections, config.duration_s, config.cardinality, config.buffer_size,
+            WRITE_CHUNK, config.threshold, config.probe_rate, MIN_DATAGRAM_SIZE);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Runs load generator, prints sustained throughput and latency.
+ * @param argc — number of arguments
+ * @param argv — arguments, see @ref usage
+ * @return @p EXIT_SUCCESS
+ */
+int main(int argc, char *argv[]) {
+    static const char *widths[] = {"fixint", "u8", "u16", "u32", "u64", "mixed"};
+    for (int opt; (opt = getopt(argc, argv, "H:p:c:d:k:z:v:B:R:n:lr:o:u:")) != -1;) {
+        switch (opt) {
+            case 'H': config.host = optarg; break;
+            case 'p': config.port = strtoul(optarg, NULL, 10); break;
+            case 'c': config.connections = strtoul(optarg, NULL, 10); break;
+            case 'd': config.duration_s = strtoul(optarg, NULL, 10); break;
+            case 'k': config.cardinality = strtoul(optarg, NULL, 10); break;
+            case 'z': config.skew = strtod(optarg, NULL); break;
+            case 'v': {
+                size_t i;
+                for (i = 0; i < sizeof(widths) / sizeof(widths[0]) && strcmp(optarg, widths[i]) != 0; ++i);
+                if (i == sizeof(widths) / sizeof(widths[0])) usage(argv[0]);
+                config.width = (enum value_width) i;
+                break;
+            }
+            case 'B': config.buffer_size = strtoul(optarg, NULL, 10); break;
+            case 'R': config.rate = strtod(optarg, NULL); break;
+            case 'n': config.threshold = strtoul(optarg, NULL, 10); break;
+            case 'l': config.latency = true; break;
+            case 'r': config.probe_rate = strtoul(optarg, NULL, 10); break;
+            case 'o': config.capture = optarg; break;
+            case 'u': config.datagram_size = strtoul(optarg, NULL, 10); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (config.connections == 0 || config.duration_s == 0 || config.cardinality == 0 || config.skew < 0 || config.rate < 0 ||
+        config.buffer_size == 0 || config.threshold == 0 || config.threshold > MAX_VALUES_THRESHOLD ||
+        config.probe_rate == 0 || config.probe_rate > 1000000 ||
+        (config.datagram_size > 0 && config.datagram_size < MIN_DATAGRAM_SIZE))
+        usage(argv[0]);
+
+    ids_init(&ids, config.skew > 0 ? IDS_ZIPF : IDS_UNIFORM, config.cardinality, config.skew);
+    atomic_init(&stopping, false);
+    atomic_init(&sent, 0);
+    atomic_init(&probes, 0);
+    atomic_init(&probes_received, 0);
+
+    pthread_t *threads, probe, reader;
+    unsigned *indices;
+    NULL_CHECK(threads = calloc(config.connections, sizeof(pthread_t)));
+    NULL_CHECK(indices = calloc(config.connections, sizeof(unsigned)));
+    if (config.latency && config.capture == NULL) {
+        NULL_CHECK(probe_sent = calloc((size_t) config.probe_rate * config.duration_s, sizeof(uint_least64_t)));
+        NULL_CHECK(probe_latency = calloc((size_t) config.probe_rate * config.duration_s, sizeof(uint_least64_t)));
+        NON_ZERO_CHECK(pthread_create(&reader, NULL, output_reader_thread, NULL));
+        NON_ZERO_CHECK(pthread_detach(reader));
+        NON_ZERO_CHECK(pthread_create(&probe, NULL, probe_thread, NULL));
+    }
+    for (unsigned i = 0; i < config.connections; ++i) {
+        indices[i] = i;
+        NON_ZERO_CHECK(pthread_create(&threads[i], NULL, connection_thread, &indices[i]));
+    }
+
+    if (config.capture != NULL) {
+        for (unsigned i = 0; i < config.connections; ++i) {
+            NON_ZERO_CHECK(pthread_join(threads[i], NULL));
+        }
+        printf("captures: %u, ids: %lu, skew: %g, values: %s, messages: %llu\n", config.connections,
+               config.cardinality, config.skew, widths[config.width], (unsigned long long) atomic_load(&sent));
+        ids_free(&ids);
+        free(indices);
+        free(threads);
+        return EXIT_SUCCESS;
+    }
+
+    /* Measure after the first second, once connections are established */
+    sleep(1);
+    uint_least64_t start = now_ns();
+    unsigned long long start_sent = atomic_load(&sent);
+    sleep(config.duration_s);
+    unsigned long long total = atomic_load(&sent) - start_sent;
+    double seconds = (now_ns() - start) / 1e9;
+    atomic_store(&stopping, true);
+
+    for (unsigned i = 0; i < config.connections; ++i) {
+        NON_ZERO_CHECK(pthread_join(threads[i], NULL));
+    }
+    printf("connections: %u, ids: %lu, skew: %g, values: %s, messages: %llu, seconds: %.3f, messages/s: %.0f\n",
+           config.connections, config.cardinality, config.skew, widths[config.width], total, seconds,
+           total / seconds);
+
+    if (config.latency) {
+        NON_ZERO_CHECK(pthread_join(probe, NULL));
+        /* Wait for probes still in flight */
+        uint_least64_t deadline = now_ns() + (uint_least64_t) GRACE_PERIOD_MS * 1000000;
+        while (atomic_load(&probes_received) < atomic_load(&probes) && now_ns() < deadline)
+            nanosleep(&(struct timespec) {.tv_nsec = 10000000}, NULL);
+        print_latency();
+    }
+
+    ids_free(&ids);
+    free(indices);
+    free(threads);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,395 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Microbenchmarks of hot paths – hashing, hashtable operations and message decoding,
+ * over sequential, uniform and Zipf distributed ids, and of every decoding kernel over int widths.
+ * Every result is printed as a single line JSON object, for tracking regressions.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "ids.h"
+#include "../src/hashtable.h"
+#include "../src/aggregator.h"
+#include "../src/protocol.h"
+#include "../src/pool.h"
+#include "../src/latency.h"
+#include "../src/error.h"
+
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Default number of distinct uniform and Zipf ids.
+ */
+#define DEFAULT_CARDINALITY 1000000
+/**
+ * Exponent of Zipf distribution.
+ */
+#define ZIPF_SKEW 1.1
+/**
+ * Chunk size of resumable decoding, as if messages arrived in small reads.
+ */
+#define DECODE_CHUNK 37
+
+/**
+ * Benchmark configuration.
+ */
+static unsigned long operations = 10000000, cardinality = DEFAULT_CARDINALITY;
+static unsigned repetitions = 3;
+
+/**
+ * Names of distributions, indexed by @ref id_kind.
+ */
+static const char *const distribution_names[] = {"sequential", "uniform", "zipf"};
+
+/**
+ * Names of decoding kernels, indexed by @ref decode_kernel.
+ */
+static const char *const kernel_names[] = {"scalar", "sse2", "avx2"};
+
+/**
+ * Encodings of ids and values, as `-v` of load generator, the last one picks one of others at random.
+ */
+static const char *const width_names[] = {"fixint", "u8", "u16", "u32", "u64", "mixed"};
+#define WIDTHS_MIXED 5
+
+/**
+ * Sink for results, so computations are not optimized out.
+ */
+static volatile uint_least64_t sink;
+
+/**
+ * Returns current time of monotonic clock.
+ * @return time in seconds
+ */
+static double now() {
+    struct timespec now;
+    ERROR_CHECK(clock_gettime(CLOCK_MONOTONIC, &now));
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Prints result of a benchmark, the best of repetitions.
+ * @param name — name of benchmark
+ * @param distribution — kind of ids
+ * @param ops — number of operations per repetition
+ * @param bytes — number of processed bytes per repetition, zero if not applicable
+ * @param seconds — the shortest time of repetition
+ */
+static void report(const char *name, enum id_kind distribution, unsigned long ops, size_t bytes, double seconds) {
+    printf("{\"benchmark\": \"%s\", \"ids\": \"%s\", \"operations\": %lu, \"seconds\": %.6f, "
+           "\"ns_per_op\": %.2f, \"ops_per_s\": %.0f",
+           name, distribution_names[distribution], ops, seconds, seconds * 1e9 / ops, ops / seconds);
+    if (bytes > 0)
+        printf(", \"bytes\": %zu, \"gb_per_s\": %.3f", bytes, bytes / seconds / 1e9);
+    printf("}\n");
+    fflush(stdout);
+}
+
+/**
+ * Generates ids of a distribution.
+ * @param kind — kind of distribution
+ * @return array of @ref operations ids
+ */
+static uint_least64_t *generate_ids(enum id_kind kind) {
+    struct id_distribution distribution;
+    struct id_generator generator;
+    uint_least64_t *ids;
+    ids_init(&distribution, kind, cardinality, ZIPF_SKEW);
+    id_generator_init(&generator, &distribution, 0);
+    NULL_CHECK(ids = malloc(operations * sizeof(uint_least64_t)));
+    for (unsigned long i = 0; i < operations; ++i)
+        ids[i] = id_next(&generator);
+    ids_free(&distribution);
+    return ids;
+}
+
+/**
+ * Measures hashing and shard selection.
+ * @param kind — kind of ids
+ * @param ids — ids to hash
+ */
+static void bench_hash(enum id_kind kind, const uint_least64_t *ids) {
+    double best = 1e9;
+    for (unsigned repetition = 0; repetition < repetitions; ++repetition) {
+        uintptr_t sum = 0;
+        double start = now();
+        for (unsigned long i = 0; i < operations; ++i)
+            sum += (uintptr_t) hashtable_shard(ids[i]);
+        double seconds = now() - start;
+        sink = sum;
+        if (seconds < best) best = seconds;
+    }
+    report("hashtable_shard", kind, operations, 0, best);
+}
+
+/**
+ * Measures aggregation pattern – @ref hashtable_get, appending value,
+ * @ref hashtable_remove once entry is complete – without locking.
+ * Every repetition starts with an empty hashtable.
+ * @param kind — kind of ids
+ * @param ids — ids of messages
+ * @param timed — whether every complete entry reads the clock and records its latencies, as with `-t`
+ */
+static void bench_aggregate(enum id_kind kind, const uint_least64_t *ids, bool timed) {
+    double best = 1e9;
+    latency_received = latency_now();
+    for (unsigned repetition = 0; repetition < repetitions; ++repetition) {
+        init_hashtable(DEFAULT_SHARDS, DEFAULT_VALUES_THRESHOLD, 0, NULL);
+        double start = now();
+        for (unsigned long i = 0; i < operations; ++i) {
+            struct hashtable_shard *shard = hashtable_shard(ids[i]);
+            struct entry_t *entry;
+            NULL_CHECK(entry = hashtable_get(shard, ids[i]));
+            entry->payload[entry->count++] = i;
+            if (entry->count == DEFAULT_VALUES_THRESHOLD) {
+                hashtable_remove(shard, ids[i]);
+                if (timed) {
+                    uint_least64_t updated = latency_now();
+                    latency_record(LATENCY_UPDATE, updated - latency_received);
+                    latency_record(LATENCY_WRITE, updated - latency_received);
+                    latency_record(LATENCY_TOTAL, updated - latency_received);
+                }
+            }
+        }
+        double seconds = now() - start;
+        if (seconds < best) best = seconds;
+    }
+    report(timed ? "hashtable_aggregate_timed" : "hashtable_aggregate", kind, operations, 0, best);
+}
+
+/**
+ * Measures lookups of present ids – every id is inserted first, then looked up again.
+ * @param kind — kind of ids
+ * @param ids — ids to look up
+ */
+static void bench_lookup(enum id_kind kind, const uint_least64_t *ids) {
+    init_hashtable(DEFAULT_SHARDS, DEFAULT_VALUES_THRESHOLD, 0, NULL);
+    for (unsigned long i = 0; i < operations; ++i) {
+        NULL_CHECK(hashtable_get(hashtable_shard(ids[i]), ids[i]));
+    }
+
+    double best = 1e9;
+    for (unsigned repetition = 0; repetition < repetitions; ++repetition) {
+        uint_least64_t sum = 0;
+        double start = now();
+        for (unsigned long i = 0; i < operations; ++i)
+            sum += hashtable_get(hashtable_shard(ids[i]), ids[i])->count;
+        double seconds = now() - start;
+        sink = sum;
+        if (seconds < best) best = seconds;
+    }
+    report("hashtable_lookup", kind, operations, 0, best);
+}
+
+/**
+ * Encodes messages with values of mixed int widths, from fixint to uint64.
+ * @param ids — ids of messages
+ * @param size[out] — size of encoded messages
+ * @return buffer of @ref operations messages
+ */
+static uint8_t *encode_messages(const uint_least64_t *ids, size_t *size) {
+    static const uint_least64_t widths[] = {0x7f, 0xff, 0xffff, 0xffffffff, UINT64_MAX};
+    uint8_t *buffer;
+    uint_least64_t state = 1;
+    NULL_CHECK(buffer = malloc(operations * (1 + 3 + 2 * MSGPACK_MAX_UINT_LENGTH + 6)));
+
+    uint8_t *it = buffer;
+    for (unsigned long i = 0; i < operations; ++i) {
+        uint_least64_t value = random_next(&state);
+        *it++ = MSGPACK_FIXMAP | NO_KEYS;
+        it += encode_msgpack_key(it, ID_KEY_NAME, ID_KEY_NAME_LENGTH);
+        it += encode_msgpack_uint(it, ids[i]);
+        it += encode_msgpack_key(it, VALUE_KEY_NAME, VALUE_KEY_NAME_LENGTH);
+        it += encode_msgpack_uint(it, value & widths[i % 5]);
+    }
+    *size = it - buffer;
+    return buffer;
+}
+
+/**
+ * Measures decoding of in-memory buffer, whole at once and in small chunks.
+ * @param kind — kind of ids
+ * @param ids — ids of messages
+ */
+static void bench_decode(enum id_kind kind, const uint_least64_t *ids) {
+    size_t size;
+    uint8_t *buffer = encode_messages(ids, &size);
+
+    for (int chunked = 0; chunked < 2; ++chunked) {
+        double best = 1e9;
+        for (unsigned repetition = 0; repetition < repetitions; ++repetition) {
+            struct decoder decoder;
+            struct message messages[MESSAGES_BATCH];
+            uint_least64_t sum = 0;
+            unsigned long decoded = 0;
+            decoder_init(&decoder);
+
+            double start = now();
+            for (size_t begin = 0; begin < size;) {
+                size_t end = chunked && size - begin > DECODE_CHUNK ? begin + DECODE_CHUNK : size;
+                while (begin < end) {
+                    size_t count;
+                    begin += decode_messages(&decoder, buffer + begin, end - begin, messages, MESSAGES_BATCH, &count);
+                    for (size_t i = 0; i < count; ++i)
+                        sum += messages[i].value;
+                    decoded += count;
+                }
+            }
+            double seconds = now() - start;
+            sink = sum;
+
+            if (decoder_failed(&decoder) || decoded != operations) {
+                fprintf(stderr, "Decoded %lu of %lu messages.\n", decoded, operations);
+                exit(EXIT_FAILURE);
+            }
+            if (seconds < best) best = seconds;
+        }
+        report(chunked ? "decode_chunked" : "decode", kind, operations, size, best);
+    }
+    free(buffer);
+}
+
+/**
+ * Draws unsigned int, which shortest messagepack encoding has given width.
+ * @param state — state of random generator
+ * @param width — index of @ref width_names, other than @ref WIDTHS_MIXED
+ * @return drawn int
+ */
+static uint_least64_t random_width(uint_least64_t *state, unsigned width) {
+    static const uint_least64_t masks[] = {0x7f, 0xff, 0xffff, 0xffffffff, UINT64_MAX};
+    static const uint_least64_t lowest[] = {0, 0x80, 0x100, 0x10000, 0x100000000};
+    return (random_next(state) & masks[width]) | lowest[width];
+}
+
+/**
+ * Measures every supported decoding kernel over whole buffer of messages,
+ * with ids and values of every width, or of widths mixed at random.
+ */
+static void bench_kernels() {
+    uint8_t *buffer;
+    NULL_CHECK(buffer = malloc(operations * (1 + 3 + 2 * MSGPACK_MAX_UINT_LENGTH + 6)));
+
+    for (unsigned width = 0; width <= WIDTHS_MIXED; ++width) {
+        uint_least64_t state = 1;
+        uint8_t *it = buffer;
+        for (unsigned long i = 0; i < operations; ++i) {
+            unsigned id_width = width == WIDTHS_MIXED ? random_next(&state) % WIDTHS_MIXED : width;
+            unsigned value_width = width == WIDTHS_MIXED ? random_next(&state) % WIDTHS_MIXED : width;
+            *it++ = MSGPACK_FIXMAP | NO_KEYS;
+            it += encode_msgpack_key(it, ID_KEY_NAME, ID_KEY_NAME_LENGTH);
+            it += encode_msgpack_uint(it, random_width(&state, id_width));
+            it += encode_msgpack_key(it, VALUE_KEY_NAME, VALUE_KEY_NAME_LENGTH);
+            it += encode_msgpack_uint(it, random_width(&state, value_width));
+        }
+        size_t size = it - buffer;
+
+        uint_least64_t expected = 0;
+        for (enum decode_kernel kernel = DECODE_SCALAR; kernel <= DECODE_AVX2; ++kernel) {
+            if (!decode_kernel_supported(kernel)) continue;
+            decode_kernel_select(kernel);
+
+            double best = 1e9;
+            uint_least64_t sum = 0;
+            for (unsigned repetition = 0; repetition < repetitions; ++repetition) {
+                struct decoder decoder;
+                struct message messages[MESSAGES_BATCH];
+                unsigned long decoded = 0;
+                sum = 0;
+                decoder_init(&decoder);
+
+                double start = now();
+                for (size_t begin = 0; begin < size;) {
+                    size_t count;
+                    begin += decode_messages(&decoder, buffer + begin, size - begin, messages, MESSAGES_BATCH, &count);
+                    for (size_t i = 0; i < count; ++i)
+                        sum += messages[i].id ^ messages[i].value;
+                    decoded += count;
+                }
+                double seconds = now() - start;
+
+                if (decoder_failed(&decoder) || decoded != operations) {
+                    fprintf(stderr, "Decoded %lu of %lu messages.\n", decoded, operations);
+                    exit(EXIT_FAILURE);
+                }
+                if (seconds < best) best = seconds;
+            }
+            /* Every kernel has to decode the same messages */
+            if (kernel == DECODE_SCALAR) expected = sum;
+            if (sum != expected) {
+                fprintf(stderr, "Kernel %s decoded other messages.\n", kernel_names[kernel]);
+                exit(EXIT_FAILURE);
+            }
+            sink = sum;
+
+            char name[64];
+            snprintf(name, sizeof(name), "decode_%s_%s", kernel_names[kernel], width_names[width]);
+            report(name, IDS_UNIFORM, operations, size, best);
+        }
+    }
+    free(buffer);
+}
+
+/**
+ * Runs every microbenchmark for every distribution of ids.
+ * @param argc — number of arguments
+ * @param argv — `-n operations -k ids -r repetitions`
+ * @return @p EXIT_SUCCESS
+ */
+int main(int argc, char *argv[]) {
+    for (int opt; (opt = getopt(argc, argv, "n:k:r:")) != -1;) {
+        switch (opt) {
+            case 'n':
+                operations = strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                cardinality = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                repetitions = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n operations] [-k ids] [-r repetitions]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (operations == 0 || cardinality == 0 || repetitions == 0) {
+        fprintf(stderr, "Invalid configuration.\n");
+        return EXIT_FAILURE;
+    }
+    init_arenas(HUGEPAGES_OFF);
+
+    for (enum id_kind kind = IDS_SEQUENTIAL; kind <= IDS_ZIPF; ++kind) {
+        uint_least64_t *ids = generate_ids(kind);
+        bench_hash(kind, ids);
+        bench_aggregate(kind, ids, false);
+        bench_aggregate(kind, ids, true);
+        bench_lookup(kind, ids);
+        bench_decode(kind, ids);
+        free(ids);
+    }
+    bench_kernels();
+    return EXIT_SUCCESS;
+}
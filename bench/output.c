@@ -0,0 +1,215 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Output format benchmark – formatting of aggregates by the server
+ * and parsing them back by a consumer, text lines against messagepack records.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#include "../src/output.h"
+#include "../src/protocol.h"
+#include "../src/error.h"
+
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Number of distinct records, formatted over and over.
+ */
+#define RECORDS 4096
+/**
+ * Size of record with default number of raw values.
+ */
+#define RECORD_SIZE (sizeof(struct output_record) + DEFAULT_VALUES_THRESHOLD * sizeof(uint_least64_t))
+
+/**
+ * Finds record in an array of records of @ref RECORD_SIZE.
+ * @param records — array of records
+ * @param index — index of record
+ * @return record of given index
+ */
+static struct output_record *record_at(void *records, int index) {
+    return (struct output_record *) ((char *) records + index * RECORD_SIZE);
+}
+
+/**
+ * Returns current time of monotonic clock.
+ * @return time in seconds
+ */
+static double now() {
+    struct timespec now;
+    ERROR_CHECK(clock_gettime(CLOCK_MONOTONIC, &now));
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Generates value with random number of significant bytes, like mixed int widths on input.
+ * @return random value
+ */
+static uint_least64_t random_value() {
+    uint_least64_t value = ((uint_least64_t) rand() << 42) ^ ((uint_least64_t) rand() << 21) ^ rand();
+    static const int bits[] = {7, 8, 16, 32, 64};
+    int width = bits[rand() % 5];
+    return width == 64 ? value : value & (((uint_least64_t) 1 << width) - 1);
+}
+
+/**
+ * Parses text line, as a consumer of text output would.
+ * @param line — beginning of line
+ * @param record[out] — parsed aggregate
+ * @return beginning of next line
+ */
+static const char *parse_text(const char *line, struct output_record *record) {
+    char *end;
+    record->id = strtoull(line + 4, &end, 10);
+    end += 10;
+    for (int i = 0; i < DEFAULT_VALUES_THRESHOLD; ++i) {
+        record->payload[i] = strtoull(end, &end, 10);
+        end += i + 1 < DEFAULT_VALUES_THRESHOLD ? 2 : 1;
+    }
+    return end;
+}
+
+/**
+ * Parses messagepack unsigned int.
+ * @param it — int header
+ * @param value[out] — parsed value
+ * @return byte following the int
+ */
+static const uint8_t *parse_uint(const uint8_t *it, uint_least64_t *value) {
+    int length;
+    switch (*it) {
+        case MSGPACK_UINT8: length = 1; break;
+        case MSGPACK_UINT16: length = 2; break;
+        case MSGPACK_UINT32: length = 4; break;
+        case MSGPACK_UINT64: length = 8; break;
+        default:
+            *value = *it;
+            return it + 1;
+    }
+    *value = 0;
+    for (int i = 1; i <= length; ++i)
+        *value = (*value << 8) | it[i];
+    return it + 1 + length;
+}
+
+/**
+ * Parses messagepack record, as a consumer of binary output would.
+ * @param data — beginning of record
+ * @param record[out] — parsed aggregate
+ * @return beginning of next record
+ */
+static const char *parse_msgpack(const char *data, struct output_record *record) {
+    const uint8_t *it = (const uint8_t *) data + 1 + 1 + ID_KEY_NAME_LENGTH;
+    it = parse_uint(it, &record->id);
+    it += 1 + VALUES_KEY_NAME_LENGTH + 1;
+    for (int i = 0; i < DEFAULT_VALUES_THRESHOLD; ++i)
+        it = parse_uint(it, &record->payload[i]);
+    return (const char *) it;
+}
+
+/**
+ * Measures formatting and parsing of one format.
+ * @param name — name of format
+ * @param records — records to format
+ * @param rounds — number of times every record is formatted
+ * @param format — formatter
+ * @param parse — parser
+ */
+static void measure(const char *name, void *records, unsigned rounds,
+                    size_t (*format)(char *, const struct output_record *),
+                    const char *(*parse)(const char *, struct output_record *)) {
+    char *buffer;
+    NULL_CHECK(buffer = malloc(RECORDS * MAX_RECORD_LENGTH));
+
+    size_t size = 0;
+    double start = now();
+    for (unsigned round = 0; round < rounds; ++round) {
+        size = 0;
+        for (int i = 0; i < RECORDS; ++i)
+            size += format(buffer + size, record_at(records, i));
+    }
+    double formatting = now() - start;
+
+    /* Parse and verify */
+    uint_least64_t checksum = 0;
+    start = now();
+    for (unsigned round = 0; round < rounds; ++round) {
+        const char *it = buffer;
+        for (int i = 0; i < RECORDS; ++i) {
+            _Alignas(struct output_record) char parsed[RECORD_SIZE];
+            it = parse(it, (struct output_record *) parsed);
+            checksum += ((struct output_record *) parsed)->id +
+                        ((struct output_record *) parsed)->payload[DEFAULT_VALUES_THRESHOLD - 1];
+        }
+    }
+    double parsing = now() - start;
+
+    uint_least64_t expected = 0;
+    for (int i = 0; i < RECORDS; ++i)
+        expected += record_at(records, i)->id + record_at(records, i)->payload[DEFAULT_VALUES_THRESHOLD - 1];
+    if (checksum != expected * rounds) {
+        fprintf(stderr, "%s: parsed records differ from formatted ones.\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    double total = (double) RECORDS * rounds;
+    printf("format: %s, bytes/record: %.1f, format records/s: %.0f, format MB/s: %.1f, parse records/s: %.0f\n",
+           name, (double) size / RECORDS, total / formatting, size * (double) rounds / formatting / 1e6,
+           total / parsing);
+    free(buffer);
+}
+
+/**
+ * Runs benchmark for every output format.
+ * @param argc — number of arguments
+ * @param argv — `-n rounds`
+ * @return @p EXIT_SUCCESS
+ */
+int main(int argc, char *argv[]) {
+    unsigned rounds = 1000;
+    for (int opt; (opt = getopt(argc, argv, "n:")) != -1;) {
+        if (opt != 'n') {
+            fprintf(stderr, "Usage: %s [-n rounds]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        rounds = strtoul(optarg, NULL, 10);
+    }
+
+    /* Formatters see default aggregation policy, raw values */
+    void *records;
+    NULL_CHECK(records = calloc(RECORDS, RECORD_SIZE));
+    srand(1);
+    for (int i = 0; i < RECORDS; ++i) {
+        struct output_record *record = record_at(records, i);
+        record->id = random_value();
+        record->count = DEFAULT_VALUES_THRESHOLD;
+        for (int j = 0; j < DEFAULT_VALUES_THRESHOLD; ++j)
+            record->payload[j] = random_value();
+    }
+
+    measure("text", records, rounds, format_text_record, parse_text);
+    measure("msgpack", records, rounds, format_msgpack_record, parse_msgpack);
+
+    free(records);
+    return EXIT_SUCCESS;
+}
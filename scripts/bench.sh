@@ -0,0 +1,41 @@
+#!/bin/sh
+
+# End-to-end benchmark: release build of the server fed by loadgen,
+# first at full speed, then at fixed rates for latency under load.
+# Extra arguments are passed to the server, eg. `./scripts/bench.sh -m threads`.
+
+rm -r build
+mkdir build
+cd build
+
+cmake -DCMAKE_BUILD_TYPE=Release ..
+make
+
+DURATION=${DURATION:-10}
+
+# run "loadgen arguments" server arguments...
+run() {
+    LOADGEN=$1
+    shift
+    rm -f output.fifo
+    mkfifo output.fifo
+    ./loadgen -l -d $DURATION $LOADGEN < output.fifo &
+    ./aggregation-server -F 1 "$@" > output.fifo &
+    SERVER=$!
+    sleep $((DURATION + 3))
+    # Server usually terminates on its own, on write to closed pipe
+    kill $SERVER 2> /dev/null
+    wait
+    rm -f output.fifo
+}
+
+for connections in 1 4 16; do
+    echo "== $connections connections, full speed"
+    run "-c $connections" "$@"
+done
+echo "== 16 connections, zipf ids"
+run "-c 16 -z 1.1" "$@"
+for rate in 100000 1000000; do
+    echo "== 4 connections, $rate messages/s"
+    run "-c 4 -R $rate" "$@"
+done
@@ -6,7 +6,25 @@ cd build
 
 cc -O2 --std=c11 -Wall -Wextra -pthread \
     ../src/hashtable.c \
+    ../src/epoch.c \
+    ../src/expiry.c \
     ../src/input.c \
     ../src/protocol.c \
+    ../src/aggregator.c \
+    ../src/event_loop.c \
+    ../src/listener.c \
+    ../src/query.c \
+    ../src/publish.c \
+    ../src/options.c \
+    ../src/pool.c \
+    ../src/stats.c \
+    ../src/router.c \
+    ../src/snapshot.c \
+    ../src/wal.c \
+    ../src/replay.c \
+    ../src/uring.c \
+    ../src/metrics.c \
+    ../src/latency.c \
+    ../src/output.c \
     ../src/main.c \
     -o aggregation-server
@@ -0,0 +1,36 @@
+#!/bin/sh
+
+# Scaling curves: throughput of hashtable behind a single mutex (locked, epoll with one shard),
+# of shared hashtable with locked shards (epoll) and of shard-per-core mode (cores),
+# for 1 up to all cpus. Prints `mode,threads,messages_per_s` lines.
+# Loadgen competes with the server for cpus, unless pinned with eg. `LOADGEN_CPUS=8-15`.
+# Extra arguments are passed to the server, eg. `./scripts/scaling.sh -a count,sum`.
+
+rm -r build
+mkdir build
+cd build
+
+cmake -DCMAKE_BUILD_TYPE=Release .. > /dev/null
+make > /dev/null
+
+DURATION=${DURATION:-5}
+CPUS=${CPUS:-$(getconf _NPROCESSORS_ONLN)}
+LOADGEN="./loadgen"
+[ -n "$LOADGEN_CPUS" ] && LOADGEN="taskset -c $LOADGEN_CPUS ./loadgen"
+
+echo "mode,threads,messages_per_s"
+for threads in $(seq 1 $CPUS); do
+    for mode in locked epoll cores; do
+        case $mode in
+            locked) SERVER_ARGS="-m epoll -s 1" ;;
+            *) SERVER_ARGS="-m $mode" ;;
+        esac
+        ./aggregation-server $SERVER_ARGS -w $threads "$@" > /dev/null &
+        SERVER=$!
+        sleep 1
+        RATE=$($LOADGEN -c $((2 * threads)) -k 1000000 -d $DURATION 2>&1 | sed -n 's/.*messages\/s: \([0-9]*\).*/\1/p')
+        echo "$mode,$threads,$RATE"
+        kill $SERVER
+        wait
+    done
+done
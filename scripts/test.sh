@@ -2,11 +2,70 @@
 
 ./scripts/build.sh
 
-for i in `seq 1 3`; do
-    timeout 2s ./build/aggregation-server > ./build/prod$i.out &
+for flags in "-m epoll" "-m threads" "-m cores -w 1" "-m uring -w 1" "-L" "-m cores -w 1 -t"; do
+    for i in `seq 1 4`; do
+        timeout 2s ./build/aggregation-server $flags > ./build/prod$i.out &
+        sleep 1
+        timeout 0.5s cat ./test/test$i.in | netcat -t localhost 8080 & 
+        sleep 2
+        diff ./build/prod$i.out ./test/test$i.out && echo "Test $i ($flags) OK." || echo "Test $i ($flags) failed."
+    done
+done
+# Unix domain stream socket is served like tcp connections
+for i in `seq 1 4`; do
+    timeout 2s ./build/aggregation-server -l unix:./build/server.sock > ./build/unix$i.out &
+    sleep 1
+    timeout 0.5s cat ./test/test$i.in | netcat -U ./build/server.sock &
+    sleep 2
+    diff ./build/unix$i.out ./test/test$i.out && echo "Test $i (unix socket) OK." || echo "Test $i (unix socket) failed."
+done
+# Incomplete aggregate of id 1 and missing one of id 2 are queried
+timeout 3s ./build/aggregation-server -q tcp:8081 > /dev/null &
+sleep 1
+printf '\202\242id\001\245value\005' | timeout 0.5s netcat -t localhost 8080
+sleep 0.5
+printf '\001\002' | timeout 0.5s netcat -t localhost 8081 | od -An -tx1 | tr -d ' \n' \
+    | grep -qx '82a2696401a676616c756573910582a2696402a676616c75657390' \
+    && echo "Test (query) OK." || echo "Test (query) failed."
+sleep 2
+# Subscriber receives the same aggregates as standard output, including those written at shutdown
+for i in `seq 1 4`; do
+    timeout 3s ./build/aggregation-server -p tcp:8082 > ./build/published$i.out &
     sleep 1
-    timeout 0.5s cat ./test/test$i.in | netcat -t localhost 8080 & 
+    timeout 3s netcat -d -t localhost 8082 > ./build/subscriber$i.out &
+    sleep 0.5
+    timeout 0.5s cat ./test/test$i.in | netcat -t localhost 8080 &
     sleep 2
-    diff ./build/prod$i.out ./test/test$i.out && echo "Test $i OK." || echo "Test $i failed."
+    diff ./build/subscriber$i.out ./test/test$i.out && diff ./build/published$i.out ./test/test$i.out \
+        && echo "Test $i (publish) OK." || echo "Test $i (publish) failed."
+done
+# Aggregation is tested on captures replayed offline, without waiting for the network
+for i in `seq 1 4`; do
+    ./build/aggregation-server -m replay ./test/test$i.in 2> /dev/null | diff - ./test/test$i.out \
+        && echo "Test $i (replay) OK." || echo "Test $i (replay) failed."
+    ./build/aggregation-server -m replay -a count,sum,min,max ./test/test$i.in 2> /dev/null \
+        | diff - ./test/test$i.stats.out && echo "Test $i (statistics) OK." || echo "Test $i (statistics) failed."
+done
+for i in `seq 1 4`; do
+    # Input replayed twice by one server, then once by each of two servers sharing a snapshot
+    rm -f ./build/snapshot$i
+    ./build/aggregation-server -m replay ./test/test$i.in ./test/test$i.in > ./build/twice$i.out 2> /dev/null
+    for run in 1 2; do
+        ./build/aggregation-server -m replay -S ./build/snapshot$i ./test/test$i.in \
+            > ./build/restart$i.$run.out 2> /dev/null
+    done
+    cat ./build/restart$i.1.out ./build/restart$i.2.out | diff - ./build/twice$i.out \
+        && echo "Test $i (snapshot) OK." || echo "Test $i (snapshot) failed."
+    # The first server is killed, the second replays whole log, as only the final snapshot is taken
+    rm -rf ./build/snapshot$i ./build/wal$i
+    for signal in KILL TERM; do
+        timeout -s $signal 2s ./build/aggregation-server -S ./build/snapshot$i -I 0 -W ./build/wal$i \
+            > ./build/crash$i.out &
+        sleep 1
+        timeout 0.5s cat ./test/test$i.in | netcat -t localhost 8080 &
+        sleep 2
+    done
+    diff ./build/crash$i.out ./build/twice$i.out \
+        && echo "Test $i (write-ahead log) OK." || echo "Test $i (write-ahead log) failed."
 done
 echo "All tests completed."
@@ -0,0 +1,488 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Implementation of aggregation of incoming messages.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "aggregator.h"
+#include "hashtable.h"
+#include "output.h"
+#include "metrics.h"
+#include "latency.h"
+#include "snapshot.h"
+#include "error.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Aggregation policy, set by @ref init_aggregator.
+ */
+static struct aggregation_config config;
+/**
+ * Aggregation specialized for configured policy.
+ */
+static void (*aggregate_policy)(const struct message *);
+/**
+ * Requests maintenance of shards from their owners, @p NULL if shards are locked instead of owned.
+ */
+static void (*maintenance_wake)();
+
+/**
+ * Coarse clock, advanced by housekeeping thread, so producers never read time themselves.
+ */
+static _Atomic uint32_t clock_tick;
+/**
+ * Length of a tick of @ref clock_tick and TTL in ticks.
+ */
+static unsigned tick_ms, ttl_ticks;
+/**
+ * Number of ended tumbling windows, advanced by housekeeping thread if shards are owned.
+ */
+static _Atomic uint32_t window_epoch;
+/**
+ * Window and tick, up to which owner maintained a shard, per shard.
+ */
+static struct shard_clock {
+    uint32_t window, tick;
+} *shard_clocks;
+
+/**
+ * Returns current time of monotonic clock.
+ * @return time in nanoseconds
+ */
+static uint_least64_t now_ns() {
+    struct timespec now;
+    ERROR_CHECK(clock_gettime(CLOCK_MONOTONIC, &now));
+    return (uint_least64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Locks shard, counting contended acquisitions and time spent waiting.
+ * Uncontended acquisition costs a single try, clock is read only before blocking.
+ * @param shard — shard to lock
+ */
+static void shard_lock(struct hashtable_shard *shard) {
+    int error = pthread_mutex_trylock(&shard->mutex);
+    if (error == 0) return;
+    if (error != EBUSY) {
+        errno = error;
+        ERROR("pthread_mutex_trylock");
+    }
+
+    uint_least64_t start = now_ns();
+    ERROR_CHECK(pthread_mutex_lock(&shard->mutex));
+    metrics_add(METRIC_LOCK_CONTENDED, 1);
+    metrics_add(METRIC_LOCK_WAIT_NS, now_ns() - start);
+}
+
+/**
+ * Adds message to its partial aggregate, queues aggregate for output once complete.
+ * Inlined with constant arguments, so every policy gets its own copy of the hot path.
+ * @param m — message to aggregate
+ * @param raw_values — whether raw values are kept, instead of statistics
+ * @param locked — whether shard is locked, or accessed only by its owner
+ */
+static inline void aggregate_with(const struct message *m, bool raw_values, bool locked) {
+    diagnostic("Got message; id: %" PRIuLEAST64 ", value: %" PRIuLEAST64 ".\n", m->id, m->value);
+
+    /* Process entry in critical section of its shard */
+    struct hashtable_shard *shard = hashtable_shard(m->id);
+    if (locked)
+        shard_lock(shard);
+    hashtable_write_begin(shard);
+
+    /* Add id — value mapping to hashtable */
+    struct entry_t *entry;
+    NULL_CHECK(entry = hashtable_get(shard, m->id));
+    if (entry->count == 0 && config.ttl_ms > 0) {
+        /* Schedule expiry of new entry, it is done by housekeeping thread */
+        uint32_t tick = atomic_load_explicit(&clock_tick, memory_order_relaxed);
+        entry->birth = (uint16_t) tick;
+        expiry_push(&shard->expiry, m->id, tick);
+    }
+    if (raw_values) {
+        entry->payload[entry->count] = m->value;
+    } else {
+        /* Statistics are stored in field order, count is kept in the header anyway */
+        uint_least64_t *it = entry->payload;
+        if (config.fields & FIELD_SUM)
+            *it++ += m->value;
+        if (config.fields & FIELD_MIN) {
+            if (entry->count == 0 || m->value < *it)
+                *it = m->value;
+            ++it;
+        }
+        if ((config.fields & FIELD_MAX) && m->value > *it)
+            *it = m->value;
+    }
+
+    _Alignas(struct entry_t) unsigned char completed[MAX_ENTRY_SIZE];
+    bool complete = ++entry->count == config.threshold;
+    if (complete) {
+        /* Remove aggregated entry, keeping its copy for output */
+        memcpy(completed, entry, hashtable_entry_size());
+        hashtable_remove(shard, entry->id);
+    }
+
+    hashtable_write_end(shard);
+    if (locked) {
+        ERROR_CHECK(pthread_mutex_unlock(&shard->mutex));
+    }
+
+    /* Output formats and writes aggregate outside of critical section */
+    if (complete) {
+        if (latency_enabled && latency_received != 0) {
+            uint_least64_t updated = latency_now();
+            latency_record(LATENCY_UPDATE, updated - latency_received);
+            output_emit_timed((struct entry_t *) completed, latency_received, updated);
+        } else {
+            output_emit((struct entry_t *) completed);
+        }
+    }
+}
+
+/**
+ * Aggregates message into raw values.
+ * @param m — message to aggregate
+ */
+static void aggregate_values(const struct message *m) {
+    aggregate_with(m, true, true);
+}
+
+/**
+ * Aggregates message into statistics.
+ * @param m — message to aggregate
+ */
+static void aggregate_statistics(const struct message *m) {
+    aggregate_with(m, false, true);
+}
+
+/**
+ * Aggregates message into raw values, in shard owned by the caller.
+ * @param m — message to aggregate
+ */
+static void aggregate_owned_values(const struct message *m) {
+    aggregate_with(m, true, false);
+}
+
+/**
+ * Aggregates message into statistics, in shard owned by the caller.
+ * @param m — message to aggregate
+ */
+static void aggregate_owned_statistics(const struct message *m) {
+    aggregate_with(m, false, false);
+}
+
+/**
+ * Adds message to its partial aggregate, queues aggregate for output once complete.
+ * If shards are owned, has to be called by owner of shard of @p m->id.
+ * @param m — message to aggregate
+ */
+void aggregate(const struct message *m) {
+    aggregate_policy(m);
+}
+
+/**
+ * Aggregates a batch of messages, consumer of connection inputs.
+ * @param messages — messages to aggregate
+ * @param count — number of @p messages
+ */
+void aggregate_messages(const struct message *messages, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        aggregate_policy(&messages[i]);
+}
+
+/**
+ * Reports entry evicted from hashtable to stay within memory budget.
+ * @param entry — evicted partial aggregate
+ */
+static void aggregator_evict(const struct entry_t *entry) {
+    metrics_add(METRIC_EVICTED, 1);
+    output_evicted(entry);
+}
+
+/**
+ * Emits every partial aggregate and empties hashtable, one shard at a time.
+ */
+static void aggregator_flush() {
+    for (unsigned i = 0; i < hashtable_shard_count(); ++i) {
+        struct hashtable_shard *shard = hashtable_shard_at(i);
+        shard_lock(shard);
+        hashtable_write_begin(shard);
+        hashtable_drain(shard, output_emit);
+        hashtable_write_end(shard);
+        ERROR_CHECK(pthread_mutex_unlock(&shard->mutex));
+    }
+}
+
+/**
+ * Expires entries of a shard created at least TTL ago.
+ * Releases the lock every @ref EXPIRY_BATCH tokens, so producers never wait for a whole backlog.
+ * @param shard — shard to expire entries of
+ * @param now — current tick of coarse clock
+ */
+static void expire_shard(struct hashtable_shard *shard, uint32_t now) {
+    for (bool more = true; more;) {
+        if (maintenance_wake == NULL)
+            shard_lock(shard);
+        hashtable_write_begin(shard);
+        for (unsigned i = 0; i < EXPIRY_BATCH; ++i) {
+            const struct expiry_token *token = expiry_peek(&shard->expiry);
+            if (token == NULL || now - token->tick < ttl_ticks) {
+                more = false;
+                break;
+            }
+
+            /* Token of entry, which completed or was replaced by a newer one, is ignored */
+            struct entry_t *entry = hashtable_find(shard, token->id);
+            if (entry != NULL && entry->birth == (uint16_t) token->tick) {
+                if (config.expiry == EXPIRY_EMIT)
+                    output_emit(entry);
+                metrics_add(METRIC_EXPIRED, 1);
+                hashtable_remove(shard, token->id);
+            }
+            expiry_pop(&shard->expiry);
+        }
+        hashtable_write_end(shard);
+        if (maintenance_wake == NULL) {
+            ERROR_CHECK(pthread_mutex_unlock(&shard->mutex));
+        }
+    }
+}
+
+/**
+ * Returns current time of monotonic clock.
+ * @return time in milliseconds
+ */
+static uint_least64_t now_ms() {
+    struct timespec now;
+    ERROR_CHECK(clock_gettime(CLOCK_MONOTONIC, &now));
+    return (uint_least64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Sleeps until given time of monotonic clock.
+ * @param deadline_ms — time in milliseconds
+ */
+static void sleep_until(uint_least64_t deadline_ms) {
+    struct timespec deadline = {.tv_sec = deadline_ms / 1000, .tv_nsec = (long) (deadline_ms % 1000) * 1000000};
+    int result;
+    while ((result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)) == EINTR);
+    NON_ZERO_CHECK(result);
+}
+
+/**
+ * Advances coarse clock and expires old entries every tick, ends tumbling windows.
+ * Deadlines are absolute, so neither drifts by time spent on expiry and flushes.
+ * @param unused — unused
+ * @return never returns
+ */
+static void *housekeeping_thread(void *unused) {
+    (void) unused;
+    uint_least64_t start = now_ms();
+    uint_least64_t next_tick = start + tick_ms, next_window = start + config.window_ms;
+
+    for (;;) {
+        bool window = config.window_ms > 0 && (config.ttl_ms == 0 || next_window <= next_tick);
+        sleep_until(window ? next_window : next_tick);
+
+        if (window) {
+            if (maintenance_wake == NULL)
+                aggregator_flush();
+            else
+                atomic_fetch_add_explicit(&window_epoch, 1, memory_order_relaxed);
+            next_window += config.window_ms;
+        } else {
+            uint32_t now = (uint32_t) ((next_tick - start) / tick_ms);
+            atomic_store_explicit(&clock_tick, now, memory_order_relaxed);
+            if (maintenance_wake == NULL) {
+                for (unsigned i = 0; i < hashtable_shard_count(); ++i)
+                    expire_shard(hashtable_shard_at(i), now);
+            }
+            next_tick += tick_ms;
+        }
+
+        /* Owners flush and expire their shards themselves */
+        if (maintenance_wake != NULL)
+            maintenance_wake();
+    }
+    return NULL;
+}
+
+/**
+ * Ends tumbling window and expires old entries of a shard, if housekeeping thread advanced clocks since last call,
+ * copies the shard if snapshot requested it.
+ * @param index — index of shard owned by the caller
+ * @return @p false if the shard was copied by the final snapshot and must no longer change, @p true otherwise
+ */
+bool aggregator_maintain(unsigned index) {
+    struct hashtable_shard *shard = hashtable_shard_at(index);
+    struct shard_clock *clock = &shard_clocks[index];
+
+    uint32_t window = atomic_load_explicit(&window_epoch, memory_order_relaxed);
+    if (clock->window != window) {
+        clock->window = window;
+        hashtable_write_begin(shard);
+        hashtable_drain(shard, output_emit);
+        hashtable_write_end(shard);
+    }
+    uint32_t now = atomic_load_explicit(&clock_tick, memory_order_relaxed);
+    if (config.ttl_ms > 0 && clock->tick != now) {
+        clock->tick = now;
+        expire_shard(shard, now);
+    }
+    return snapshot_maintain(index);
+}
+
+/**
+ * Reads coarse clock, for snapshots preserving age of entries.
+ * @param tick[out] — current tick
+ * @return length of a tick in milliseconds, zero if entries never expire
+ */
+unsigned aggregator_clock(uint32_t *tick) {
+    *tick = atomic_load_explicit(&clock_tick, memory_order_relaxed);
+    return config.ttl_ms > 0 ? tick_ms : 0;
+}
+
+/**
+ * Schedules expiry of entries restored into a shard from snapshot, so they expire as if server never stopped.
+ * Tokens have to be pushed oldest first, so entries are sorted by age, which is at most TTL.
+ * @param shard[locked] — shard holding only restored entries
+ * @param tick — tick of coarse clock when snapshot was taken, birth ticks of entries are relative to it
+ * @param snapshot_tick_ms — length of that tick, zero if birth ticks are meaningless
+ * @param downtime_ms — time since snapshot was taken
+ */
+void aggregator_restore(struct hashtable_shard *shard, uint32_t tick, unsigned snapshot_tick_ms,
+                        uint_least64_t downtime_ms) {
+    if (config.ttl_ms == 0) return;
+    uint32_t now = atomic_load_explicit(&clock_tick, memory_order_relaxed);
+
+    /* Count entries of every age, oldest first, rebasing their birth ticks on the current clock */
+    size_t *offsets;
+    NULL_CHECK(offsets = calloc(ttl_ticks + 2, sizeof(size_t)));
+    struct entry_t *entry;
+    size_t position = 0;
+    while ((entry = hashtable_next(shard, &position)) != NULL) {
+        uint_least64_t age_ms = downtime_ms;
+        if (snapshot_tick_ms > 0)
+            age_ms += (uint_least64_t) (uint16_t) (tick - entry->birth) * snapshot_tick_ms;
+        uint32_t age = age_ms / tick_ms < ttl_ticks ? (uint32_t) (age_ms / tick_ms) : ttl_ticks;
+        entry->birth = (uint16_t) (now - age);
+        ++offsets[ttl_ticks - age + 1];
+    }
+    for (unsigned i = 1; i < ttl_ticks + 2; ++i)
+        offsets[i] += offsets[i - 1];
+    size_t restored = offsets[ttl_ticks + 1];
+
+    struct expiry_token *tokens;
+    NULL_CHECK(tokens = malloc((restored + 1) * sizeof(struct expiry_token)));
+    for (position = 0; (entry = hashtable_next(shard, &position)) != NULL;) {
+        uint32_t age = (uint16_t) ((uint16_t) now - entry->birth);
+        tokens[offsets[ttl_ticks - age]++] = (struct expiry_token) {.id = entry->id, .tick = now - age};
+    }
+    for (size_t i = 0; i < restored; ++i)
+        expiry_push(&shard->expiry, tokens[i].id, tokens[i].tick);
+
+    free(tokens);
+    free(offsets);
+}
+
+/**
+ * Initializes hashtable storing partial aggregates, starts housekeeping thread if needed.
+ * Shards are either locked by every thread accessing them, or owned by threads, which alone
+ * access them, and which have to call @ref aggregator_maintain on every @p wake.
+ * @param shards — number of hashtable shards
+ * @param aggregation — aggregation policy
+ * @param wake — called by housekeeping thread, when owned shards need maintenance,
+ * @p NULL if shards are locked
+ */
+void init_aggregator(unsigned shards, const struct aggregation_config *aggregation, void (*wake)()) {
+    config = *aggregation;
+    maintenance_wake = wake;
+    if (wake == NULL)
+        aggregate_policy = config.fields == 0 ? aggregate_values : aggregate_statistics;
+    else
+        aggregate_policy = config.fields == 0 ? aggregate_owned_values : aggregate_owned_statistics;
+    init_hashtable(shards, aggregation_payload_words(&config), config.memory_budget, aggregator_evict);
+    atomic_init(&clock_tick, 0);
+    atomic_init(&window_epoch, 0);
+    NULL_CHECK(shard_clocks = calloc(hashtable_shard_count(), sizeof(struct shard_clock)));
+
+    if (config.ttl_ms > 0) {
+        init_expiry();
+        /* Entries expire between TTL and TTL plus one tick after creation */
+        tick_ms = config.ttl_ms / EXPIRY_TICKS_PER_TTL > 0 ? config.ttl_ms / EXPIRY_TICKS_PER_TTL : 1;
+        ttl_ticks = (config.ttl_ms + tick_ms - 1) / tick_ms;
+    }
+    if (config.window_ms > 0 || config.ttl_ms > 0) {
+        pthread_t thread;
+        NON_ZERO_CHECK(pthread_create(&thread, NULL, housekeeping_thread, NULL));
+        NON_ZERO_CHECK(pthread_detach(thread));
+    }
+}
+
+/**
+ * Prints occupancy of hashtable and histogram of probe lengths in Prometheus text format.
+ * Every shard is scanned under its lock, so producers of one shard wait at a time.
+ * Prints nothing if shards are owned.
+ * @param output — stream to print to
+ */
+void aggregator_stats_print(FILE *output) {
+    /* Shards owned by threads can't be scanned from outside */
+    if (maintenance_wake != NULL) return;
+
+    struct hashtable_occupancy occupancy = {0};
+    for (unsigned i = 0; i < hashtable_shard_count(); ++i) {
+        struct hashtable_shard *shard = hashtable_shard_at(i);
+        ERROR_CHECK(pthread_mutex_lock(&shard->mutex));
+        hashtable_occupancy(shard, &occupancy);
+        ERROR_CHECK(pthread_mutex_unlock(&shard->mutex));
+    }
+
+    fprintf(output, "# HELP aggregation_entries Incomplete aggregates held in hashtable.\n"
+                    "# TYPE aggregation_entries gauge\n"
+                    "aggregation_entries %zu\n"
+                    "# HELP aggregation_slots Slots of hashtable, including ones of tables being migrated.\n"
+                    "# TYPE aggregation_slots gauge\n"
+                    "aggregation_slots %zu\n"
+                    "# HELP aggregation_probe_length Slots inspected by lookup of held aggregates.\n"
+                    "# TYPE aggregation_probe_length histogram\n",
+            occupancy.entries, occupancy.capacity);
+    size_t cumulative = 0;
+    for (unsigned i = 0; i < PROBE_LENGTH_BUCKETS; ++i) {
+        cumulative += occupancy.probe_lengths[i];
+        fprintf(output, "aggregation_probe_length_bucket{le=\"%u\"} %zu\n", 1u << i, cumulative);
+    }
+    fprintf(output, "aggregation_probe_length_bucket{le=\"+Inf\"} %zu\n"
+                    "aggregation_probe_length_sum %llu\n"
+                    "aggregation_probe_length_count %zu\n",
+            cumulative, (unsigned long long) occupancy.probe_length_sum, cumulative);
+}
@@ -0,0 +1,120 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Interface for aggregation of incoming messages, shared by all connection models.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _AGGREGATOR_H_
+#define _AGGREGATOR_H_
+
+#include "protocol.h"
+#include "hashtable.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Default number of values completing an aggregate.
+ */
+#define DEFAULT_VALUES_THRESHOLD 3
+/**
+ * Max number of raw values kept per id.
+ */
+#define MAX_VALUES_THRESHOLD 32
+
+/**
+ * Statistics computed instead of keeping raw values, in output order.
+ */
+enum aggregation_field {
+    FIELD_COUNT = 1,
+    FIELD_SUM = 2,
+    FIELD_MIN = 4,
+    FIELD_MAX = 8
+};
+
+/**
+ * Number of coarse clock ticks per TTL, determines precision of expiry.
+ */
+#define EXPIRY_TICKS_PER_TTL 64
+/**
+ * Max number of entries expired under a single lock acquisition.
+ */
+#define EXPIRY_BATCH 256
+
+/**
+ * Handling of entries, which did not complete within TTL.
+ */
+enum expiry_policy {
+    /** Partial aggregate is written like a complete one. */
+    EXPIRY_EMIT,
+    /** Partial aggregate is discarded, only counted. */
+    EXPIRY_DROP
+};
+
+/**
+ * Aggregation policy.
+ */
+struct aggregation_config {
+    /** Set of @ref aggregation_field, raw values are kept if empty. */
+    unsigned fields;
+    /** Number of values completing an aggregate, zero if only windows complete them. */
+    unsigned threshold;
+    /** Length of tumbling window, after which partial aggregates are emitted, zero if disabled. */
+    unsigned window_ms;
+    /** Time after creation, after which incomplete entry expires, zero if never. */
+    unsigned ttl_ms;
+    enum expiry_policy expiry;
+    /** Max size of hashtable in bytes, cold entries are evicted beyond it, zero if unlimited. */
+    size_t memory_budget;
+};
+
+/**
+ * Calculates number of entry payload words needed by a policy.
+ * Raw values take one word each, every statistic except count takes one word.
+ * @param config — aggregation policy
+ * @return number of payload words
+ */
+static inline unsigned aggregation_payload_words(const struct aggregation_config *config) {
+    if (config->fields == 0)
+        return config->threshold;
+    return !!(config->fields & FIELD_SUM) + !!(config->fields & FIELD_MIN) + !!(config->fields & FIELD_MAX);
+}
+
+void init_aggregator(unsigned shards, const struct aggregation_config *config, void (*wake)());
+
+void aggregate(const struct message *m);
+
+void aggregate_messages(const struct message *messages, size_t count);
+
+bool aggregator_maintain(unsigned index);
+
+unsigned aggregator_clock(uint32_t *tick);
+
+void aggregator_restore(struct hashtable_shard *shard, uint32_t tick, unsigned snapshot_tick_ms,
+                        uint_least64_t downtime_ms);
+
+void aggregator_stats_print(FILE *output);
+
+#endif /* _AGGREGATOR_H_ */
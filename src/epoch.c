@@ -0,0 +1,151 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Implementation of epoch-based reclamation.
+ * Writers retire memory after unpublishing it, which advances the global epoch.
+ * Retired memory is released once every reader is outside of read sections,
+ * or entered its current one after the memory was retired. Retirements are rare,
+ * so they are kept on a list under a mutex, readers only store their epoch.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "epoch.h"
+#include "error.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/**
+ * Memory waiting for readers, node of @ref retired list.
+ */
+struct retired {
+    void *memory;
+    size_t bytes;
+    void (*release)(void *, size_t);
+    /** Global epoch before retirement, readers which entered in it may hold the memory. */
+    uint_least64_t epoch;
+    struct retired *next;
+};
+
+/**
+ * Global epoch, advanced by every retirement, never zero.
+ */
+static _Atomic uint_least64_t global_epoch = 1;
+/**
+ * Announcements of registered readers.
+ */
+static struct epoch_reader readers[MAX_EPOCH_READERS];
+static _Atomic unsigned readers_count;
+/**
+ * Memory not released yet, and its number, checked by readers without the mutex.
+ */
+static struct retired *retired_list;
+static _Atomic size_t retired_count;
+static pthread_mutex_t retired_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Registers calling thread as a reader.
+ * @return announcement of the reader, terminates if there are too many readers
+ */
+struct epoch_reader *epoch_register() {
+    unsigned index = atomic_fetch_add(&readers_count, 1);
+    if (index >= MAX_EPOCH_READERS) {
+        fprintf(stderr, "epoch: More than %d readers.\n", MAX_EPOCH_READERS);
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&readers[index].epoch, 0);
+    return &readers[index];
+}
+
+/**
+ * Releases every retired memory, which no reader may hold.
+ * Reader holds memory retired in its epoch or later, memory retired before it is unreachable to it.
+ */
+static void epoch_reclaim() {
+    uint_least64_t oldest = UINT_LEAST64_MAX;
+    unsigned count = atomic_load(&readers_count);
+    for (unsigned i = 0; i < count && i < MAX_EPOCH_READERS; ++i) {
+        uint_least64_t epoch = atomic_load(&readers[i].epoch);
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    ERROR_CHECK(pthread_mutex_lock(&retired_mutex));
+    struct retired **it = &retired_list;
+    while (*it != NULL) {
+        struct retired *node = *it;
+        if (node->epoch < oldest) {
+            *it = node->next;
+            node->release(node->memory, node->bytes);
+            free(node);
+            atomic_fetch_sub(&retired_count, 1);
+        } else {
+            it = &node->next;
+        }
+    }
+    ERROR_CHECK(pthread_mutex_unlock(&retired_mutex));
+}
+
+/**
+ * Starts read section, memory reachable in it is not released until @ref epoch_exit.
+ * Announcement is made visible before any shared pointer is read.
+ * @param reader — announcement of the calling thread
+ */
+void epoch_enter(struct epoch_reader *reader) {
+    atomic_store(&reader->epoch, atomic_load(&global_epoch));
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/**
+ * Ends read section, releases memory retired meanwhile, if no other reader holds it.
+ * @param reader — announcement of the calling thread
+ */
+void epoch_exit(struct epoch_reader *reader) {
+    atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+    if (atomic_load_explicit(&retired_count, memory_order_relaxed) > 0)
+        epoch_reclaim();
+}
+
+/**
+ * Releases memory once no reader may hold it, immediately if no reader is in read section.
+ * Memory has to be unreachable for readers entering read sections from now on.
+ * @param memory — unpublished memory
+ * @param bytes — size of @p memory
+ * @param release — called with @p memory and @p bytes, by this or a reader thread
+ */
+void epoch_retire(void *memory, size_t bytes, void (*release)(void *memory, size_t bytes)) {
+    struct retired *node;
+    NULL_CHECK(node = malloc(sizeof(struct retired)));
+    *node = (struct retired) {.memory = memory, .bytes = bytes, .release = release};
+    /* Readers entering after the advance can't see unpublished memory */
+    node->epoch = atomic_fetch_add(&global_epoch, 1);
+
+    ERROR_CHECK(pthread_mutex_lock(&retired_mutex));
+    node->next = retired_list;
+    retired_list = node;
+    atomic_fetch_add(&retired_count, 1);
+    ERROR_CHECK(pthread_mutex_unlock(&retired_mutex));
+    epoch_reclaim();
+}
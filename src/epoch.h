@@ -0,0 +1,59 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Interface for epoch-based reclamation – memory read by lock-free readers
+ * is released only once no reader could still hold a reference to it.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+#include "hashtable.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Max number of registered reader threads.
+ */
+#define MAX_EPOCH_READERS 16
+
+/**
+ * Announcement of a reader thread, written only by that thread.
+ */
+struct epoch_reader {
+    /** Global epoch at entry of current read section, zero outside of it. */
+    _Atomic uint_least64_t epoch;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct epoch_reader *epoch_register();
+
+void epoch_enter(struct epoch_reader *reader);
+
+void epoch_exit(struct epoch_reader *reader);
+
+void epoch_retire(void *memory, size_t bytes, void (*release)(void *memory, size_t bytes));
+
+#endif /* _EPOCH_H_ */
@@ -0,0 +1,372 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Implementation of epoll based connection handling.
+ * Main thread accepts connections and assigns them round-robin to event loops,
+ * every event loop owns its connections, so they are never shared between threads.
+ * Datagram sockets are served like connections, every event loop receives from its own udp socket.
+ * In shard-per-core mode every core thread accepts connections on its own listening sockets
+ * instead, and owns a part of hashtable too.
+ * Connection is read at most @ref READ_BUDGET times per turn, then queued on ready list of its loop,
+ * as edge-triggered epoll won't report it again, so a fast sender can't starve the others.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _GNU_SOURCE
+
+#include "event_loop.h"
+#include "input.h"
+#include "router.h"
+#include "error.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/**
+ * Listeners of core threads, set by @ref run_core_loops.
+ */
+static const struct listener *core_listeners;
+static unsigned core_listeners_count;
+
+/**
+ * Inputs which used up their read budget before socket was drained, in order of queueing.
+ */
+struct ready_list {
+    struct input *head;
+    struct input **tail;
+};
+
+/**
+ * Initializes empty ready list.
+ * @param list — list to initialize
+ */
+static void ready_init(struct ready_list *list) {
+    list->head = NULL;
+    list->tail = &list->head;
+}
+
+/**
+ * Queues input at the end of ready list.
+ * @param list — ready list of event loop
+ * @param in — input, which socket may hold more bytes
+ */
+static void ready_push(struct ready_list *list, struct input *in) {
+    in->ready = true;
+    in->next_ready = NULL;
+    *list->tail = in;
+    list->tail = &in->next_ready;
+}
+
+/**
+ * Takes every queued input, leaving ready list empty.
+ * Taken inputs stay marked as ready, until they are read again.
+ * @param list — ready list of event loop
+ * @return the first input, linked by @p next_ready
+ */
+static struct input *ready_take(struct ready_list *list) {
+    struct input *head = list->head;
+    ready_init(list);
+    return head;
+}
+
+/**
+ * Checks whether socket may hold more bytes after a receive.
+ * Once peer closed connection, epoll reports no more edges, so it is read until its end.
+ * @param in — connection input
+ * @param status — result of the last receive
+ * @return @p true if socket should be read again
+ */
+static bool input_pending(const struct input *in, enum input_status status) {
+    return status == INPUT_MORE || (status == INPUT_DRAINED && in->hangup);
+}
+
+/**
+ * Receives from readable connection until socket is drained, as required by edge-triggered epoll,
+ * or read budget is used up, then connection is queued on ready list.
+ * Datagram socket is shared by every sender, so it may never drain – it gets a single batch per turn.
+ * @param in — connection input, or input of datagram socket
+ * @param list — ready list of event loop
+ * @return @p false if connection should be closed, @p true otherwise
+ */
+static bool handle_readable(struct input *in, struct ready_list *list) {
+    enum input_status status = INPUT_MORE;
+    unsigned budget = in->datagram ? 1 : READ_BUDGET;
+    in->ready = false;
+    for (unsigned reads = 0; reads < budget && input_pending(in, status); ++reads)
+        status = input_receive(in);
+    if (input_pending(in, status))
+        ready_push(list, in);
+    return status != INPUT_CLOSED;
+}
+
+/**
+ * Registers input in epoll instance, edge-triggered, so event loop reads until socket is drained.
+ * @param epoll_fd — epoll instance of event loop
+ * @param in — input of accepted connection or of datagram socket
+ */
+static void add_input(int epoll_fd, struct input *in) {
+    set_nonblocking(in->sock);
+    struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = in};
+    ERROR_CHECK(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, in->sock, &event));
+}
+
+/**
+ * Serves connections registered in given epoll instance.
+ * @param epoll_ptr — pointer to epoll descriptor
+ * @return [noreturn]
+ */
+static void *event_loop(void *epoll_ptr) {
+    int epoll_fd = *(int *) epoll_ptr;
+    struct epoll_event events[MAX_EVENTS];
+    struct ready_list ready_list;
+    ready_init(&ready_list);
+
+    for (;;) {
+        /* Queued connections are read without waiting */
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, ready_list.head == NULL ? -1 : 0);
+        if (ready < 0 && errno == EINTR) continue;
+        ERROR_CHECK(ready);
+
+        /* Connections queued on previous turn are read after new events, once per turn */
+        struct input *queued = ready_take(&ready_list);
+        for (int i = 0; i < ready; ++i) {
+            struct input *in = events[i].data.ptr;
+            /* Queued connection is read on its turn, but its end has to be remembered */
+            if (events[i].events & (EPOLLRDHUP | EPOLLHUP))
+                in->hangup = true;
+            if (in->ready) continue;
+            if (!handle_readable(in, &ready_list)) {
+                /* Closing the last descriptor removes it from epoll set */
+                input_close(in);
+                diagnostic("event-loop: Closed connection.\n");
+            }
+        }
+        while (queued != NULL) {
+            struct input *in = queued;
+            queued = in->next_ready;
+            if (!handle_readable(in, &ready_list)) {
+                input_close(in);
+                diagnostic("event-loop: Closed connection.\n");
+            }
+        }
+    }
+}
+
+/**
+ * Starts @p workers event loops and distributes accepted connections among them.
+ * Every event loop opens its own socket of udp listeners, unix datagram sockets are served by the first one.
+ * @param listeners — listeners to open
+ * @param count — number of listeners
+ * @param workers — number of event loops
+ * @return [noreturn]
+ */
+void run_event_loops(const struct listener *listeners, unsigned count, unsigned workers) {
+    int *epoll_fds;
+    NULL_CHECK(epoll_fds = calloc(workers, sizeof(int)));
+
+    /* Stream listeners are accepted by calling thread */
+    int socks[MAX_LISTENERS];
+    unsigned streams = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        if (listener_is_datagram(&listeners[i])) continue;
+        socks[streams] = listener_open(&listeners[i], false);
+        set_nonblocking(socks[streams++]);
+    }
+
+    /* Launch event loops, every one with its own epoll instance */
+    pthread_t thread;
+    pthread_attr_t detached_attr;
+    NON_ZERO_CHECK(pthread_attr_init(&detached_attr));
+    NON_ZERO_CHECK(pthread_attr_setdetachstate(&detached_attr, PTHREAD_CREATE_DETACHED));
+    for (unsigned i = 0; i < workers; ++i) {
+        ERROR_CHECK(epoll_fds[i] = epoll_create1(0));
+        for (unsigned j = 0; j < count; ++j) {
+            if (listener_is_datagram(&listeners[j]) && listener_owned(&listeners[j], i))
+                add_input(epoll_fds[i], input_open_datagram(listener_open(&listeners[j], true)));
+        }
+        NON_ZERO_CHECK(pthread_create(&thread, &detached_attr, event_loop, &epoll_fds[i]));
+    }
+    diagnostic("main-thread: Launched %u event loops.\n", workers);
+
+    /* Without stream listeners there is nothing to accept */
+    while (streams == 0)
+        pause();
+    for (unsigned next = 0;; next = (next + 1) % workers) {
+        /* Accept incoming connection */
+        int client_sock = listener_accept(socks, streams);
+        add_input(epoll_fds[next], input_open(client_sock));
+        diagnostic("main-thread: Accepted client connection, assigned to event loop %u.\n", next);
+    }
+}
+
+/**
+ * Binds calling thread to @p index-th CPU it is allowed to run on, modulo number of such CPUs.
+ * @param index — index of core thread
+ */
+static void pin_to_cpu(unsigned index) {
+    cpu_set_t allowed, pinned;
+    NON_ZERO_CHECK(pthread_getaffinity_np(pthread_self(), sizeof(allowed), &allowed));
+
+    unsigned skip = index % (unsigned) CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && skip-- == 0) {
+            CPU_ZERO(&pinned);
+            CPU_SET(cpu, &pinned);
+            NON_ZERO_CHECK(pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned));
+            return;
+        }
+    }
+}
+
+/**
+ * Accepts every pending connection of non-blocking listening socket.
+ * @param listen_sock — one of listening sockets of the core
+ * @param epoll_fd — epoll instance of the core
+ */
+static void accept_connections(int listen_sock, int epoll_fd) {
+    for (;;) {
+        int client_sock = accept(listen_sock, NULL, NULL);
+        if (client_sock < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            /* Connection reset before it was accepted */
+            if (errno == ECONNABORTED || errno == EINTR) continue;
+            ERROR("accept");
+        }
+        add_input(epoll_fd, input_open(client_sock));
+        diagnostic("core: Accepted client connection.\n");
+    }
+}
+
+/**
+ * Reads a slice of connection of a core, then forwards what it routed and drains inbox,
+ * so cores forwarding to this one don't wait for the end of the turn.
+ * @param in — connection input
+ * @param list — ready list of the core
+ */
+static void core_readable(struct input *in, struct ready_list *list) {
+    if (!handle_readable(in, list)) {
+        input_close(in);
+        diagnostic("core: Closed connection.\n");
+    }
+    router_flush();
+    router_drain();
+}
+
+/**
+ * Serves connections of a core and messages forwarded to it.
+ * Pending batches are forwarded and inbox drained on every iteration and after every read slice,
+ * core sleeps in @p epoll_wait only once both are empty and no connection is queued.
+ * @param index_ptr — index of the core
+ * @return [noreturn]
+ */
+static void *core_loop(void *index_ptr) {
+    unsigned index = (unsigned) (uintptr_t) index_ptr;
+    pin_to_cpu(index);
+    int wake_fd = router_attach(index);
+    int epoll_fd;
+    ERROR_CHECK(epoll_fd = epoll_create1(0));
+
+    /* Listeners and wake eventfd are level-triggered, told apart from connections by address,
+     * datagram sockets are served like connections */
+    int listen_socks[MAX_LISTENERS];
+    unsigned listening = 0;
+    struct epoll_event event = {.events = EPOLLIN};
+    for (unsigned i = 0; i < core_listeners_count; ++i) {
+        if (!listener_owned(&core_listeners[i], index)) continue;
+        int sock = listener_open(&core_listeners[i], true);
+        if (listener_is_datagram(&core_listeners[i])) {
+            add_input(epoll_fd, input_open_datagram(sock));
+            continue;
+        }
+        set_nonblocking(sock);
+        listen_socks[listening] = sock;
+        event.data.ptr = &listen_socks[listening++];
+        ERROR_CHECK(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event));
+    }
+    event.data.ptr = &wake_fd;
+    ERROR_CHECK(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event));
+
+    struct epoll_event events[MAX_EVENTS];
+    struct ready_list ready_list;
+    ready_init(&ready_list);
+    for (;;) {
+        router_flush();
+        bool idle = !router_drain() && ready_list.head == NULL;
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, idle && router_sleep() ? -1 : 0);
+        router_awake();
+        if (ready < 0 && errno == EINTR) continue;
+        ERROR_CHECK(ready);
+
+        struct input *queued = ready_take(&ready_list);
+        for (int i = 0; i < ready; ++i) {
+            uintptr_t tag = (uintptr_t) events[i].data.ptr;
+            if (tag >= (uintptr_t) listen_socks && tag < (uintptr_t) (listen_socks + listening)) {
+                accept_connections(*(int *) events[i].data.ptr, epoll_fd);
+            } else if (events[i].data.ptr == &wake_fd) {
+                /* Wakeups are either forwarded batches or maintenance requests */
+                uint64_t wakeups;
+                if (read(wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+                    ERROR("read");
+                }
+                router_maintain();
+            } else {
+                struct input *in = events[i].data.ptr;
+                if (events[i].events & (EPOLLRDHUP | EPOLLHUP))
+                    in->hangup = true;
+                if (!in->ready)
+                    core_readable(in, &ready_list);
+            }
+        }
+        while (queued != NULL) {
+            struct input *in = queued;
+            queued = in->next_ready;
+            core_readable(in, &ready_list);
+        }
+    }
+}
+
+/**
+ * Starts @p cores core threads, each with its own tcp and udp sockets, calling thread becomes the first one,
+ * which serves unix sockets too. Router has to be initialized for @p cores cores.
+ * @param listeners — listeners to open
+ * @param count — number of listeners
+ * @param cores — number of cores
+ * @return [noreturn]
+ */
+void run_core_loops(const struct listener *listeners, unsigned count, unsigned cores) {
+    core_listeners = listeners;
+    core_listeners_count = count;
+
+    pthread_t thread;
+    pthread_attr_t detached_attr;
+    NON_ZERO_CHECK(pthread_attr_init(&detached_attr));
+    NON_ZERO_CHECK(pthread_attr_setdetachstate(&detached_attr, PTHREAD_CREATE_DETACHED));
+    for (unsigned i = 1; i < cores; ++i) {
+        NON_ZERO_CHECK(pthread_create(&thread, &detached_attr, core_loop, (void *) (uintptr_t) i));
+    }
+    diagnostic("main-thread: Launched %u core threads.\n", cores);
+    core_loop((void *) 0);
+}
@@ -0,0 +1,46 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Interface for epoll based connection handling, serving every connection
+ * from a fixed set of threads, optionally each owning a part of hashtable.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#include "listener.h"
+
+/**
+ * Max number of events fetched by single @p epoll_wait.
+ */
+#define MAX_EVENTS 64
+/**
+ * Max number of receives from a connection per turn of event loop, so a fast sender can't starve the others.
+ */
+#define READ_BUDGET 16
+
+void run_event_loops(const struct listener *listeners, unsigned count, unsigned workers);
+
+void run_core_loops(const struct listener *listeners, unsigned count, unsigned cores);
+
+#endif /* _EVENT_LOOP_H_ */
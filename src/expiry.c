@@ -0,0 +1,90 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Implementation of expiry queues.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#include "expiry.h"
+#include "pool.h"
+#include "error.h"
+
+/**
+ * Pool of queue blocks, shared by all queues.
+ */
+static struct pool block_pool;
+
+/**
+ * Initializes pool of queue blocks.
+ */
+void init_expiry() {
+    pool_init(&block_pool, "expiry", sizeof(struct expiry_block));
+}
+
+/**
+ * Appends token at the end of a queue.
+ * @param queue[locked] — queue to append to
+ * @param id — id of created entry
+ * @param tick — tick of creation, not less than tick of any queued token
+ */
+void expiry_push(struct expiry_queue *queue, uint_least64_t id, uint32_t tick) {
+    struct expiry_block *block = queue->last;
+
+    if (block == NULL || block->tail == EXPIRY_BLOCK_TOKENS) {
+        NULL_CHECK(block = pool_alloc(&block_pool));
+        block->next = NULL;
+        block->head = block->tail = 0;
+        if (queue->last != NULL)
+            queue->last->next = block;
+        else
+            queue->first = block;
+        queue->last = block;
+    }
+
+    block->tokens[block->tail++] = (struct expiry_token) {.id = id, .tick = tick};
+}
+
+/**
+ * Finds the oldest token of a queue.
+ * @param queue[locked] — queue to search
+ * @return oldest token, or @p NULL if queue is empty
+ */
+const struct expiry_token *expiry_peek(const struct expiry_queue *queue) {
+    struct expiry_block *block = queue->first;
+    return block != NULL && block->head < block->tail ? &block->tokens[block->head] : NULL;
+}
+
+/**
+ * Removes the oldest token of a non-empty queue, frees its block once empty.
+ * @param queue[locked] — queue to remove from
+ */
+void expiry_pop(struct expiry_queue *queue) {
+    struct expiry_block *block = queue->first;
+
+    if (++block->head == block->tail) {
+        queue->first = block->next;
+        if (queue->first == NULL)
+            queue->last = NULL;
+        pool_free(&block_pool, block);
+    }
+}
@@ -0,0 +1,74 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Interface of expiry queues, ordering partial aggregates by creation time.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _EXPIRY_H_
+#define _EXPIRY_H_
+
+#include <stdint.h>
+
+/**
+ * Number of tokens in a single block of expiry queue.
+ */
+#define EXPIRY_BLOCK_TOKENS 62
+
+/**
+ * Scheduled expiry of an entry, valid only while the entry has the same birth tick.
+ */
+struct expiry_token {
+    uint_least64_t id;
+    /** Tick of the coarse clock, at which entry was created. */
+    uint32_t tick;
+};
+
+/**
+ * Block of tokens, node of expiry queue.
+ */
+struct expiry_block {
+    struct expiry_block *next;
+    /** First pending and first free token. */
+    unsigned head, tail;
+    struct expiry_token tokens[EXPIRY_BLOCK_TOKENS];
+};
+
+/**
+ * FIFO of tokens in order of creation time.
+ * With a single TTL for every entry, tokens expire in the order they were pushed,
+ * so the queue does the job of a timer wheel, with O(1) push and pop.
+ */
+struct expiry_queue {
+    struct expiry_block *first, *last;
+};
+
+void init_expiry();
+
+void expiry_push(struct expiry_queue *queue, uint_least64_t id, uint32_t tick);
+
+const struct expiry_token *expiry_peek(const struct expiry_queue *queue);
+
+void expiry_pop(struct expiry_queue *queue);
+
+#endif /* _EXPIRY_H_ */
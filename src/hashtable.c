@@ -18,22 +18,168 @@
 
 /**
  * @file
- * Implementation of static hashtable with linear collision resolving.
+ * Implementation of sharded, growable open-addressing hashtable.
+ * Collisions are resolved with Robin Hood linear probing, removal shifts
+ * following entries backwards, so no tombstones are ever left behind.
+ * Slot arrays replaced by writers are retired, so lock-free readers never touch unmapped memory.
  *
  * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
  * @date 10.05.2019
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "hashtable.h"
+#include "epoch.h"
+#include "pool.h"
+#include "error.h"
+
+#include <limits.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Array of shards, allocated by @ref init_hashtable.
+ */
+static struct hashtable_shard *shards;
+/**
+ * Logarithm of number of @ref shards.
+ */
+static unsigned shards_log;
+/**
+ * Size of every entry, header and payload.
+ */
+static size_t entry_size;
+/**
+ * Logarithm of max number of slots of a shard, within memory budget.
+ */
+static unsigned max_capacity_log;
+/**
+ * Called with entries evicted to stay within memory budget.
+ */
+static void (*evict_entry)(const struct entry_t *);
+
+/**
+ * Calculates size of slot array.
+ * @param capacity_log — logarithm of number of slots
+ * @return size of slot array in bytes
+ */
+static size_t slots_bytes(unsigned capacity_log) {
+    return entry_size << capacity_log;
+}
+
+/**
+ * Finds slot of given index.
+ * @param table — table to index
+ * @param position — index of a slot
+ * @return slot at @p position
+ */
+static struct entry_t *slot_at(const struct slots *table, size_t position) {
+    return (struct entry_t *) (table->slots + position * entry_size);
+}
+
+/**
+ * Allocates empty table in its own arena, so big tables may be backed by huge pages.
+ * @param table[out] — table to initialize
+ * @param capacity_log — logarithm of number of slots
+ * @return @p false on allocation failure, @p true otherwise
+ */
+static bool slots_init(struct slots *table, unsigned capacity_log) {
+    table->slots = arena_map(slots_bytes(capacity_log));
+    table->capacity_log = capacity_log;
+    table->size = 0;
+    return table->slots != NULL;
+}
+
+/**
+ * Releases slot array, once readers, which may still copy entries from it, leave their read sections.
+ * @param table — table, which slot array is no longer reachable from its shard
+ */
+static void slots_retire(const struct slots *table) {
+    epoch_retire(table->slots, slots_bytes(table->capacity_log), arena_unmap);
+}
+
+/**
+ * Initializes empty hashtable split into @p count shards.
+ * @param count — number of shards, power of two not greater than @ref HASHTABLE_SIZE
+ * @param payload_words — number of payload words of every entry, up to @ref MAX_PAYLOAD_WORDS
+ * @param budget — max size of slot arrays of all shards in bytes, zero if unlimited
+ * @param evict — called with every entry evicted to stay within @p budget, under lock of its shard
+ */
+void init_hashtable(unsigned count, unsigned payload_words, size_t budget,
+                    void (*evict)(const struct entry_t *)) {
+    entry_size = sizeof(struct entry_t) + payload_words * sizeof(uint_least64_t);
+    evict_entry = evict;
+    for (shards_log = 0; (1u << shards_log) < count; ++shards_log);
+
+    /* Split initial capacity among shards */
+    unsigned capacity_log, min_capacity_log;
+    for (capacity_log = 0; ((size_t) 1 << capacity_log) < MIN_SHARD_CAPACITY ||
+                           ((size_t) 1 << (capacity_log + shards_log)) < HASHTABLE_SIZE; ++capacity_log);
+    for (min_capacity_log = 0; ((size_t) 1 << min_capacity_log) < MIN_SHARD_CAPACITY; ++min_capacity_log);
+
+    /* Split budget among shards, growing shard holds both tables, the old one half as big */
+    max_capacity_log = sizeof(size_t) * CHAR_BIT - 1;
+    if (budget > 0) {
+        size_t shard_budget = budget >> shards_log;
+        for (max_capacity_log = min_capacity_log;
+             3 * (slots_bytes(max_capacity_log + 1) / 2) <= shard_budget; ++max_capacity_log);
+        if (3 * (slots_bytes(max_capacity_log) / 2) > shard_budget)
+            fprintf(stderr, "hashtable: Memory budget too small, using %zu bytes.\n",
+                    (3 * (slots_bytes(max_capacity_log) / 2)) << shards_log);
+        if (capacity_log > max_capacity_log)
+            capacity_log = max_capacity_log;
+    }
+
+    NON_ZERO_CHECK(posix_memalign((void **) &shards, CACHE_LINE_SIZE,
+                                  sizeof(struct hashtable_shard) << shards_log));
+    for (unsigned i = 0; i < (1u << shards_log); ++i) {
+        ERROR_CHECK(pthread_mutex_init(&shards[i].mutex, NULL));
+        atomic_init(&shards[i].sequence, 0);
+        if (!slots_init(&shards[i].current, capacity_log)) {
+            ERROR("slots_init")
+        }
+        shards[i].old.slots = NULL;
+        shards[i].migration_position = shards[i].migration_left = 0;
+        shards[i].clock_hand = 0;
+        shards[i].expiry.first = shards[i].expiry.last = NULL;
+    }
+}
+
+/**
+ * Returns size of every entry.
+ * @return size of entry header and payload in bytes
+ */
+size_t hashtable_entry_size() {
+    return entry_size;
+}
 
-#include <malloc.h>
+/**
+ * Returns number of shards.
+ * @return number of shards set by @ref init_hashtable
+ */
+unsigned hashtable_shard_count() {
+    return 1u << shards_log;
+}
+
+/**
+ * Finds shard by its index, for operations on whole hashtable.
+ * @param index — index of shard, less than @ref hashtable_shard_count
+ * @return shard of given index
+ */
+struct hashtable_shard *hashtable_shard_at(unsigned index) {
+    return &shards[index];
+}
 
 /**
- * Calculates (0 =<) hash (< number of buckets) for a key.
+ * Calculates uniform 64 bit hash for a key.
+ * Lowest bits of hash select the shard, highest bits select home slot in the shard.
  * @param id — key to calculate hash for
  * @return uniform hash for key @p id
  */
-static uint16_t hashtable_hash(uint_least64_t id) {
+uint_least64_t hashtable_hash(uint_least64_t id) {
     /* MurmurHash3 Mixer,
      * Read http://zimbry.blogspot.com/2011/09/better-bit-mixing-improving-on.html */
     id ^= id >> 33;
@@ -42,58 +188,556 @@ static uint16_t hashtable_hash(uint_least64_t id) {
     id *= 0xc4ceb9fe1a85ec53;
     id ^= id >> 33;
 
+    return id;
+}
+
+/**
+ * Finds index of shard responsible for key @p id.
+ * @param id — key to find shard for
+ * @return index of shard, less than @ref hashtable_shard_count
+ */
+unsigned hashtable_shard_index(uint_least64_t id) {
+    return (unsigned) (hashtable_hash(id) & ((1u << shards_log) - 1));
+}
+
+/**
+ * Finds shard responsible for key @p id.
+ * @param id — key to find shard for
+ * @return shard, which mutex has to be held while accessing @p id
+ */
+struct hashtable_shard *hashtable_shard(uint_least64_t id) {
+    return &shards[hashtable_shard_index(id)];
+}
+
+/**
+ * Calculates home slot of a hash.
+ * @param table — table to calculate slot in
+ * @param hash — hash of a key
+ * @return index of the first slot probed for the key
+ */
+static size_t slots_home(const struct slots *table, uint_least64_t hash) {
     /* Right shift calculated hash to fit in index space */
-    return (uint16_t) (id >> (64 - HASHTABLE_SIZE_LOG));
+    return (size_t) (hash >> (64 - table->capacity_log));
+}
+
+/**
+ * Finds entry associated with @p id in a single table.
+ * @param table — table to search
+ * @param id — key to search for
+ * @return found entry or @p NULL
+ */
+static struct entry_t *slots_find(const struct slots *table, uint_least64_t id) {
+    size_t mask = ((size_t) 1 << table->capacity_log) - 1;
+    size_t position = slots_home(table, hashtable_hash(id));
+
+    /* Robin Hood invariant – key cannot be further than poorer entry, nor than max distance */
+    for (size_t distance = 1; distance <= mask + 1 && distance <= UINT8_MAX;
+         ++distance, position = (position + 1) & mask) {
+        struct entry_t *it = slot_at(table, position);
+        if (it->distance < distance)
+            return NULL;
+        if (it->id == id)
+            return it;
+    }
+    return NULL;
+}
+
+/**
+ * Checks whether key can be inserted without pushing any entry beyond max distance of @p UINT8_MAX.
+ * New entry goes after poorer and equally poor ones, every entry from there to the next empty slot
+ * ends up at most one slot further.
+ * @param table — table with at least one free slot
+ * @param hash — hash of key to insert
+ * @return @p true if every distance stays within @p UINT8_MAX, @p false otherwise
+ */
+static bool slots_fits(const struct slots *table, uint_least64_t hash) {
+    size_t mask = ((size_t) 1 << table->capacity_log) - 1;
+    size_t position = slots_home(table, hash);
+    struct entry_t *it;
+
+    for (size_t distance = 1; (it = slot_at(table, position))->distance >= distance;
+         ++distance, position = (position + 1) & mask) {
+        if (distance == UINT8_MAX)
+            return false;
+    }
+    for (; it->distance != 0; position = (position + 1) & mask, it = slot_at(table, position)) {
+        if (it->distance == UINT8_MAX)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Inserts entry, which key is not present, into a table with at least one free slot,
+ * if @ref slots_fits allows it.
+ * @param table — table to insert into
+ * @param entry — entry to insert, its distance is recalculated
+ * @return slot, in which @p entry ended up
+ */
+static struct entry_t *slots_insert(struct slots *table, const struct entry_t *entry) {
+    _Alignas(struct entry_t) unsigned char buffers[2][MAX_ENTRY_SIZE];
+    struct entry_t *carried = (struct entry_t *) buffers[0], *displaced = (struct entry_t *) buffers[1];
+    size_t mask = ((size_t) 1 << table->capacity_log) - 1;
+    size_t position = slots_home(table, hashtable_hash(entry->id));
+    struct entry_t *result = NULL;
+
+    memcpy(carried, entry, entry_size);
+    ++table->size;
+    for (carried->distance = 1;; ++carried->distance, position = (position + 1) & mask) {
+        struct entry_t *it = slot_at(table, position);
+        if (it->distance == 0) {
+            memcpy(it, carried, entry_size);
+            return result != NULL ? result : it;
+        }
+
+        /* Take the place of richer entry, carry on with that entry instead */
+        if (it->distance < carried->distance) {
+            memcpy(displaced, it, entry_size);
+            memcpy(it, carried, entry_size);
+            struct entry_t *swap = carried;
+            carried = displaced;
+            displaced = swap;
+            if (result == NULL)
+                result = it;
+        }
+    }
+}
+
+/**
+ * Removes occupied slot, shifting following entries back to keep probe sequences intact.
+ * @param table — table to remove from
+ * @param entry — occupied slot of @p table
+ */
+static void slots_erase(struct slots *table, struct entry_t *entry) {
+    size_t mask = ((size_t) 1 << table->capacity_log) - 1;
+    size_t position = ((unsigned char *) entry - table->slots) / entry_size;
+
+    --table->size;
+    for (;;) {
+        size_t next = (position + 1) & mask;
+        struct entry_t *it = slot_at(table, position), *following = slot_at(table, next);
+
+        /* Stop at empty slot or entry in its home slot */
+        if (following->distance <= 1) {
+            it->distance = 0;
+            return;
+        }
+
+        memcpy(it, following, entry_size);
+        --it->distance;
+        position = next;
+    }
 }
 
 /**
- * Adds empty entry at the beginning of bucket corresponding to @p id.
+ * Moves some old entries to the current table, frees old table once empty.
+ * Stops only at empty slots, so every cluster is moved at once and probe
+ * sequences of entries left in the old table stay valid.
+ * @param shard[locked] — shard during migration
+ * @param step — number of slots to scan, unless in the middle of a cluster
+ */
+static void hashtable_migrate(struct hashtable_shard *shard, size_t step) {
+    size_t mask = ((size_t) 1 << shard->old.capacity_log) - 1;
+
+    for (; shard->migration_left > 0; --shard->migration_left, --step) {
+        struct entry_t *it = slot_at(&shard->old, shard->migration_position);
+        if (it->distance == 0 && step == 0)
+            return;
+
+        if (it->distance != 0) {
+            /* Entry, which would push its cluster beyond max distance, is evicted instead */
+            if (slots_fits(&shard->current, hashtable_hash(it->id)))
+                slots_insert(&shard->current, it);
+            else if (evict_entry != NULL)
+                evict_entry(it);
+            it->distance = 0;
+            --shard->old.size;
+        }
+        shard->migration_position = (shard->migration_position + 1) & mask;
+        if (step == 0)
+            ++step;
+    }
+
+    struct slots migrated = shard->old;
+    shard->old.slots = NULL;
+    slots_retire(&migrated);
+    diagnostic("hashtable: Migration finished, capacity: %zu.\n", (size_t) 1 << shard->current.capacity_log);
+}
+
+/**
+ * Starts migration to a table twice as big as the current one.
+ * @param shard[locked] — shard to grow, not during migration
+ * @return @p false on allocation failure, @p true otherwise
+ */
+static bool hashtable_grow(struct hashtable_shard *shard) {
+    struct slots grown;
+    ZERO_RETURN(slots_init(&grown, shard->current.capacity_log + 1));
+    shard->old = shard->current;
+    shard->current = grown;
+
+    /* Start migration at empty slot, so it never splits a cluster */
+    size_t capacity = (size_t) 1 << shard->old.capacity_log;
+    for (shard->migration_position = 0;
+         slot_at(&shard->old, shard->migration_position)->distance != 0;
+         ++shard->migration_position);
+    shard->migration_left = capacity;
+    return true;
+}
+
+/**
+ * Evicts entry of the current table.
+ * @param shard[locked] — shard of @p entry
+ * @param entry — occupied slot of the current table
+ */
+static void hashtable_evict_entry(struct hashtable_shard *shard, struct entry_t *entry) {
+    if (evict_entry != NULL)
+        evict_entry(entry);
+    slots_erase(&shard->current, entry);
+}
+
+/**
+ * Evicts entry of the current table, not accessed since the previous pass of the clock hand.
+ * Hand visits slots in scattered order, as evicting most of the entries it passes leaves
+ * the table sparse behind it and full ahead of it, with clusters growing beyond max distance.
+ * @param shard[locked] — shard with non-empty current table, not during migration
+ */
+static void hashtable_evict(struct hashtable_shard *shard) {
+    size_t mask = ((size_t) 1 << shard->current.capacity_log) - 1;
+
+    /* Every entry is cleared at most once, so at most two rounds are needed */
+    for (shard->clock_hand &= mask;; shard->clock_hand = (shard->clock_hand + CLOCK_STRIDE) & mask) {
+        struct entry_t *it = slot_at(&shard->current, shard->clock_hand);
+        if (it->distance == 0)
+            continue;
+        if (it->referenced) {
+            it->referenced = 0;
+            continue;
+        }
+
+        /* Hand stays in place, erasure shifts next entry into it */
+        hashtable_evict_entry(shard, it);
+        return;
+    }
+}
+
+/**
+ * Adds empty entry associated with @p id, growing the shard if needed,
+ * or evicting cold entry if shard reached its memory budget.
+ * @param shard — shard of @p id
  * @param id — id associated with new entry
- * @return pointer to new entry, or @p NULL on @p malloc failure
+ * @return pointer to new entry, or @p NULL on allocation failure
  */
-static struct entry_t *hashtable_add(uint_least64_t id) {
-    /* Create empty entry */
-    struct entry_t *new = malloc(sizeof(struct entry_t));
-    if (!new) return NULL;
+static struct entry_t *hashtable_add(struct hashtable_shard *shard, uint_least64_t id) {
+    size_t capacity = (size_t) 1 << shard->current.capacity_log;
+    size_t size = shard->current.size + (shard->old.slots != NULL ? shard->old.size : 0);
+
+    if ((size + 1) * MAX_LOAD_DENOMINATOR > capacity * MAX_LOAD_NUMERATOR) {
+        /* Previous migration has to be finished before the next one */
+        if (shard->old.slots != NULL)
+            hashtable_migrate(shard, shard->migration_left);
+        if (shard->current.capacity_log >= max_capacity_log)
+            hashtable_evict(shard);
+        else if (!hashtable_grow(shard) && shard->current.size + 1 == capacity)
+            return NULL;
+    }
+
+    /* Crafted or colliding ids may form a cluster, which insert would push beyond max distance.
+     * Half full table grows, so such clusters split, but never beyond twice the needed size.
+     * Otherwise entry in home slot is evicted, shortening the cluster. */
+    uint_least64_t hash = hashtable_hash(id);
+    while (!slots_fits(&shard->current, hash)) {
+        capacity = (size_t) 1 << shard->current.capacity_log;
+        if (shard->old.slots == NULL && shard->current.capacity_log < max_capacity_log &&
+            2 * shard->current.size >= capacity && hashtable_grow(shard))
+            continue;
+        hashtable_evict_entry(shard, slot_at(&shard->current, slots_home(&shard->current, hash)));
+    }
+
+    _Alignas(struct entry_t) unsigned char buffer[MAX_ENTRY_SIZE];
+    struct entry_t *new = (struct entry_t *) buffer;
+    memset(new, 0, entry_size);
     new->id = id;
-    new->count = 0;
+    new->referenced = 1;
+    return slots_insert(&shard->current, new);
+}
+
+/**
+ * Finds entry associated with key @p id, without creating it.
+ * @param shard[locked] — shard of @p id
+ * @param id — key, for which entry is being searched
+ * @return pointer to found entry or @p NULL, valid until next shard modification
+ */
+struct entry_t *hashtable_find(struct hashtable_shard *shard, uint_least64_t id) {
+    struct entry_t *it;
+
+    if (shard->old.slots != NULL && (it = slots_find(&shard->old, id)) != NULL)
+        return it;
+    return slots_find(&shard->current, id);
+}
+
+/**
+ * Copies entry associated with @p id from a single table, which may be modified meanwhile.
+ * Every slot is copied before it is inspected and probing is bounded, so torn reads end
+ * with a wrong result, rejected by validation of the caller, never with a wild access.
+ * @param table — copy of table description, validated by the caller
+ * @param id — key to search for
+ * @param copy[out] — copy of probed slots, of the found entry if any
+ * @return @p true if entry was found, @p false otherwise
+ */
+static bool slots_read(const struct slots *table, uint_least64_t id, struct entry_t *copy) {
+    size_t mask = ((size_t) 1 << table->capacity_log) - 1;
+    size_t position = slots_home(table, hashtable_hash(id));
+
+    for (size_t distance = 1; distance <= mask + 1 && distance <= UINT8_MAX;
+         ++distance, position = (position + 1) & mask) {
+        memcpy(copy, slot_at(table, position), entry_size);
+        if (copy->distance < distance)
+            return false;
+        if (copy->id == id)
+            return true;
+    }
+    return false;
+}
 
-    /* Append to the corresponding bucket */
-    uint16_t hash = hashtable_hash(id);
-    new->next = hashtable[hash];
-    return hashtable[hash] = new;
+/**
+ * Waits until no writer modifies a shard.
+ * @param shard — shard to read
+ * @return sequence of the shard, to validate copies made since
+ */
+static unsigned shard_read_begin(struct hashtable_shard *shard) {
+    unsigned sequence;
+    for (unsigned spins = 0; (sequence = atomic_load_explicit(&shard->sequence, memory_order_acquire)) & 1; ++spins) {
+        /* Writer may be preempted in its critical section */
+        if (spins >= READ_SPINS)
+            sched_yield();
+    }
+    return sequence;
+}
+
+/**
+ * Checks if a shard was not modified since @ref shard_read_begin.
+ * @param shard — shard read
+ * @param sequence — sequence returned by @ref shard_read_begin
+ * @return @p true if copies made since are consistent, @p false otherwise
+ */
+static bool shard_read_valid(struct hashtable_shard *shard, unsigned sequence) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&shard->sequence, memory_order_relaxed) == sequence;
+}
+
+/**
+ * Copies entry associated with key @p id, without taking the lock of its shard.
+ * Copy is retried until no writer modified the shard while it was made.
+ * Caller has to be in read section of @ref epoch_enter, so slot arrays it reads are not unmapped meanwhile.
+ * @param shard — shard of @p id
+ * @param id — key, for which entry is being copied
+ * @param copy[out] — copy of found entry, @ref hashtable_entry_size bytes
+ * @param retries[in,out] — incremented by every retried copy
+ * @return @p true if entry was found, @p false otherwise
+ */
+bool hashtable_read(struct hashtable_shard *shard, uint_least64_t id, struct entry_t *copy, unsigned *retries) {
+    for (;; ++*retries) {
+        unsigned sequence = shard_read_begin(shard);
+        struct slots current = shard->current, old = shard->old;
+        if (!shard_read_valid(shard, sequence))
+            continue;
+
+        bool found = (old.slots != NULL && slots_read(&old, id, copy)) || slots_read(&current, id, copy);
+        if (shard_read_valid(shard, sequence))
+            return found;
+    }
 }
 
 /**
  * Finds or create entry associated with key @p id.
+ * @param shard[locked] — shard of @p id
  * @param id — key, for which entry is being searched or created
- * @return pointer to found or newly created entry
+ * @return pointer to found or newly created entry, valid until next shard modification
  */
-struct entry_t *hashtable_get(uint_least64_t id) {
-    /* Find entry corresponding to id */
-    for (struct entry_t *it = hashtable[hashtable_hash(id)]; it != NULL; it = it->next)
-        if (it->id == id)
+struct entry_t *hashtable_get(struct hashtable_shard *shard, uint_least64_t id) {
+    struct entry_t *it;
+
+    if (shard->old.slots != NULL) {
+        /* Continue migration, then look in both tables */
+        hashtable_migrate(shard, MIGRATION_STEP);
+        if (shard->old.slots != NULL && (it = slots_find(&shard->old, id)) != NULL) {
+            it->referenced = 1;
             return it;
+        }
+    }
+    if ((it = slots_find(&shard->current, id)) != NULL) {
+        it->referenced = 1;
+        return it;
+    }
 
     /* Otherwise add new entry */
-    return hashtable_add(id);
+    return hashtable_add(shard, id);
 }
 
 /**
  * Removes entry associated with key @p id
+ * @param shard[locked] — shard of @p id
  * @param id — key, for which entry is being removed
  */
-void hashtable_remove(uint_least64_t id) {
-    /* Find link pointing to entry with given id */
-    struct entry_t **it;
-    for (it = &hashtable[hashtable_hash(id)];
-         *it != NULL && (*it)->id != id;
-         it = &(*it)->next);
+void hashtable_remove(struct hashtable_shard *shard, uint_least64_t id) {
+    struct entry_t *it;
+
+    if ((it = slots_find(&shard->current, id)) != NULL)
+        slots_erase(&shard->current, it);
+    else if (shard->old.slots != NULL && (it = slots_find(&shard->old, id)) != NULL)
+        slots_erase(&shard->old, it);
+}
+
+/**
+ * Removes every entry of a shard.
+ * @param shard[locked] — shard to empty
+ * @param visit — called with every entry before its removal
+ */
+void hashtable_drain(struct hashtable_shard *shard, void (*visit)(const struct entry_t *)) {
+    if (shard->old.slots != NULL) {
+        for (size_t i = 0; i < ((size_t) 1 << shard->old.capacity_log); ++i) {
+            struct entry_t *it = slot_at(&shard->old, i);
+            if (it->distance != 0)
+                visit(it);
+        }
+        struct slots drained = shard->old;
+        shard->old.slots = NULL;
+        slots_retire(&drained);
+    }
+
+    for (size_t i = 0; shard->current.size > 0; ++i) {
+        struct entry_t *it = slot_at(&shard->current, i);
+        if (it->distance != 0) {
+            visit(it);
+            it->distance = 0;
+            --shard->current.size;
+        }
+    }
+}
+
+/**
+ * Iterates over entries of a shard, in both tables while it grows.
+ * @param shard[locked] — shard to iterate over, not modified during iteration, but for entry payloads
+ * @param position[in,out] — position of iteration, zero before the first entry
+ * @return next entry, or @p NULL after the last one
+ */
+struct entry_t *hashtable_next(struct hashtable_shard *shard, size_t *position) {
+    size_t current = (size_t) 1 << shard->current.capacity_log;
+    size_t old = shard->old.slots != NULL ? (size_t) 1 << shard->old.capacity_log : 0;
+
+    while (*position < current + old) {
+        size_t i = (*position)++;
+        struct entry_t *it = i < current ? slot_at(&shard->current, i) : slot_at(&shard->old, i - current);
+        if (it->distance != 0)
+            return it;
+    }
+    return NULL;
+}
+
+/**
+ * Adds occupancy of table to the sums.
+ * @param table — table to scan
+ * @param occupancy[in,out] — sums to add to
+ */
+static void slots_occupancy(const struct slots *table, struct hashtable_occupancy *occupancy) {
+    size_t capacity = (size_t) 1 << table->capacity_log;
+    occupancy->entries += table->size;
+    occupancy->capacity += capacity;
 
-    if (*it != NULL) {
-        /* Remove entry from the bucket */
-        struct entry_t *subsititue = (*it)->next;
-        free(*it);
-        *it = subsititue;
+    for (size_t i = 0; i < capacity; ++i) {
+        unsigned distance = slot_at(table, i)->distance;
+        if (distance == 0) continue;
+        unsigned bucket = 0;
+        while ((1u << bucket) < distance)
+            ++bucket;
+        ++occupancy->probe_lengths[bucket];
+        occupancy->probe_length_sum += distance;
     }
-}
\ No newline at end of file
+}
+
+/**
+ * Adds occupancy of shard to the sums, scanning every slot.
+ * Probe length of an entry is number of slots inspected by successful lookup.
+ * @param shard[locked] — shard to scan
+ * @param occupancy[in,out] — sums to add to
+ */
+void hashtable_occupancy(const struct hashtable_shard *shard, struct hashtable_occupancy *occupancy) {
+    slots_occupancy(&shard->current, occupancy);
+    if (shard->old.slots != NULL)
+        slots_occupancy(&shard->old, occupancy);
+}
+
+/**
+ * Copies slot array of a shard, finishing its migration first, so a single table describes it.
+ * @param shard[locked] — shard to copy
+ * @param image[out] — description of copied table
+ * @param buffer[in,out] — buffer for slot array, replaced with a bigger one if needed
+ * @param capacity[in,out] — size of @p buffer
+ * @return size of copied slot array in bytes
+ */
+size_t hashtable_save(struct hashtable_shard *shard, struct hashtable_image *image,
+                      unsigned char **buffer, size_t *capacity) {
+    if (shard->old.slots != NULL)
+        hashtable_migrate(shard, shard->migration_left);
+
+    size_t bytes = slots_bytes(shard->current.capacity_log);
+    if (*capacity < bytes) {
+        free(*buffer);
+        NULL_CHECK(*buffer = malloc(bytes));
+        *capacity = bytes;
+    }
+    memcpy(*buffer, shard->current.slots, bytes);
+
+    image->capacity_log = shard->current.capacity_log;
+    image->size = shard->current.size;
+    image->clock_hand = shard->clock_hand;
+    return bytes;
+}
+
+/**
+ * Grows empty shard, so it holds @p entries without growing again, within memory budget.
+ * Bulk insertion then skips migrations through every smaller capacity.
+ * @param shard[locked] — empty shard, not during migration
+ * @param entries — number of entries to be inserted
+ * @return @p false if shard is not empty or on allocation failure, @p true otherwise
+ */
+bool hashtable_reserve(struct hashtable_shard *shard, size_t entries) {
+    if (shard->current.size != 0 || shard->old.slots != NULL)
+        return false;
+
+    unsigned capacity_log = shard->current.capacity_log;
+    while (capacity_log < max_capacity_log &&
+           entries * MAX_LOAD_DENOMINATOR > ((size_t) 1 << capacity_log) * MAX_LOAD_NUMERATOR)
+        ++capacity_log;
+    if (capacity_log == shard->current.capacity_log)
+        return true;
+
+    struct slots reserved;
+    ZERO_RETURN(slots_init(&reserved, capacity_log));
+    slots_retire(&shard->current);
+    shard->current = reserved;
+    return true;
+}
+
+/**
+ * Replaces empty table of a shard with slot array saved by @ref hashtable_save, mapped from file.
+ * Pages of the table are read on first access, so adopting even a big table takes a single @p mmap.
+ * @param shard[locked] — empty shard, not during migration
+ * @param image — description of saved table
+ * @param fd — file containing slot array
+ * @param offset — page aligned position of slot array in @p fd
+ * @return @p false if shard is not empty, table exceeds memory budget or can't be mapped, @p true otherwise
+ */
+bool hashtable_adopt(struct hashtable_shard *shard, const struct hashtable_image *image, int fd, off_t offset) {
+    if (shard->current.size != 0 || shard->old.slots != NULL || image->capacity_log > max_capacity_log)
+        return false;
+
+    unsigned char *slots;
+    ZERO_RETURN(slots = arena_map_file(fd, offset, slots_bytes(image->capacity_log)));
+    slots_retire(&shard->current);
+    shard->current.slots = slots;
+    shard->current.capacity_log = image->capacity_log;
+    shard->current.size = image->size;
+    shard->clock_hand = image->clock_hand;
+    return true;
+}
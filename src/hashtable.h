@@ -18,7 +18,11 @@
 
 /**
  * @file
- * Interface for static hashtable with linear collision resolving.
+ * Interface for sharded, growable open-addressing hashtable.
+ * Every shard is guarded by its own mutex, so messages for ids from
+ * different shards are aggregated concurrently. Shards use Robin Hood
+ * hashing with entries stored inline in the slot array.
+ * Readers copy entries without the mutex, validating copies by sequence of the shard.
  *
  * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
  * @date 10.05.2019
@@ -27,35 +31,187 @@
 #ifndef _HASHTABLE_H_
 #define _HASHTABLE_H_
 
+#include "expiry.h"
+
+#include <sys/types.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
 
 /**
- * Number of buckets.
+ * Initial number of slots, in all shards together.
  */
 #define HASHTABLE_SIZE 16384
-#define HASHTABLE_SIZE_LOG 14
 /**
- * Max number of same values associated with key.
+ * Minimal number of slots of a single shard.
+ */
+#define MIN_SHARD_CAPACITY 16
+/**
+ * Default number of independently locked shards.
+ */
+#define DEFAULT_SHARDS 64
+/**
+ * Assumed cache line size, shards are aligned to it to avoid false sharing.
+ */
+#define CACHE_LINE_SIZE 64
+/**
+ * Max load factor of a shard, as fraction of its capacity, before it starts growing.
  */
-#define VALUES_THRESHOLD 3
+#define MAX_LOAD_NUMERATOR 3
+#define MAX_LOAD_DENOMINATOR 4
+/**
+ * Number of old slots moved to the grown table by every @ref hashtable_get.
+ */
+#define MIGRATION_STEP 16
+/**
+ * Odd step of eviction clock hand, so it visits every slot of a table once per round.
+ */
+#define CLOCK_STRIDE 0x9e3779b97f4a7c15u
+/**
+ * Max number of payload words of a single entry.
+ */
+#define MAX_PAYLOAD_WORDS 32
+/**
+ * Number of power of two buckets of probe length histogram, the last one holds max distance of 255.
+ */
+#define PROBE_LENGTH_BUCKETS 9
+/**
+ * Number of spins of a reader waiting for writer of a shard, before it yields the processor.
+ */
+#define READ_SPINS 64
 
 /**
- * Linked hashtable entry.
+ * Hashtable entry, stored inline in slot array.
+ * Size of payload is fixed by @ref init_hashtable, so slots are @ref hashtable_entry_size apart.
  */
 struct entry_t {
     uint_least64_t id;
-    uint8_t count;
-    uint_least64_t values[VALUES_THRESHOLD];
-    struct entry_t *next;
+    /** Number of values aggregated so far. */
+    uint32_t count;
+    /** Distance from home slot plus one, zero marks empty slot. */
+    uint8_t distance;
+    /** CLOCK reference bit, set on every access, cleared by passing eviction hand. */
+    uint8_t referenced;
+    /** Low bits of creation tick, matched against @ref expiry_token. */
+    uint16_t birth;
+    /** Aggregation state, zeroed in new entries. */
+    uint_least64_t payload[];
 };
 
 /**
- * Static hashtable, as an array of buckets.
+ * Max size of an entry, for buffers holding entry copies.
+ */
+#define MAX_ENTRY_SIZE (sizeof(struct entry_t) + MAX_PAYLOAD_WORDS * sizeof(uint_least64_t))
+
+/**
+ * Open-addressing table, power of two sized array of slots.
+ */
+struct slots {
+    unsigned char *slots;
+    unsigned capacity_log;
+    /** Number of occupied slots. */
+    size_t size;
+};
+
+/**
+ * Independently locked part of hashtable.
+ * Grows incrementally – while @p old is not empty, every lookup consults both tables,
+ * and every @ref hashtable_get moves a few old entries to the current table.
+ */
+struct hashtable_shard {
+    /** Guards both tables of the shard. */
+    pthread_mutex_t mutex;
+    /** Odd while shard is modified, advanced by @ref hashtable_write_begin and @ref hashtable_write_end. */
+    _Atomic unsigned sequence;
+    struct slots current;
+    /** Table being migrated, empty if @p old.slots is @p NULL. */
+    struct slots old;
+    /** Next old slot to migrate and number of slots left to scan. */
+    size_t migration_position, migration_left;
+    /** Next slot of the current table considered for eviction. */
+    size_t clock_hand;
+    /** Entries of the shard in order of creation, if they expire. */
+    struct expiry_queue expiry;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/**
+ * Occupancy of shards, summed by @ref hashtable_occupancy.
  */
-extern struct entry_t *hashtable[HASHTABLE_SIZE];
+struct hashtable_occupancy {
+    size_t entries;
+    /** Slots of both tables, while shard grows. */
+    size_t capacity;
+    /** Number of entries found after at most 2^i probes, but more than 2^(i-1). */
+    size_t probe_lengths[PROBE_LENGTH_BUCKETS];
+    uint_least64_t probe_length_sum;
+};
+
+/**
+ * Table of a shard copied by @ref hashtable_save, slot array itself is stored separately.
+ */
+struct hashtable_image {
+    unsigned capacity_log;
+    /** Number of occupied slots. */
+    size_t size;
+    size_t clock_hand;
+};
+
+/**
+ * Starts modification of a shard, copies made by @ref hashtable_read meanwhile are retried.
+ * Has to bracket, with @ref hashtable_write_end, every change of tables or entries of a shard read concurrently.
+ * @param shard[locked] — shard to be modified
+ */
+static inline void hashtable_write_begin(struct hashtable_shard *shard) {
+    unsigned sequence = atomic_load_explicit(&shard->sequence, memory_order_relaxed);
+    atomic_store_explicit(&shard->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/**
+ * Ends modification of a shard started by @ref hashtable_write_begin.
+ * @param shard[locked] — modified shard
+ */
+static inline void hashtable_write_end(struct hashtable_shard *shard) {
+    unsigned sequence = atomic_load_explicit(&shard->sequence, memory_order_relaxed);
+    atomic_store_explicit(&shard->sequence, sequence + 1, memory_order_release);
+}
+
+void init_hashtable(unsigned shards, unsigned payload_words, size_t budget,
+                    void (*evict)(const struct entry_t *));
+
+size_t hashtable_entry_size();
+
+unsigned hashtable_shard_count();
+
+struct hashtable_shard *hashtable_shard_at(unsigned index);
+
+uint_least64_t hashtable_hash(uint_least64_t id);
+
+unsigned hashtable_shard_index(uint_least64_t id);
+
+struct hashtable_shard *hashtable_shard(uint_least64_t id);
+
+struct entry_t *hashtable_find(struct hashtable_shard *shard, uint_least64_t id);
+
+bool hashtable_read(struct hashtable_shard *shard, uint_least64_t id, struct entry_t *copy, unsigned *retries);
+
+struct entry_t *hashtable_get(struct hashtable_shard *shard, uint_least64_t id);
+
+void hashtable_remove(struct hashtable_shard *shard, uint_least64_t id);
+
+void hashtable_drain(struct hashtable_shard *shard, void (*visit)(const struct entry_t *));
+
+struct entry_t *hashtable_next(struct hashtable_shard *shard, size_t *position);
+
+void hashtable_occupancy(const struct hashtable_shard *shard, struct hashtable_occupancy *occupancy);
+
+size_t hashtable_save(struct hashtable_shard *shard, struct hashtable_image *image,
+                      unsigned char **buffer, size_t *capacity);
 
-struct entry_t *hashtable_get(uint_least64_t id);
+bool hashtable_reserve(struct hashtable_shard *shard, size_t entries);
 
-void hashtable_remove(uint_least64_t id);
+bool hashtable_adopt(struct hashtable_shard *shard, const struct hashtable_image *image, int fd, off_t offset);
 
-#endif /* _HASHTABLE_H_ */
\ No newline at end of file
+#endif /* _HASHTABLE_H_ */
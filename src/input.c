@@ -18,98 +18,270 @@
 
 /**
  * @file
- * Implementation of buffered reads from file descriptor.
+ * Implementation of per-connection input.
+ * Every receive is a single @p readv into free part of the ring buffer,
+ * followed by decoding of all received bytes in place.
+ * Datagram sockets are drained by @p recvmmsg in batches, every datagram decoded in its slot.
  *
  * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
  * @date 10.05.2019
  */
 
+#define _GNU_SOURCE
+
 #include "input.h"
+#include "pool.h"
+#include "metrics.h"
+#include "latency.h"
 #include "error.h"
 
-#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <string.h>
 #include <unistd.h>
 
 /**
- * Initializes new input buffer for a thread.
- * Has to be destroyed by @ref destroy_input_buffer.
+ * Size of every ring buffer, set by @ref init_input.
+ */
+static size_t input_buffer_size;
+/**
+ * Pools of @ref input structures with their buffers, without them, and with datagram slots.
  */
-void init_input_buffer() {
-    /* Init buffer */
-    struct buffer *b;
-    NULL_CHECK(b = malloc(sizeof(struct buffer)));
-    b->current = b->available = 0;
-
-    /* Save in input_buffer_key store */
-    ERROR_CHECK(pthread_setspecific(input_buffer_key, b));
+static struct pool input_pool, provided_input_pool, datagram_input_pool;
+/**
+ * Consumer of decoded messages, set by @ref init_input.
+ */
+static void (*input_consume)(const struct message *, size_t);
+
+/**
+ * Sets size of ring buffers and consumer of messages, has to be called before any connection is opened.
+ * @param buffer_size — size of ring buffer, power of two
+ * @param consume — called with every batch of decoded messages, by thread receiving them
+ */
+void init_input(size_t buffer_size, void (*consume)(const struct message *messages, size_t count)) {
+    input_buffer_size = buffer_size;
+    input_consume = consume;
+    pool_init(&input_pool, "inputs", sizeof(struct input) + buffer_size);
+    pool_init(&provided_input_pool, "provided inputs", sizeof(struct input));
+    pool_init(&datagram_input_pool, "datagram inputs", sizeof(struct input) + DATAGRAM_BATCH * MAX_DATAGRAM_SIZE);
 }
 
 /**
- * Frees memory associated with input-buffer.
+ * Creates input of a connection.
+ * @param sock — connection socket, blocking or not
+ * @return input, owning @p sock
  */
-void destroy_input_buffer() {
-    free(pthread_getspecific(input_buffer_key));
-    ERROR_CHECK(pthread_setspecific(input_buffer_key, NULL));
+struct input *input_open(int sock) {
+    struct input *in;
+    NULL_CHECK(in = pool_alloc(&input_pool));
+    in->sock = sock;
+    in->provided = false;
+    in->datagram = false;
+    in->head = in->tail = 0;
+    in->ready = false;
+    in->hangup = false;
+    decoder_init(&in->decoder);
+    metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+    return in;
 }
 
 /**
- * Reads exactly @p bytes, unless connection closes.
- * @param sock — sock to read from
- * @param output[out] — place to store read result
- * @param bytes — number of bytes to store
- * @return number of bytes stored
+ * Creates input of a connection, which bytes are received into buffers provided by the caller.
+ * @param sock — connection socket
+ * @return input without ring buffer, owning @p sock
  */
-int read_all(int sock, void *output, size_t bytes) {
-    size_t already_read = 0;
-    ssize_t read_len;
+struct input *input_open_provided(int sock) {
+    struct input *in;
+    NULL_CHECK(in = pool_alloc(&provided_input_pool));
+    in->sock = sock;
+    in->provided = true;
+    in->datagram = false;
+    in->ready = false;
+    in->hangup = false;
+    decoder_init(&in->decoder);
+    metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+    return in;
+}
+
+/**
+ * Creates input of a datagram socket, which is not counted as a connection.
+ * @param sock — bound datagram socket, blocking or not
+ * @return input with a slot per datagram of a batch, owning @p sock
+ */
+struct input *input_open_datagram(int sock) {
+    struct input *in;
+    NULL_CHECK(in = pool_alloc(&datagram_input_pool));
+    in->sock = sock;
+    in->provided = false;
+    in->datagram = true;
+    in->ready = false;
+    in->hangup = false;
+    decoder_init(&in->decoder);
+    return in;
+}
+
+/**
+ * Closes connection socket and releases its input.
+ * @param in[owner] — input to close
+ */
+void input_close(struct input *in) {
+    close(in->sock);
+    if (in->datagram) {
+        pool_free(&datagram_input_pool, in);
+        return;
+    }
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+    pool_free(in->provided ? &provided_input_pool : &input_pool, in);
+}
+
+/**
+ * Decodes messages from contiguous part of the ring buffer and passes them to consumer.
+ * @param in — connection input
+ * @param data — received bytes
+ * @param size — number of received bytes
+ * @return number of decoded messages
+ */
+static size_t input_decode(struct input *in, const uint8_t *data, size_t size) {
+    struct message messages[MESSAGES_BATCH];
+    size_t offset = 0, count, total = 0;
 
-    /* Read until read all bytes */
-    while (already_read != bytes) {
-        /* Try to read remaining */
-        read_len = read(sock, output + already_read, bytes - already_read);
-        already_read += read_len;
+    while (offset < size && !decoder_failed(&in->decoder)) {
+        offset += decode_messages(&in->decoder, data + offset, size - offset,
+                                  messages, MESSAGES_BATCH, &count);
+        input_consume(messages, count);
+        total += count;
+    }
+    return total;
+}
 
-        /* Check for socket closure */
-        if (read_len == 0)
-            return already_read;
+/**
+ * Receives a batch of datagrams by a single @p recvmmsg, and consumes messages of every one of them.
+ * Datagram holds whole messages, so it is decoded from scratch, and invalid data or a message
+ * incomplete at its end drop only the rest of that datagram. Blocking socket waits only for the first datagram.
+ * @param in — input of datagram socket
+ * Socket is never closed – failed receive is counted and reported as drained.
+ * @return @ref INPUT_MORE if batch was full, @ref INPUT_DRAINED otherwise
+ */
+static enum input_status datagram_receive(struct input *in) {
+    struct mmsghdr headers[DATAGRAM_BATCH];
+    struct iovec iov[DATAGRAM_BATCH];
+    memset(headers, 0, sizeof(headers));
+    for (size_t i = 0; i < DATAGRAM_BATCH; ++i) {
+        iov[i].iov_base = in->buffer + i * MAX_DATAGRAM_SIZE;
+        iov[i].iov_len = MAX_DATAGRAM_SIZE;
+        headers[i].msg_hdr.msg_iov = &iov[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int received;
+    do {
+        received = recvmmsg(in->sock, headers, DATAGRAM_BATCH, MSG_WAITFORONE, NULL);
+        metrics_add(METRIC_READS, 1);
+    } while (received < 0 && errno == EINTR);
 
-        /* Check for read errors */
-        ERROR_CHECK(read_len);
+    if (received < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            metrics_add(METRIC_WOULD_BLOCK, 1);
+            return INPUT_DRAINED;
+        }
+        /* Socket is shared by every sender, so errors like ENOMEM or ECONNREFUSED of udp are transient */
+        metrics_add(METRIC_DATAGRAM_ERRORS, 1);
+        return INPUT_DRAINED;
     }
+    latency_receive();
 
-    return already_read;
+    size_t messages = 0, bytes = 0, dropped = 0;
+    for (int i = 0; i < received; ++i) {
+        decoder_init(&in->decoder);
+        messages += input_decode(in, iov[i].iov_base, headers[i].msg_len);
+        bytes += headers[i].msg_len;
+        if ((headers[i].msg_hdr.msg_flags & MSG_TRUNC) || !decoder_idle(&in->decoder))
+            ++dropped;
+    }
+    metrics_add(METRIC_DATAGRAMS, received);
+    metrics_add(METRIC_DATAGRAMS_DROPPED, dropped);
+    metrics_add(METRIC_BYTES, bytes);
+    metrics_add(METRIC_MESSAGES, messages);
+    return received == DATAGRAM_BATCH ? INPUT_MORE : INPUT_DRAINED;
 }
 
 /**
- * Reads exactly @p bytes from buffer or from @p sock, prefetches available bytes.
- * @param sock — sock to read from, to buffer, or to @p output
- * @param output[out] — output to store read bytes
- * @param bytes — number of bytes to fetch
- * @return number of bytes read
+ * Reads once from connection socket, consumes every complete message.
+ * Short read means socket is drained, so edge-triggered event loops
+ * don't need additional read, that would only fail with @p EAGAIN.
+ * @param in — connection input, or input of datagram socket
+ * @return status of the connection
  */
-int buffered_read_all(int sock, void *output, size_t bytes) {
-    struct buffer *input_buffer = pthread_getspecific(input_buffer_key);
+enum input_status input_receive(struct input *in) {
+    if (in->datagram) return datagram_receive(in);
 
-    size_t available = input_buffer->available - input_buffer->current;
-    size_t transfered = MIN(available, bytes);
+    size_t mask = input_buffer_size - 1;
+    size_t tail = in->tail & mask;
+    size_t space = input_buffer_size - (in->tail - in->head);
 
-    /* Copy available bytes from buffer */
-    memcpy(output, input_buffer->buffer + input_buffer->current, transfered);
-    bytes -= transfered;
-    input_buffer->current += transfered;
+    /* Free space may wrap around the end of the buffer */
+    struct iovec iov[2] = {
+            {.iov_base = in->buffer + tail, .iov_len = space < input_buffer_size - tail ? space : input_buffer_size - tail},
+            {.iov_base = in->buffer, .iov_len = 0}
+    };
+    iov[1].iov_len = space - iov[0].iov_len;
 
-    /* On buffer boundary fetch rest of bytes from socket */
-    size_t total = transfered + read_all(sock, output + transfered, bytes);
+    ssize_t read_len;
+    do {
+        read_len = readv(in->sock, iov, iov[1].iov_len > 0 ? 2 : 1);
+        metrics_add(METRIC_READS, 1);
+    } while (read_len < 0 && errno == EINTR);
 
-    /* If buffer is empty */
-    if (input_buffer->current == input_buffer->available) {
-        input_buffer->current = 0;
+    if (read_len < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            metrics_add(METRIC_WOULD_BLOCK, 1);
+            return INPUT_DRAINED;
+        }
+        /* Treat read errors, like reset connection, as disconnect */
+        return INPUT_CLOSED;
+    }
+    /* Peer closed connection, trailing partial message is dropped */
+    if (read_len == 0) return INPUT_CLOSED;
+    in->tail += read_len;
+    latency_receive();
 
-        /* Read available bytes to buffer */
-        int count;
-        ERROR_CHECK(ioctl(sock, FIONREAD, &count));
-        input_buffer->available = read(sock, input_buffer->buffer, MIN(count, INPUT_BUFFER_SIZE));
+    /* Decode both parts of received bytes */
+    size_t head = in->head & mask;
+    size_t first = (size_t) read_len < input_buffer_size - head ? (size_t) read_len : input_buffer_size - head;
+    size_t messages = input_decode(in, in->buffer + head, first);
+    messages += input_decode(in, in->buffer, read_len - first);
+    in->head = in->tail;
+
+    metrics_add(METRIC_BYTES, read_len);
+    metrics_add(METRIC_MESSAGES, messages);
+
+    if (decoder_failed(&in->decoder)) {
+        metrics_add(METRIC_PARSE_FAILURES, 1);
+        return INPUT_CLOSED;
     }
+    return (size_t) read_len == space ? INPUT_MORE : INPUT_DRAINED;
+}
 
-    return total;
-}
\ No newline at end of file
+/**
+ * Consumes bytes received by the caller, into a buffer it owns, and aggregates every complete message.
+ * Once decoding fails, every following delivery is ignored.
+ * @param in — connection input, created by @ref input_open_provided
+ * @param data — received bytes, may be reused by the caller after return
+ * @param size — number of received bytes
+ * @return @ref INPUT_CLOSED on invalid data, @ref INPUT_DRAINED otherwise
+ */
+enum input_status input_deliver(struct input *in, const uint8_t *data, size_t size) {
+    if (decoder_failed(&in->decoder)) return INPUT_CLOSED;
+
+    latency_receive();
+    size_t messages = input_decode(in, data, size);
+    metrics_add(METRIC_READS, 1);
+    metrics_add(METRIC_BYTES, size);
+    metrics_add(METRIC_MESSAGES, messages);
+
+    if (decoder_failed(&in->decoder)) {
+        metrics_add(METRIC_PARSE_FAILURES, 1);
+        return INPUT_CLOSED;
+    }
+    return INPUT_DRAINED;
+}
@@ -18,7 +18,8 @@
 
 /**
  * @file
- * Interface for buffered reads from file descriptor.
+ * Interface for per-connection input – ring buffer of received bytes
+ * and decoding of messages it holds.
  *
  * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
  * @date 10.05.2019
@@ -27,38 +28,78 @@
 #ifndef _INPUT_H_
 #define _INPUT_H_
 
-#include <pthread.h>
+#include "protocol.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 
 /**
- * Usual min macro, using < as comparison.
+ * Default size of connection ring buffer.
  */
-#define MIN(x, y) (x) < (y) ? (x) : (y)
-
+#define DEFAULT_INPUT_BUFFER_SIZE (64 * 1024)
+/**
+ * Minimal size of connection ring buffer.
+ */
+#define MIN_INPUT_BUFFER_SIZE 4096
+/**
+ * Max number of datagrams received by a single @p recvmmsg.
+ */
+#define DATAGRAM_BATCH 32
 /**
- * Size of buffers stored in @ref input_buffer_key.
+ * Max size of datagram, larger ones are truncated, so their trailing message is dropped.
  */
-#define INPUT_BUFFER_SIZE 1024
+#define MAX_DATAGRAM_SIZE 9216
 
 /**
- * Input buffer, with two-way fill indicator.
+ * Connection input, allocated together with its ring buffer, unless bytes are received
+ * into buffers provided by the caller, see @ref input_deliver.
+ * Input of datagram socket has a slot of @ref MAX_DATAGRAM_SIZE bytes per datagram of a batch instead.
  */
-struct buffer {
-    char buffer[INPUT_BUFFER_SIZE];
-    int current, available;
+struct input {
+    int sock;
+    /** Whether input has no ring buffer, and is fed by @ref input_deliver. */
+    bool provided;
+    /** Whether input receives datagrams, every one decoded on its own. */
+    bool datagram;
+    /** Stream positions of the first not decoded byte and of the end of received bytes. */
+    size_t head, tail;
+    /** Decoder keeping message split between reads. */
+    struct decoder decoder;
+    /** Whether input is queued by its event loop, as its socket may hold more bytes. */
+    bool ready;
+    /** Whether peer closed connection, so a short read doesn't drain socket of its end. */
+    bool hangup;
+    /** Next input queued by the same event loop. */
+    struct input *next_ready;
+    /** Ring buffer, power of two sized. */
+    uint8_t buffer[];
 };
 
 /**
- * Container of thread-local input buffers, used by @ref buffered_read_all.
- * Has to be initialized before use by @ref pthread_key_create
+ * Result of @ref input_receive.
  */
-extern pthread_key_t input_buffer_key;
+enum input_status {
+    /** Socket drained, wait for readiness before next receive. */
+    INPUT_DRAINED,
+    /** Buffer was filled, socket may hold more bytes. */
+    INPUT_MORE,
+    /** Disconnect, read error or invalid data. */
+    INPUT_CLOSED
+};
+
+void init_input(size_t buffer_size, void (*consume)(const struct message *messages, size_t count));
+
+struct input *input_open(int sock);
+
+struct input *input_open_provided(int sock);
 
-void init_input_buffer();
+struct input *input_open_datagram(int sock);
 
-void destroy_input_buffer();
+void input_close(struct input *in);
 
-int read_all(int sock, void *output, size_t bytes);
+enum input_status input_receive(struct input *in);
 
-int buffered_read_all(int sock, void *output, size_t bytes);
+enum input_status input_deliver(struct input *in, const uint8_t *data, size_t size);
 
-#endif /* _INPUT_H_ */
\ No newline at end of file
+#endif /* _INPUT_H_ */
@@ -0,0 +1,188 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Implementation of optional latency histograms of complete aggregates.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "latency.h"
+#include "error.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+bool latency_enabled;
+_Thread_local uint_least64_t latency_received;
+_Thread_local struct latency_histograms *thread_latency;
+
+/**
+ * Registry of histograms of live threads, and sums of histograms of terminated ones.
+ */
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct latency_histograms *registry;
+static struct {
+    uint_least64_t buckets[NO_LATENCY_STAGES][LATENCY_BUCKETS];
+    uint_least64_t sum[NO_LATENCY_STAGES];
+    uint_least64_t max[NO_LATENCY_STAGES];
+} retired;
+static pthread_key_t latency_key;
+static pthread_once_t latency_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Label values of stages, and reported quantiles.
+ */
+static const char *const latency_stage_names[NO_LATENCY_STAGES] = {"update", "write", "total"};
+static const struct {
+    const char *label;
+    uint_least64_t per_million;
+} quantiles[] = {{"0.5", 500000}, {"0.99", 990000}, {"0.999", 999000}};
+
+/**
+ * Folds histograms of terminating thread into @ref retired and unregisters them.
+ * @param local_ptr — histograms of terminating thread
+ */
+static void latency_retire(void *local_ptr) {
+    struct latency_histograms *local = local_ptr;
+
+    ERROR_CHECK(pthread_mutex_lock(&registry_mutex));
+    for (int stage = 0; stage < NO_LATENCY_STAGES; ++stage) {
+        for (unsigned i = 0; i < LATENCY_BUCKETS; ++i)
+            retired.buckets[stage][i] += atomic_load_explicit(&local->buckets[stage][i], memory_order_relaxed);
+        retired.sum[stage] += atomic_load_explicit(&local->sum[stage], memory_order_relaxed);
+        uint_least64_t max = atomic_load_explicit(&local->max[stage], memory_order_relaxed);
+        if (max > retired.max[stage])
+            retired.max[stage] = max;
+    }
+    for (struct latency_histograms **it = &registry; *it != NULL; it = &(*it)->next) {
+        if (*it == local) {
+            *it = local->next;
+            break;
+        }
+    }
+    ERROR_CHECK(pthread_mutex_unlock(&registry_mutex));
+    free(local);
+}
+
+/**
+ * Creates key, which destructor retires histograms of terminating threads.
+ */
+static void latency_key_create() {
+    NON_ZERO_CHECK(pthread_key_create(&latency_key, latency_retire));
+}
+
+/**
+ * Allocates and registers histograms of the calling thread.
+ * @return zeroed histograms of the calling thread
+ */
+struct latency_histograms *latency_register() {
+    struct latency_histograms *local;
+    NON_ZERO_CHECK(pthread_once(&latency_once, latency_key_create));
+    NON_ZERO_CHECK(posix_memalign((void **) &local, CACHE_LINE_SIZE, sizeof(struct latency_histograms)));
+    for (int stage = 0; stage < NO_LATENCY_STAGES; ++stage) {
+        for (unsigned i = 0; i < LATENCY_BUCKETS; ++i)
+            atomic_init(&local->buckets[stage][i], 0);
+        atomic_init(&local->sum[stage], 0);
+        atomic_init(&local->max[stage], 0);
+    }
+    NON_ZERO_CHECK(pthread_setspecific(latency_key, local));
+
+    ERROR_CHECK(pthread_mutex_lock(&registry_mutex));
+    local->next = registry;
+    registry = local;
+    ERROR_CHECK(pthread_mutex_unlock(&registry_mutex));
+    return thread_latency = local;
+}
+
+/**
+ * Finds largest latency falling into bucket.
+ * @param bucket — index of bucket
+ * @return upper bound of bucket in nanoseconds
+ */
+static uint_least64_t latency_bucket_bound(unsigned bucket) {
+    if (bucket < 2 * LATENCY_SUB_BUCKETS) return bucket;
+    unsigned shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    uint_least64_t mantissa = bucket - shift * LATENCY_SUB_BUCKETS;
+    return (mantissa << shift) + ((uint_least64_t) 1 << shift) - 1;
+}
+
+/**
+ * Prints quantiles, sums, counts and maxima of latencies of every stage, merged over every thread,
+ * in Prometheus text format. Quantiles are upper bounds of their buckets, so overestimate by at most 1/32.
+ * @param output — stream to print to
+ */
+void latency_print(FILE *output) {
+    if (!latency_enabled) return;
+
+    uint_least64_t buckets[NO_LATENCY_STAGES][LATENCY_BUCKETS];
+    uint_least64_t sum[NO_LATENCY_STAGES], max[NO_LATENCY_STAGES];
+
+    ERROR_CHECK(pthread_mutex_lock(&registry_mutex));
+    for (int stage = 0; stage < NO_LATENCY_STAGES; ++stage) {
+        sum[stage] = retired.sum[stage];
+        max[stage] = retired.max[stage];
+        for (unsigned i = 0; i < LATENCY_BUCKETS; ++i)
+            buckets[stage][i] = retired.buckets[stage][i];
+        for (struct latency_histograms *it = registry; it != NULL; it = it->next) {
+            for (unsigned i = 0; i < LATENCY_BUCKETS; ++i)
+                buckets[stage][i] += atomic_load_explicit(&it->buckets[stage][i], memory_order_relaxed);
+            sum[stage] += atomic_load_explicit(&it->sum[stage], memory_order_relaxed);
+            uint_least64_t local_max = atomic_load_explicit(&it->max[stage], memory_order_relaxed);
+            if (local_max > max[stage])
+                max[stage] = local_max;
+        }
+    }
+    ERROR_CHECK(pthread_mutex_unlock(&registry_mutex));
+
+    fprintf(output, "# HELP aggregation_latency_seconds Latency of complete aggregates by stage.\n"
+                    "# TYPE aggregation_latency_seconds summary\n");
+    for (int stage = 0; stage < NO_LATENCY_STAGES; ++stage) {
+        uint_least64_t count = 0;
+        for (unsigned i = 0; i < LATENCY_BUCKETS; ++i)
+            count += buckets[stage][i];
+
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); ++q) {
+            /* Smallest bucket, up to which at least the quantile of latencies falls */
+            uint_least64_t rank = (count * quantiles[q].per_million + 999999) / 1000000, seen = 0, value = 0;
+            for (unsigned i = 0; i < LATENCY_BUCKETS && count > 0; ++i) {
+                seen += buckets[stage][i];
+                if (seen >= rank && seen > 0) {
+                    value = latency_bucket_bound(i);
+                    break;
+                }
+            }
+            if (value > max[stage])
+                value = max[stage];
+            fprintf(output, "aggregation_latency_seconds{stage=\"%s\",quantile=\"%s\"} %.9f\n",
+                    latency_stage_names[stage], quantiles[q].label, value / 1e9);
+        }
+        fprintf(output, "aggregation_latency_seconds_sum{stage=\"%s\"} %.9f\n"
+                        "aggregation_latency_seconds_count{stage=\"%s\"} %llu\n",
+                latency_stage_names[stage], sum[stage] / 1e9, latency_stage_names[stage], (unsigned long long) count);
+    }
+
+    fprintf(output, "# HELP aggregation_latency_max_seconds Largest latency of complete aggregates by stage.\n"
+                    "# TYPE aggregation_latency_max_seconds gauge\n");
+    for (int stage = 0; stage < NO_LATENCY_STAGES; ++stage)
+        fprintf(output, "aggregation_latency_max_seconds{stage=\"%s\"} %.9f\n", latency_stage_names[stage], max[stage] / 1e9);
+}
@@ -0,0 +1,142 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Interface of optional latency histograms of complete aggregates – from receiving the message
+ * completing an aggregate, through update of the hashtable, to write of the aggregate.
+ * Every thread records into its own log-linear histograms, which are merged only when read.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include "hashtable.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * Every power of two of nanoseconds is split into this many buckets, so a bucket is at most 1/32 of its values.
+ */
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1u << LATENCY_SUB_BITS)
+/**
+ * Latencies of at least 2^36 ns, about 69 s, share the last bucket.
+ */
+#define LATENCY_MAX_EXPONENT 36
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXPONENT - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/**
+ * Measured stages.
+ */
+enum latency_stage {
+    /** From receiving the message completing an aggregate to its removal from hashtable. */
+    LATENCY_UPDATE,
+    /** From removal of aggregate from hashtable to return from write of its batch. */
+    LATENCY_WRITE,
+    /** From receiving the message completing an aggregate to return from write of its batch. */
+    LATENCY_TOTAL,
+    NO_LATENCY_STAGES
+};
+
+/**
+ * Histograms of a single thread, written only by that thread.
+ */
+struct latency_histograms {
+    _Atomic uint_least64_t buckets[NO_LATENCY_STAGES][LATENCY_BUCKETS];
+    _Atomic uint_least64_t sum[NO_LATENCY_STAGES];
+    _Atomic uint_least64_t max[NO_LATENCY_STAGES];
+    /** Next thread in registry of all threads. */
+    struct latency_histograms *next;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/**
+ * Whether latencies are measured, set before other threads start.
+ */
+extern bool latency_enabled;
+
+/**
+ * Time, at which the calling thread received messages it aggregates, zero if unknown.
+ */
+extern _Thread_local uint_least64_t latency_received;
+
+/**
+ * Histograms of the calling thread, @p NULL until its first record.
+ */
+extern _Thread_local struct latency_histograms *thread_latency;
+
+struct latency_histograms *latency_register();
+
+void latency_print(FILE *output);
+
+/**
+ * Returns current time of monotonic clock.
+ * @return time in nanoseconds
+ */
+static inline uint_least64_t latency_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint_least64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Notes that the calling thread received messages it is about to decode, if latencies are measured.
+ */
+static inline void latency_receive() {
+    if (latency_enabled)
+        latency_received = latency_now();
+}
+
+/**
+ * Finds bucket of a latency – exact below @ref LATENCY_SUB_BUCKETS * 2 ns, then @ref LATENCY_SUB_BUCKETS
+ * buckets per power of two.
+ * @param ns — latency in nanoseconds
+ * @return index of bucket
+ */
+static inline unsigned latency_bucket(uint_least64_t ns) {
+    if (ns < 2 * LATENCY_SUB_BUCKETS) return (unsigned) ns;
+    unsigned exponent = 63 - __builtin_clzll(ns);
+    if (exponent >= LATENCY_MAX_EXPONENT) return LATENCY_BUCKETS - 1;
+    return (exponent - LATENCY_SUB_BITS) * LATENCY_SUB_BUCKETS + (unsigned) (ns >> (exponent - LATENCY_SUB_BITS));
+}
+
+/**
+ * Adds latency to histogram of the calling thread – plain loads and stores, as no other thread writes it.
+ * @param stage — measured stage
+ * @param ns — latency in nanoseconds
+ */
+static inline void latency_record(enum latency_stage stage, uint_least64_t ns) {
+    struct latency_histograms *local = thread_latency;
+    if (local == NULL)
+        local = latency_register();
+    _Atomic uint_least64_t *bucket = &local->buckets[stage][latency_bucket(ns)];
+    atomic_store_explicit(bucket, atomic_load_explicit(bucket, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&local->sum[stage],
+                          atomic_load_explicit(&local->sum[stage], memory_order_relaxed) + ns, memory_order_relaxed);
+    if (ns > atomic_load_explicit(&local->max[stage], memory_order_relaxed))
+        atomic_store_explicit(&local->max[stage], ns, memory_order_relaxed);
+}
+
+#endif /* _LATENCY_H_ */
@@ -0,0 +1,207 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Implementation of listening sockets.
+ * Tcp and udp sockets may be opened once per worker, sharing their port,
+ * unix sockets are bound to a file, so they are opened only once.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _GNU_SOURCE
+
+#include "listener.h"
+#include "error.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/**
+ * Requested receive buffer of datagram sockets, capped by the kernel at @p net.core.rmem_max.
+ * Datagrams are dropped once it is full, so it has to absorb bursts of many senders.
+ */
+#define DATAGRAM_SOCKET_BUFFER (4 * 1024 * 1024)
+
+/**
+ * Names of @ref listener_kind, as given on command line.
+ */
+static const char *const listener_names[] = {"tcp", "udp", "unix", "unixgram"};
+
+/**
+ * Parses listener address.
+ * @param spec — `tcp:port`, `udp:port`, `unix:path` or `unixgram:path`
+ * @param listener[out] — parsed listener, referring to @p spec
+ * @return @p false if @p spec is malformed
+ */
+bool parse_listener(const char *spec, struct listener *listener) {
+    const char *address = strchr(spec, ':');
+    if (address == NULL) return false;
+
+    size_t kind;
+    for (kind = 0; kind < sizeof(listener_names) / sizeof(listener_names[0]); ++kind) {
+        if (strlen(listener_names[kind]) == (size_t) (address - spec) &&
+            strncmp(spec, listener_names[kind], address - spec) == 0)
+            break;
+    }
+    if (kind == sizeof(listener_names) / sizeof(listener_names[0])) return false;
+    listener->kind = (enum listener_kind) kind;
+    ++address;
+
+    if (listener->kind == LISTENER_UNIX || listener->kind == LISTENER_UNIXGRAM) {
+        listener->path = address;
+        listener->port = 0;
+        return *address != '\0' && strlen(address) < sizeof(((struct sockaddr_un *) NULL)->sun_path);
+    }
+    char *end;
+    unsigned long port = strtoul(address, &end, 10);
+    listener->path = NULL;
+    listener->port = (uint16_t) port;
+    return *address != '\0' && *end == '\0' && port > 0 && port <= UINT16_MAX;
+}
+
+/**
+ * Checks whether listener receives datagrams, instead of accepting connections.
+ * @param listener — listener
+ * @return @p true for udp and unix datagram sockets
+ */
+bool listener_is_datagram(const struct listener *listener) {
+    return listener->kind == LISTENER_UDP || listener->kind == LISTENER_UNIXGRAM;
+}
+
+/**
+ * Checks whether worker opens its own socket of a listener, when every worker listens on its own sockets.
+ * @param listener — listener
+ * @param index — index of the worker
+ * @return @p true for tcp and udp, which port is shared, and for unix sockets only in the first worker
+ */
+bool listener_owned(const struct listener *listener, unsigned index) {
+    return index == 0 || listener->kind == LISTENER_TCP || listener->kind == LISTENER_UDP;
+}
+
+/**
+ * Creates blocking socket of a listener, listening for connections if it is a stream one.
+ * @param listener — listener
+ * @param reuse_port — whether other sockets may bind the same port, sharing its connections or datagrams,
+ * ignored by unix sockets
+ * @return listening socket
+ */
+int listener_open(const struct listener *listener, bool reuse_port) {
+    bool datagram = listener_is_datagram(listener);
+    bool local = listener->kind == LISTENER_UNIX || listener->kind == LISTENER_UNIXGRAM;
+    int sock;
+    ERROR_CHECK(sock = socket(local ? AF_UNIX : AF_INET, datagram ? SOCK_DGRAM : SOCK_STREAM, 0));
+
+    int enable = 1;
+    if (listener->kind == LISTENER_TCP) {
+        /* Ignore TIME_WAIT tcp state on server termination */
+        ERROR_CHECK(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)));
+    }
+    if (reuse_port && !local) {
+        ERROR_CHECK(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)));
+    }
+    if (datagram) {
+        int size = DATAGRAM_SOCKET_BUFFER;
+        ERROR_CHECK(setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(int)));
+    }
+
+    /* Bind server socket */
+    if (local) {
+        struct sockaddr_un listen_addr = {.sun_family = AF_UNIX};
+        strcpy(listen_addr.sun_path, listener->path);
+        /* Socket file left by previous run would fail bind, any other file is never replaced */
+        struct stat existing;
+        if (lstat(listener->path, &existing) == 0) {
+            if (!S_ISSOCK(existing.st_mode)) {
+                errno = EEXIST;
+                ERROR(listener->path);
+            }
+            ERROR_CHECK(unlink(listener->path));
+        } else if (errno != ENOENT) {
+            ERROR("lstat");
+        }
+        ERROR_CHECK(bind(sock, (struct sockaddr *) &listen_addr, sizeof(listen_addr)));
+    } else {
+        struct sockaddr_in listen_addr;
+        memset(&listen_addr, 0, sizeof(listen_addr));
+        listen_addr.sin_family = AF_INET;
+        listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        listen_addr.sin_port = htons(listener->port);
+        ERROR_CHECK(bind(sock, (struct sockaddr *) &listen_addr, sizeof(listen_addr)));
+    }
+
+    /* Switch to listening mode */
+    if (!datagram) {
+        ERROR_CHECK(listen(sock, BACKLOG_LENGTH));
+    }
+    if (local)
+        diagnostic("main-thread: Listening on %s socket %s.\n", listener_names[listener->kind], listener->path);
+    else
+        diagnostic("main-thread: Listening on %s port %u.\n", listener_names[listener->kind], listener->port);
+    return sock;
+}
+
+/**
+ * Switches socket into non-blocking mode.
+ * @param sock — socket to switch
+ */
+void set_nonblocking(int sock) {
+    int flags;
+    ERROR_CHECK(flags = fcntl(sock, F_GETFL));
+    ERROR_CHECK(fcntl(sock, F_SETFL, flags | O_NONBLOCK));
+}
+
+/**
+ * Accepts connection of any of stream listeners, waiting until one of them has a pending connection.
+ * Listeners are tried round-robin, so a busy one doesn't starve the others. Called by a single thread.
+ * @param socks — non-blocking listening sockets
+ * @param count — number of listening sockets, up to @ref MAX_LISTENERS
+ * @return accepted connection, blocking
+ */
+int listener_accept(const int *socks, unsigned count) {
+    static unsigned next = 0;
+    struct pollfd fds[MAX_LISTENERS];
+    for (unsigned i = 0; i < count; ++i) {
+        fds[i].fd = socks[i];
+        fds[i].events = POLLIN;
+    }
+
+    for (;;) {
+        for (unsigned i = 0; i < count; ++i) {
+            next = (next + 1) % count;
+            int client_sock = accept(socks[next], NULL, NULL);
+            if (client_sock >= 0) return client_sock;
+            /* Connection may be reset before it is accepted */
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR) {
+                ERROR("accept");
+            }
+        }
+        if (poll(fds, count, -1) < 0 && errno != EINTR) {
+            ERROR("poll");
+        }
+    }
+}
@@ -0,0 +1,83 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Interface for listening sockets – tcp and unix stream sockets accepting connections,
+ * and udp and unix datagram sockets, which datagrams carry whole messages.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _LISTENER_H_
+#define _LISTENER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Maximum number of listeners given on command line.
+ */
+#define MAX_LISTENERS 8
+/**
+ * Maximum number of pending connections on listening socket.
+ */
+#define BACKLOG_LENGTH 64
+/**
+ * Port of tcp listener used, unless any listener is given.
+ */
+#define DEFAULT_PORT 8080
+
+/**
+ * Socket types, on which server receives messages.
+ */
+enum listener_kind {
+    LISTENER_TCP,
+    LISTENER_UDP,
+    /** Unix domain stream socket. */
+    LISTENER_UNIX,
+    /** Unix domain datagram socket. */
+    LISTENER_UNIXGRAM
+};
+
+/**
+ * Address of a listener, parsed from `kind:port` or `kind:path`.
+ */
+struct listener {
+    enum listener_kind kind;
+    /** Port of tcp and udp listeners, on every interface. */
+    uint16_t port;
+    /** Socket file of unix listeners, replaced if it exists. */
+    const char *path;
+};
+
+bool parse_listener(const char *spec, struct listener *listener);
+
+bool listener_is_datagram(const struct listener *listener);
+
+bool listener_owned(const struct listener *listener, unsigned index);
+
+int listener_open(const struct listener *listener, bool reuse_port);
+
+void set_nonblocking(int sock);
+
+int listener_accept(const int *socks, unsigned count);
+
+#endif /* _LISTENER_H_ */
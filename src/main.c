@@ -24,76 +24,39 @@
  * @date 10.05.2019
  */
 
-#include "hashtable.h"
 #include "protocol.h"
 #include "input.h"
+#include "aggregator.h"
+#include "event_loop.h"
+#include "listener.h"
+#include "query.h"
+#include "publish.h"
+#include "router.h"
+#include "snapshot.h"
+#include "uring.h"
+#include "replay.h"
+#include "wal.h"
+#include "options.h"
+#include "stats.h"
+#include "latency.h"
+#include "pool.h"
 #include "error.h"
 
-#include <netinet/in.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <inttypes.h>
 
-/**
- * Maximum number of pending connections on main-thread socket.
- */
-#define BACKLOG_LENGTH 64
-/**
- * Port, on which server listen to incoming connections.
- */
-#define PORT 8080
-
-/**
- * Mutex to @ref hashtable, accessed by multiple @ref handle_connection.
- */
-pthread_mutex_t hashtable_mutex;
-/**
- * Hashtable to store id – value mapping with partial aggregation.
- */
-struct entry_t *hashtable[HASHTABLE_SIZE] = {NULL};
-
-/**
- * Definition of container of thread-local input buffers.
- */
-pthread_key_t input_buffer_key;
-
-
 /**
  * Reads incoming packets and aggregates them.
- * @param sock_ptr[owner] — wrapped client socket
+ * @param input_ptr[owner] — input of client connection, or of datagram socket
  * @return EXIT_SUCCESS or terminates program at serious failure.
  */
-void *handle_connection(void *sock_ptr) {
-    int sock = *(int *) sock_ptr;
-    /* Init thread local input buffer */
-    init_input_buffer();
-
+void *handle_connection(void *input_ptr) {
     /* Iterate over every message in a stream */
-    for (struct message m; next_message(sock, &m);) {
-        diagnostic("Got message; id: %" PRIuLEAST64 ", value: %" PRIuLEAST64 ".\n", m.id, m.value);
-
-        /* Process entry in critical section */
-        ERROR_CHECK(pthread_mutex_lock(&hashtable_mutex));
-
-        /* Add id — value mapping to hashtable */
-        struct entry_t *entry;
-        NULL_CHECK(entry = hashtable_get(m.id));
-        entry->values[entry->count++] = m.value;
-
-        if (entry->count == VALUES_THRESHOLD) {
-            /* Print and remove aggregated entries */
-            printf("id: %" PRIuLEAST64 ", values: %" PRIuLEAST64 ", %" PRIuLEAST64 ", %" PRIuLEAST64 "\n",
-                   entry->id, entry->values[0], entry->values[1], entry->values[2]);
-            fflush(stdout);
-            hashtable_remove(entry->id);
-        }
-
-        ERROR_CHECK(pthread_mutex_unlock(&hashtable_mutex));
-    }
+    while (input_receive(input_ptr) != INPUT_CLOSED);
 
     /* Release resources */
-    free(sock_ptr);
-    destroy_input_buffer();
-    close(sock);
+    input_close(input_ptr);
 
     /* Terminate thread */
     diagnostic("Thread exited.\n");
@@ -101,52 +64,114 @@ void *handle_connection(void *sock_ptr) {
 }
 
 /**
- * Initializes server and listen to incoming connections.
- * @return [noreturn]
+ * Launches detached thread for every datagram listener, blocking in receive of its socket.
+ * @param listeners — listeners, stream ones are skipped
+ * @param count — number of listeners
  */
-int main() {
-    /* Initialize thread local input buffers */
-    pthread_key_create(&input_buffer_key, NULL);
-
-    /* Init synchronization mechanisms */
-    ERROR_CHECK(pthread_mutex_init(&hashtable_mutex, NULL));
-
-    /* Create server socket */
-    int server_sock;
-    ERROR_CHECK(server_sock = socket(AF_INET, SOCK_STREAM, 0));
-
-    /* Ignore TIME_WAIT tcp state on server termination */
-    int enable = 1;
-    ERROR_CHECK(setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)));
-
-    /* Bind server socket */
-    struct sockaddr_in listen_addr;
-    listen_addr.sin_family = AF_INET;
-    listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    listen_addr.sin_port = htons(PORT);
-    ERROR_CHECK(bind(server_sock, (struct sockaddr *) &listen_addr, sizeof(listen_addr)));
+static void run_datagram_threads(const struct listener *listeners, unsigned count) {
+    pthread_attr_t detached_attr;
+    NON_ZERO_CHECK(pthread_attr_init(&detached_attr));
+    NON_ZERO_CHECK(pthread_attr_setdetachstate(&detached_attr, PTHREAD_CREATE_DETACHED));
 
-    /* Switch to listening mode */
-    ERROR_CHECK(listen(server_sock, BACKLOG_LENGTH));
-    diagnostic("main-thread: Listening on port %d.\n", PORT);
+    for (unsigned i = 0; i < count; ++i) {
+        if (!listener_is_datagram(&listeners[i])) continue;
+        pthread_t thread;
+        struct input *in = input_open_datagram(listener_open(&listeners[i], false));
+        NON_ZERO_CHECK(pthread_create(&thread, &detached_attr, handle_connection, in));
+    }
+}
 
+/**
+ * Launches detached thread for every accepted connection, and for every datagram socket – legacy connection model.
+ * @param listeners — listeners to open
+ * @param count — number of listeners
+ * @return [noreturn]
+ */
+static void run_thread_per_connection(const struct listener *listeners, unsigned count) {
     /* Pthread attribute to create detached threads */
     pthread_attr_t detached_attr;
     NON_ZERO_CHECK(pthread_attr_init(&detached_attr));
     NON_ZERO_CHECK(pthread_attr_setdetachstate(&detached_attr, PTHREAD_CREATE_DETACHED));
 
+    int socks[MAX_LISTENERS];
+    unsigned streams = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        if (listener_is_datagram(&listeners[i])) continue;
+        socks[streams] = listener_open(&listeners[i], false);
+        set_nonblocking(socks[streams++]);
+    }
+    run_datagram_threads(listeners, count);
+
+    /* Without stream listeners there is nothing to accept */
+    while (streams == 0)
+        pause();
     for (;;) {
         /* Accept incoming connection */
-        int client_sock;
-        ERROR_CHECK(client_sock = accept(server_sock, NULL, NULL));
+        int client_sock = listener_accept(socks, streams);
         diagnostic("main-thread: Accepted client connection.\n");
 
         /* Launch new thread to handle it */
         pthread_t thread;
-        int *client_sock_ptr;
-        NULL_CHECK(client_sock_ptr = malloc(sizeof(int)));
-        *client_sock_ptr = client_sock;
-        ERROR_CHECK(pthread_create(&thread, &detached_attr, handle_connection, client_sock_ptr));
+        ERROR_CHECK(pthread_create(&thread, &detached_attr, handle_connection, input_open(client_sock)));
         diagnostic("main-thread: Launched new detached thread.\n");
     }
 }
+
+/**
+ * Initializes server and listen to incoming connections.
+ * @param argc — number of arguments
+ * @param argv — arguments, see @ref parse_options
+ * @return [noreturn]
+ */
+int main(int argc, char *argv[]) {
+    parse_options(argc, argv);
+    latency_enabled = options.latency;
+    start_signal_thread();
+
+    /* Init hashtable and its synchronization mechanisms */
+    init_arenas(options.hugepages);
+    /* With write-ahead log, aggregates are written only once messages they are made of are durable */
+    if (options.publish_enabled)
+        init_publish(&options.publish);
+    init_output(&options.output, &options.aggregation, options.wal_path != NULL ? wal_barrier : NULL,
+                options.publish_enabled ? publish : NULL);
+    if (options.eviction_path != NULL)
+        init_eviction_output(options.eviction_path);
+    if (options.mode == MODE_CORES) {
+        /* Cores own shards, so they aggregate, and maintain them, without locks */
+        init_router(options.workers, options.shards);
+        init_aggregator(options.shards, &options.aggregation, router_wake_all);
+        init_input(options.input_buffer_size, router_route);
+        if (options.snapshot_path != NULL)
+            init_snapshots(options.snapshot_path, options.snapshot_interval_ms, &options.aggregation, router_wake_all);
+        if (options.query_enabled)
+            init_query(&options.query, &options.aggregation);
+        run_core_loops(options.listeners, options.listeners_count, options.workers);
+    }
+    init_aggregator(options.shards, &options.aggregation, NULL);
+    if (options.wal_path != NULL)
+        init_wal(options.wal_path, options.wal_batch_size, options.wal_batch_delay_ms, aggregate_messages);
+    init_input(options.input_buffer_size, options.wal_path != NULL ? wal_consume : aggregate_messages);
+    if (options.snapshot_path != NULL)
+        init_snapshots(options.snapshot_path, options.snapshot_interval_ms, &options.aggregation, NULL);
+    /* Queries read shards without locks, once they are restored */
+    if (options.query_enabled)
+        init_query(&options.query, &options.aggregation);
+    if (options.mode == MODE_REPLAY)
+        run_replay(options.captures, options.captures_count, options.workers);
+    /* Uring workers listen on their own sockets, epoll serves connections on kernels without io_uring,
+     * datagrams are received by threads of their own */
+    if (options.mode == MODE_URING) {
+        if (uring_supported()) {
+            run_datagram_threads(options.listeners, options.listeners_count);
+            run_uring_loops(options.listeners, options.listeners_count, options.workers);
+        }
+        fprintf(stderr, "io_uring is unsupported, falling back to epoll.\n");
+    }
+
+    /* Serve connections with selected model */
+    if (options.mode == MODE_THREADS)
+        run_thread_per_connection(options.listeners, options.listeners_count);
+    else
+        run_event_loops(options.listeners, options.listeners_count, options.workers);
+}
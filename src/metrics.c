@@ -0,0 +1,158 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Implementation of always-on counters.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "metrics.h"
+#include "error.h"
+
+#include <pthread.h>
+
+_Thread_local struct metrics *thread_metrics;
+
+/**
+ * Registry of counters of live threads, and sums of counters of terminated ones.
+ */
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics *registry;
+static uint_least64_t retired[NO_METRICS];
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Prometheus names, types and descriptions of counters.
+ */
+static const struct {
+    const char *name, *type, *help;
+} metric_names[NO_METRICS] = {
+        {"aggregation_messages_total", "counter", "Decoded messages."},
+        {"aggregation_parse_failures_total", "counter", "Connections closed on invalid data."},
+        {"aggregation_read_bytes_total", "counter", "Bytes read from connections."},
+        {"aggregation_reads_total", "counter", "Read syscalls, including ones that would block."},
+        {"aggregation_reads_would_block_total", "counter", "Read syscalls failed with EAGAIN."},
+        {"aggregation_connections_total", "counter", "Accepted connections."},
+        {"aggregation_connections_closed_total", "counter", "Closed connections."},
+        {"aggregation_datagrams_total", "counter", "Datagrams received by udp and unix datagram sockets."},
+        {"aggregation_datagrams_dropped_total", "counter", "Datagrams, which rest was dropped at invalid or incomplete message."},
+        {"aggregation_datagram_errors_total", "counter", "Receives of datagram sockets failed with an error, which did not close them."},
+        {"aggregation_lock_contended_total", "counter", "Shard lock acquisitions, which had to wait."},
+        {"aggregation_lock_wait_seconds_total", "counter", "Time spent waiting for shard locks."},
+        {"aggregation_expired_total", "counter", "Incomplete aggregates expired after TTL."},
+        {"aggregation_evicted_total", "counter", "Incomplete aggregates evicted to stay within memory budget."},
+        {"aggregation_forwarded_total", "counter", "Messages forwarded to cores owning their shards."},
+        {"aggregation_ring_full_total", "counter", "Forwarding attempts, which found ring to other core full."},
+        {"aggregation_wal_commits_total", "counter", "Batches written to write-ahead log, with a single sync each."},
+        {"aggregation_wal_bytes_total", "counter", "Bytes written to write-ahead log."},
+        {"aggregation_queries_total", "counter", "Ids answered by queries of partial aggregates."},
+        {"aggregation_query_retries_total", "counter", "Lock-free reads of partial aggregates retried after concurrent change."},
+        {"aggregation_publish_bytes_total", "counter", "Bytes of complete aggregates sent to subscribers."},
+        {"aggregation_publish_dropped_total", "counter", "Complete aggregates skipped by lagging subscribers."},
+        {"aggregation_publish_lag_disconnects_total", "counter", "Subscribers disconnected for lag."}
+};
+
+/**
+ * Folds counters of terminating thread into @ref retired and unregisters them.
+ * @param local_ptr — counters of terminating thread
+ */
+static void metrics_retire(void *local_ptr) {
+    struct metrics *local = local_ptr;
+
+    ERROR_CHECK(pthread_mutex_lock(&registry_mutex));
+    for (int i = 0; i < NO_METRICS; ++i)
+        retired[i] += atomic_load_explicit(&local->counters[i], memory_order_relaxed);
+    for (struct metrics **it = &registry; *it != NULL; it = &(*it)->next) {
+        if (*it == local) {
+            *it = local->next;
+            break;
+        }
+    }
+    ERROR_CHECK(pthread_mutex_unlock(&registry_mutex));
+    free(local);
+}
+
+/**
+ * Creates key, which destructor retires counters of terminating threads.
+ */
+static void metrics_key_create() {
+    NON_ZERO_CHECK(pthread_key_create(&metrics_key, metrics_retire));
+}
+
+/**
+ * Allocates and registers counters of the calling thread.
+ * @return zeroed counters of the calling thread
+ */
+struct metrics *metrics_register() {
+    struct metrics *local;
+    NON_ZERO_CHECK(pthread_once(&metrics_once, metrics_key_create));
+    NON_ZERO_CHECK(posix_memalign((void **) &local, CACHE_LINE_SIZE, sizeof(struct metrics)));
+    for (int i = 0; i < NO_METRICS; ++i)
+        atomic_init(&local->counters[i], 0);
+    NON_ZERO_CHECK(pthread_setspecific(metrics_key, local));
+
+    ERROR_CHECK(pthread_mutex_lock(&registry_mutex));
+    local->next = registry;
+    registry = local;
+    ERROR_CHECK(pthread_mutex_unlock(&registry_mutex));
+    return thread_metrics = local;
+}
+
+/**
+ * Sums counters of every thread, live or terminated.
+ * @param counters[out] — sums of every counter
+ */
+void metrics_read(uint_least64_t counters[NO_METRICS]) {
+    ERROR_CHECK(pthread_mutex_lock(&registry_mutex));
+    for (int i = 0; i < NO_METRICS; ++i) {
+        counters[i] = retired[i];
+        for (struct metrics *it = registry; it != NULL; it = it->next)
+            counters[i] += atomic_load_explicit(&it->counters[i], memory_order_relaxed);
+    }
+    ERROR_CHECK(pthread_mutex_unlock(&registry_mutex));
+}
+
+/**
+ * Prints every counter, and open connections derived from them, in Prometheus text format.
+ * @param output — stream to print to
+ */
+void metrics_print(FILE *output) {
+    uint_least64_t counters[NO_METRICS];
+    metrics_read(counters);
+
+    for (int i = 0; i < NO_METRICS; ++i) {
+        fprintf(output, "# HELP %s %s\n# TYPE %s %s\n", metric_names[i].name, metric_names[i].help,
+                metric_names[i].name, metric_names[i].type);
+        if (i == METRIC_LOCK_WAIT_NS)
+            fprintf(output, "%s %.9f\n", metric_names[i].name, counters[i] / 1e9);
+        else
+            fprintf(output, "%s %llu\n", metric_names[i].name, (unsigned long long) counters[i]);
+    }
+
+    fprintf(output, "# HELP aggregation_connections_open Open connections.\n"
+                    "# TYPE aggregation_connections_open gauge\n"
+                    "aggregation_connections_open %llu\n",
+            (unsigned long long) (counters[METRIC_CONNECTIONS_OPENED] - counters[METRIC_CONNECTIONS_CLOSED]));
+}
@@ -0,0 +1,109 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Interface of always-on counters – every thread increments its own copy,
+ * copies are summed only when counters are read.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "hashtable.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Counters, in order of @ref metric_names.
+ */
+enum metric {
+    METRIC_MESSAGES,
+    METRIC_PARSE_FAILURES,
+    METRIC_BYTES,
+    /** Read syscalls, including ones that would block. */
+    METRIC_READS,
+    METRIC_WOULD_BLOCK,
+    METRIC_CONNECTIONS_OPENED,
+    METRIC_CONNECTIONS_CLOSED,
+    /** Received datagrams, ones with invalid, truncated or incomplete messages, and failed receives. */
+    METRIC_DATAGRAMS,
+    METRIC_DATAGRAMS_DROPPED,
+    METRIC_DATAGRAM_ERRORS,
+    /** Shard lock acquisitions, which had to wait, and time spent waiting. */
+    METRIC_LOCK_CONTENDED,
+    METRIC_LOCK_WAIT_NS,
+    METRIC_EXPIRED,
+    METRIC_EVICTED,
+    /** Messages forwarded to cores owning their shards, and waits for a full ring. */
+    METRIC_FORWARDED,
+    METRIC_RING_FULL,
+    /** Batches synced to write-ahead log, and bytes written to it. */
+    METRIC_WAL_COMMITS,
+    METRIC_WAL_BYTES,
+    /** Answered ids, and copies of entries retried as writer changed their shard meanwhile. */
+    METRIC_QUERIES,
+    METRIC_QUERY_RETRIES,
+    /** Bytes sent to subscribers, aggregates skipped by lagging ones, and ones disconnected for lag. */
+    METRIC_PUBLISH_BYTES,
+    METRIC_PUBLISH_DROPPED,
+    METRIC_PUBLISH_DISCONNECTS,
+    NO_METRICS
+};
+
+/**
+ * Counters of a single thread, written only by that thread.
+ */
+struct metrics {
+    _Atomic uint_least64_t counters[NO_METRICS];
+    /** Next thread in registry of all threads. */
+    struct metrics *next;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/**
+ * Counters of the calling thread, @p NULL until its first update.
+ */
+extern _Thread_local struct metrics *thread_metrics;
+
+struct metrics *metrics_register();
+
+/**
+ * Adds to counter of the calling thread – plain load and store, as no other thread writes it.
+ * @param metric — counter to increase
+ * @param value — value to add
+ */
+static inline void metrics_add(enum metric metric, uint_least64_t value) {
+    struct metrics *local = thread_metrics;
+    if (local == NULL)
+        local = metrics_register();
+    atomic_store_explicit(&local->counters[metric],
+                          atomic_load_explicit(&local->counters[metric], memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+void metrics_read(uint_least64_t counters[NO_METRICS]);
+
+void metrics_print(FILE *output);
+
+#endif /* _METRICS_H_ */
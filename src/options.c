@@ -0,0 +1,411 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Implementation of command line configuration of the server.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "options.h"
+#include "hashtable.h"
+#include "input.h"
+#include "snapshot.h"
+#include "wal.h"
+#include "error.h"
+
+#include <unistd.h>
+
+struct options options = {
+        .mode = MODE_EPOLL,
+        .workers = 0,
+        .listeners_count = 0,
+        .query_enabled = false,
+        .publish = {
+                .ring_size = DEFAULT_PUBLISH_RING_SIZE,
+                .lag_policy = LAG_DROP
+        },
+        .publish_enabled = false,
+        .shards = DEFAULT_SHARDS,
+        .hugepages = HUGEPAGES_OFF,
+        .input_buffer_size = DEFAULT_INPUT_BUFFER_SIZE,
+        .aggregation = {
+                .fields = 0,
+                .threshold = DEFAULT_VALUES_THRESHOLD,
+                .window_ms = 0,
+                .ttl_ms = 0,
+                .expiry = EXPIRY_EMIT,
+                .memory_budget = 0
+        },
+        .output = {
+                .format = OUTPUT_TEXT,
+                .buffer_size = DEFAULT_OUTPUT_BUFFER_SIZE,
+                .flush_interval_ms = DEFAULT_FLUSH_INTERVAL_MS,
+                .line_mode = false
+        },
+        .eviction_path = NULL,
+        .snapshot_path = NULL,
+        .snapshot_interval_ms = DEFAULT_SNAPSHOT_INTERVAL_MS,
+        .wal_path = NULL,
+        .wal_batch_size = DEFAULT_WAL_BATCH_SIZE,
+        .wal_batch_delay_ms = DEFAULT_WAL_BATCH_DELAY_MS,
+        .latency = false,
+        .captures = NULL,
+        .captures_count = 0
+};
+
+/**
+ * Prints usage information and terminates.
+ * @param name — program name
+ */
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [-m epoll|threads|cores|uring|replay] [-w workers] [-l kind:address]... [-q kind:address]\n"
+            "          [-p kind:address] [-g drop|disconnect] [-G bytes]\n"
+            "          [-s shards] [-P off|thp|hugetlb] [-b bytes]\n"
+            "          [-a values|count,sum,min,max] [-n values] [-T milliseconds]\n"
+            "          [-e milliseconds] [-E emit|drop] [-M bytes] [-V path]\n"
+            "          [-o text|msgpack] [-O bytes] [-F milliseconds] [-L] [-S path] [-I milliseconds]\n"
+            "          [-W directory] [-B bytes] [-D milliseconds] [-t] [capture files...]\n"
+            "  -m  connection handling model, or replay of capture files and exit (default: epoll)\n"
+            "  -w  number of event-loop threads, or cores, or files replayed in parallel\n"
+            "      (default: number of cpus, 1 for replay)\n"
+            "  -l  listener tcp:port, udp:port, unix:path or unixgram:path, up to %d times (default: tcp:%d)\n"
+            "  -q  listener tcp:port or unix:path, on which partial aggregates are queried (default: none)\n"
+            "  -p  listener tcp:port or unix:path, on which complete aggregates are published (default: none)\n"
+            "  -g  whether subscribers lagging half of the ring behind skip aggregates or are disconnected\n"
+            "      (default: drop)\n"
+            "  -G  ring of published aggregates, power of two, at least 4 output buffers (default: %d)\n"
+            "  -s  number of hashtable shards, power of two up to %d (default: %d)\n"
+            "  -P  huge page backing of hashtable arenas (default: off)\n"
+            "  -b  per-connection buffer size, power of two, at least %d (default: %d)\n"
+            "  -a  raw values, or comma separated statistics, aggregated per id (default: values)\n"
+            "  -n  number of values completing an aggregate, up to %d raw values,\n"
+            "      0 for statistics emitted only at the end of window (default: %d)\n"
+            "  -T  tumbling window, after which partial aggregates are emitted (default: none)\n"
+            "  -e  time after which incomplete aggregate expires (default: never)\n"
+            "  -E  whether expired aggregates are emitted or dropped (default: emit)\n"
+            "  -M  memory budget of hashtable, cold aggregates are evicted beyond it (default: none)\n"
+            "  -V  file, to which evicted aggregates are appended (default: none)\n"
+            "  -o  format of aggregates on stdout (default: text)\n"
+            "  -O  output buffer size, at least %d (default: %d)\n"
+            "  -F  max time aggregate waits in output buffer (default: %d ms)\n"
+            "  -L  write every aggregate as soon as it is complete\n"
+            "  -S  snapshot file, partial aggregates are restored from it and saved to it (default: none)\n"
+            "  -I  time between snapshots, 0 to save only at shutdown (default: %d ms)\n"
+            "  -W  directory of write-ahead log of accepted messages, requires -S, not with -m cores (default: none)\n"
+            "  -B  bytes of messages, which commit a batch of the log at once (default: %d)\n"
+            "  -D  max time message waits for commit of its batch (default: %d ms)\n"
+            "  -t  measure latencies of complete aggregates, from receipt to write, not with -m replay\n"
+            "Send SIGUSR1 to print statistics to stderr.\n",
+            name, MAX_LISTENERS, DEFAULT_PORT, DEFAULT_PUBLISH_RING_SIZE, HASHTABLE_SIZE, DEFAULT_SHARDS, MIN_INPUT_BUFFER_SIZE, DEFAULT_INPUT_BUFFER_SIZE,
+            MAX_VALUES_THRESHOLD, DEFAULT_VALUES_THRESHOLD,
+            MAX_RECORD_LENGTH, DEFAULT_OUTPUT_BUFFER_SIZE, DEFAULT_FLUSH_INTERVAL_MS, DEFAULT_SNAPSHOT_INTERVAL_MS,
+            DEFAULT_WAL_BATCH_SIZE, DEFAULT_WAL_BATCH_DELAY_MS);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Parses positive integer option argument, terminates on malformed input.
+ * @param name — program name, for usage message
+ * @param arg — option argument
+ * @return parsed value
+ */
+static unsigned long parse_positive(const char *name, const char *arg) {
+    char *end;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || value == 0)
+        usage(name);
+    return value;
+}
+
+/**
+ * Parses non-negative integer option argument, terminates on malformed input.
+ * @param name — program name, for usage message
+ * @param arg — option argument
+ * @return parsed value
+ */
+static unsigned long parse_non_negative(const char *name, const char *arg) {
+    return strcmp(arg, "0") == 0 ? 0 : parse_positive(name, arg);
+}
+
+/**
+ * Parses size in bytes, with optional `K`, `M` or `G` binary suffix, terminates on malformed input.
+ * @param name — program name, for usage message
+ * @param arg — option argument
+ * @return parsed size
+ */
+static size_t parse_size(const char *name, const char *arg) {
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    unsigned shift = 0;
+    switch (*end) {
+        case 'K': shift = 10; ++end; break;
+        case 'M': shift = 20; ++end; break;
+        case 'G': shift = 30; ++end; break;
+        default: break;
+    }
+    if (*arg == '\0' || *end != '\0' || value == 0 || value > (SIZE_MAX >> shift))
+        usage(name);
+    return (size_t) value << shift;
+}
+
+/**
+ * Parses aggregation policy, terminates on unknown statistics.
+ * @param name — program name, for usage message
+ * @param arg — `values` or comma separated list of statistics, modified while parsing
+ * @return set of @ref aggregation_field, empty for raw values
+ */
+static unsigned parse_fields(const char *name, char *arg) {
+    static const struct {
+        const char *name;
+        enum aggregation_field field;
+    } statistics[] = {{"count", FIELD_COUNT}, {"sum", FIELD_SUM}, {"min", FIELD_MIN}, {"max", FIELD_MAX}};
+
+    if (strcmp(arg, "values") == 0)
+        return 0;
+
+    unsigned fields = 0;
+    for (char *state, *token = strtok_r(arg, ",", &state); token != NULL; token = strtok_r(NULL, ",", &state)) {
+        size_t i;
+        for (i = 0; i < sizeof(statistics) / sizeof(statistics[0]) && strcmp(token, statistics[i].name) != 0; ++i);
+        if (i == sizeof(statistics) / sizeof(statistics[0]))
+            usage(name);
+        fields |= statistics[i].field;
+    }
+    if (fields == 0)
+        usage(name);
+    return fields;
+}
+
+/**
+ * Fills @ref options from command line arguments, terminates on invalid ones.
+ * @param argc — number of arguments
+ * @param argv — arguments
+ */
+void parse_options(int argc, char *argv[]) {
+    for (int opt; (opt = getopt(argc, argv, "m:w:l:q:p:g:G:s:P:b:a:n:T:e:E:M:V:o:O:F:LS:I:W:B:D:t")) != -1;) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "epoll") == 0)
+                    options.mode = MODE_EPOLL;
+                else if (strcmp(optarg, "threads") == 0)
+                    options.mode = MODE_THREADS;
+                else if (strcmp(optarg, "cores") == 0)
+                    options.mode = MODE_CORES;
+                else if (strcmp(optarg, "uring") == 0)
+                    options.mode = MODE_URING;
+                else if (strcmp(optarg, "replay") == 0)
+                    options.mode = MODE_REPLAY;
+                else
+                    usage(argv[0]);
+                break;
+
+            case 'w':
+                options.workers = parse_positive(argv[0], optarg);
+                break;
+
+            case 'l':
+                if (options.listeners_count == MAX_LISTENERS ||
+                    !parse_listener(optarg, &options.listeners[options.listeners_count++]))
+                    usage(argv[0]);
+                break;
+
+            case 'q':
+                if (!parse_listener(optarg, &options.query) || listener_is_datagram(&options.query))
+                    usage(argv[0]);
+                options.query_enabled = true;
+                break;
+
+            case 'p':
+                if (!parse_listener(optarg, &options.publish.listener) ||
+                    listener_is_datagram(&options.publish.listener))
+                    usage(argv[0]);
+                options.publish_enabled = true;
+                break;
+
+            case 'g':
+                if (strcmp(optarg, "drop") == 0)
+                    options.publish.lag_policy = LAG_DROP;
+                else if (strcmp(optarg, "disconnect") == 0)
+                    options.publish.lag_policy = LAG_DISCONNECT;
+                else
+                    usage(argv[0]);
+                break;
+
+            case 'G':
+                options.publish.ring_size = parse_size(argv[0], optarg);
+                break;
+
+            case 's':
+                options.shards = parse_positive(argv[0], optarg);
+                if ((options.shards & (options.shards - 1)) != 0 || options.shards > HASHTABLE_SIZE)
+                    usage(argv[0]);
+                break;
+
+            case 'P':
+                if (strcmp(optarg, "off") == 0)
+                    options.hugepages = HUGEPAGES_OFF;
+                else if (strcmp(optarg, "thp") == 0)
+                    options.hugepages = HUGEPAGES_THP;
+                else if (strcmp(optarg, "hugetlb") == 0)
+                    options.hugepages = HUGEPAGES_HUGETLB;
+                else
+                    usage(argv[0]);
+                break;
+
+            case 'b':
+                options.input_buffer_size = parse_positive(argv[0], optarg);
+                if ((options.input_buffer_size & (options.input_buffer_size - 1)) != 0 ||
+                    options.input_buffer_size < MIN_INPUT_BUFFER_SIZE)
+                    usage(argv[0]);
+                break;
+
+            case 'a':
+                options.aggregation.fields = parse_fields(argv[0], optarg);
+                break;
+
+            case 'n':
+                options.aggregation.threshold = parse_non_negative(argv[0], optarg);
+                break;
+
+            case 'T':
+                options.aggregation.window_ms = parse_positive(argv[0], optarg);
+                break;
+
+            case 'e':
+                options.aggregation.ttl_ms = parse_positive(argv[0], optarg);
+                break;
+
+            case 'E':
+                if (strcmp(optarg, "emit") == 0)
+                    options.aggregation.expiry = EXPIRY_EMIT;
+                else if (strcmp(optarg, "drop") == 0)
+                    options.aggregation.expiry = EXPIRY_DROP;
+                else
+                    usage(argv[0]);
+                break;
+
+            case 'M':
+                options.aggregation.memory_budget = parse_size(argv[0], optarg);
+                break;
+
+            case 'V':
+                options.eviction_path = optarg;
+                break;
+
+            case 'o':
+                if (strcmp(optarg, "text") == 0)
+                    options.output.format = OUTPUT_TEXT;
+                else if (strcmp(optarg, "msgpack") == 0)
+                    options.output.format = OUTPUT_MSGPACK;
+                else
+                    usage(argv[0]);
+                break;
+
+            case 'O':
+                options.output.buffer_size = parse_positive(argv[0], optarg);
+                if (options.output.buffer_size < MAX_RECORD_LENGTH)
+                    usage(argv[0]);
+                break;
+
+            case 'F':
+                options.output.flush_interval_ms = parse_positive(argv[0], optarg);
+                break;
+
+            case 'L':
+                options.output.line_mode = true;
+                break;
+
+            case 'S':
+                options.snapshot_path = optarg;
+                break;
+
+            case 'I':
+                options.snapshot_interval_ms = parse_non_negative(argv[0], optarg);
+                break;
+
+            case 'W':
+                options.wal_path = optarg;
+                break;
+
+            case 'B':
+                options.wal_batch_size = parse_size(argv[0], optarg);
+                break;
+
+            case 'D':
+                options.wal_batch_delay_ms = parse_non_negative(argv[0], optarg);
+                break;
+
+            case 't':
+                options.latency = true;
+                break;
+
+            default:
+                usage(argv[0]);
+        }
+    }
+    /* Only replay takes capture files, and needs at least one */
+    if ((options.mode == MODE_REPLAY) != (optind < argc))
+        usage(argv[0]);
+    options.captures = argv + optind;
+    options.captures_count = (unsigned) (argc - optind);
+    /* Replay receives nothing, server listens on the default port unless told otherwise */
+    if (options.mode == MODE_REPLAY &&
+        (options.listeners_count > 0 || options.query_enabled || options.publish_enabled || options.latency))
+        usage(argv[0]);
+    if (options.listeners_count == 0) {
+        options.listeners[0] = (struct listener) {.kind = LISTENER_TCP, .port = DEFAULT_PORT, .path = NULL};
+        options.listeners_count = 1;
+    }
+
+    /* Raw values are bounded by threshold, unbounded statistics need a window to complete */
+    if (options.aggregation.fields == 0 &&
+        (options.aggregation.threshold == 0 || options.aggregation.threshold > MAX_VALUES_THRESHOLD))
+        usage(argv[0]);
+    if (options.aggregation.threshold == 0 && options.aggregation.window_ms == 0)
+        usage(argv[0]);
+    /* Ring holds a few whole batches of output */
+    options.publish.batch_size = options.output.buffer_size;
+    if ((options.publish.ring_size & (options.publish.ring_size - 1)) != 0 ||
+        options.publish.ring_size / 4 < options.publish.batch_size)
+        usage(argv[0]);
+    /* Only snapshot truncates the log, owned shards are aggregated apart from the thread logging their messages */
+    if (options.wal_path != NULL && (options.snapshot_path == NULL || options.mode == MODE_CORES))
+        usage(argv[0]);
+
+    /* Replay is sequential, unless asked otherwise, so its output is deterministic */
+    if (options.workers == 0 && options.mode == MODE_REPLAY)
+        options.workers = 1;
+    /* Default to one event loop per cpu */
+    if (options.workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        options.workers = cpus > 0 ? (unsigned) cpus : 1;
+    }
+    /* Every core owns at least one shard */
+    if (options.mode == MODE_CORES) {
+        if (options.workers > HASHTABLE_SIZE)
+            usage(argv[0]);
+        while (options.shards < options.workers)
+            options.shards *= 2;
+    }
+}
@@ -0,0 +1,105 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Interface for command line configuration of the server.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _OPTIONS_H_
+#define _OPTIONS_H_
+
+#include "pool.h"
+#include "output.h"
+#include "aggregator.h"
+#include "listener.h"
+#include "publish.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Connection handling models.
+ */
+enum server_mode {
+    /** Non-blocking sockets served by fixed set of epoll threads. */
+    MODE_EPOLL,
+    /** Legacy model, one detached thread per connection. */
+    MODE_THREADS,
+    /** Thread per core, with its own listening socket and part of hashtable, accessed without locks. */
+    MODE_CORES,
+    /** Thread per core, with its own listening socket, completing multishot receives of io_uring. */
+    MODE_URING,
+    /** No listening socket, capture files are decoded and aggregated, then server exits. */
+    MODE_REPLAY
+};
+
+/**
+ * Server configuration, filled by @ref parse_options.
+ */
+struct options {
+    enum server_mode mode;
+    /** Number of event-loop threads in @ref MODE_EPOLL, cores in @ref MODE_CORES and @ref MODE_URING,
+     * or files replayed in parallel in @ref MODE_REPLAY. */
+    unsigned workers;
+    /** Sockets, on which messages are received, tcp on @ref DEFAULT_PORT unless any is given. */
+    struct listener listeners[MAX_LISTENERS];
+    unsigned listeners_count;
+    /** Stream socket, on which partial aggregates are queried, if @p query_enabled. */
+    struct listener query;
+    bool query_enabled;
+    /** Publishing of complete aggregates to subscribers, if @p publish_enabled. */
+    struct publish_config publish;
+    bool publish_enabled;
+    /** Number of independently locked hashtable shards. */
+    unsigned shards;
+    /** Huge page backing of memory arenas. */
+    enum hugepages_mode hugepages;
+    /** Size of per-connection ring buffer. */
+    size_t input_buffer_size;
+    struct aggregation_config aggregation;
+    struct output_config output;
+    /** File, to which evicted aggregates are appended, @p NULL if they are discarded. */
+    const char *eviction_path;
+    /** File, from which partial aggregates are restored and to which they are saved, @p NULL if disabled. */
+    const char *snapshot_path;
+    /** Time between snapshots, zero if only taken at shutdown. */
+    unsigned snapshot_interval_ms;
+    /** Directory of write-ahead log of accepted messages, @p NULL if disabled. */
+    const char *wal_path;
+    /** Bytes of messages, which commit a batch of log, and max time a message waits for commit. */
+    size_t wal_batch_size;
+    unsigned wal_batch_delay_ms;
+    /** Whether latencies of complete aggregates are measured. */
+    bool latency;
+    /** Capture files of @ref MODE_REPLAY, the remaining arguments. */
+    char *const *captures;
+    unsigned captures_count;
+};
+
+/**
+ * Global server configuration.
+ */
+extern struct options options;
+
+void parse_options(int argc, char *argv[]);
+
+#endif /* _OPTIONS_H_ */
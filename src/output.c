@@ -0,0 +1,589 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Implementation of output of completed aggregates.
+ * Queue is intrusive multiple-producer single-consumer queue by Dmitry Vyukov,
+ * read http://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "output.h"
+#include "protocol.h"
+#include "pool.h"
+#include "latency.h"
+#include "error.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+/**
+ * Output configuration, set by @ref init_output.
+ */
+static struct output_config config;
+/**
+ * Aggregation policy, which determines layout of record payload.
+ */
+static struct aggregation_config aggregation;
+/**
+ * Formatter of configured output format.
+ */
+static size_t (*format_record)(char *, const struct output_record *);
+/**
+ * Waits until aggregates may be written, @p NULL if they are written at once.
+ */
+static void (*output_barrier)();
+/**
+ * Receives every written batch of complete aggregates, @p NULL if they are not published.
+ */
+static void (*output_publish)(const char *, size_t, size_t);
+/**
+ * Pool of queue nodes, shared by producers and output thread.
+ */
+static struct pool record_pool;
+
+/**
+ * Stream of aggregates, written by its own thread.
+ */
+struct output_stream {
+    /** Descriptor written to, @p -1 if stream is not started. */
+    int fd;
+
+    /** Queue of aggregates – producers push at @p head, output thread pops at @p tail. */
+    struct {
+        struct output_record *_Atomic head;
+        struct output_record *tail;
+        struct output_record stub;
+    } queue;
+
+    /** Output thread sleep state – set when it waits for new aggregates, guarded by @p mutex. */
+    atomic_bool sleeping;
+    atomic_bool stopping;
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    pthread_t thread;
+
+    /** Node queued by @ref output_sync, and whether aggregates queued before it are written, guarded by @p mutex. */
+    struct output_record marker;
+    bool synced;
+    pthread_cond_t synced_cond;
+};
+
+/**
+ * Complete aggregates, written to stdout, and evicted ones, written to optional file.
+ */
+static struct output_stream aggregates = {.fd = -1}, evictions = {.fd = -1};
+
+/**
+ * Two decimal digits of every number below 100.
+ */
+static const char digit_pairs[201] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+/**
+ * Formats unsigned integer in decimal, two digits at a time.
+ * @param output[out] — place for at least 20 characters
+ * @param value — value to format
+ * @return number of written characters
+ */
+size_t format_u64(char *output, uint_least64_t value) {
+    char reversed[20];
+    char *it = reversed + sizeof(reversed);
+
+    while (value >= 100) {
+        const char *pair = &digit_pairs[2 * (value % 100)];
+        value /= 100;
+        *--it = pair[1];
+        *--it = pair[0];
+    }
+    if (value >= 10) {
+        const char *pair = &digit_pairs[2 * value];
+        *--it = pair[1];
+        *--it = pair[0];
+    } else {
+        *--it = (char) ('0' + value);
+    }
+
+    size_t length = reversed + sizeof(reversed) - it;
+    memcpy(output, it, length);
+    return length;
+}
+
+/**
+ * Names of statistics, indexed by bit position of @ref aggregation_field.
+ */
+static const char *const field_names[] = {"count", "sum", "min", "max"};
+#define NO_FIELDS (sizeof(field_names) / sizeof(field_names[0]))
+
+/**
+ * Finds value of a statistic in a record.
+ * @param record — aggregate with statistics
+ * @param field — index of statistic in @ref field_names
+ * @param payload[in,out] — next unread payload word, advanced past statistics other than count
+ * @return value of the statistic
+ */
+static uint_least64_t record_field(const struct output_record *record, unsigned field,
+                                   const uint_least64_t **payload) {
+    return field == 0 ? record->count : *(*payload)++;
+}
+
+/**
+ * Formats aggregate as `id: X, values: a, b, c` or `id: X, count: c, sum: s, min: m, max: M` line.
+ * @param output[out] — place for at least @ref MAX_RECORD_LENGTH characters
+ * @param record — aggregate to format
+ * @return number of written characters
+ */
+size_t format_text_record(char *output, const struct output_record *record) {
+    char *it = output;
+    memcpy(it, "id: ", 4);
+    it += 4;
+    it += format_u64(it, record->id);
+
+    if (aggregation.fields == 0) {
+        memcpy(it, ", values: ", 10);
+        it += 10;
+        for (uint_least64_t i = 0; i < record->count; ++i) {
+            if (i > 0) {
+                memcpy(it, ", ", 2);
+                it += 2;
+            }
+            it += format_u64(it, record->payload[i]);
+        }
+    } else {
+        const uint_least64_t *payload = record->payload;
+        for (unsigned field = 0; field < NO_FIELDS; ++field) {
+            if (!(aggregation.fields & (1u << field)))
+                continue;
+            size_t length = strlen(field_names[field]);
+            *it++ = ',';
+            *it++ = ' ';
+            memcpy(it, field_names[field], length);
+            it += length;
+            *it++ = ':';
+            *it++ = ' ';
+            it += format_u64(it, record_field(record, field, &payload));
+        }
+    }
+    *it++ = '\n';
+    return it - output;
+}
+
+/**
+ * Formats aggregate as messagepack map `{"id": X, "values": [a, b, c]}` or `{"id": X, "count": c, ...}`,
+ * with ints in the shortest form, the same way producers encode messages.
+ * @param output[out] — place for at least @ref MAX_RECORD_LENGTH bytes
+ * @param record — aggregate to format
+ * @return number of written bytes
+ */
+size_t format_msgpack_record(char *output, const struct output_record *record) {
+    uint8_t *it = (uint8_t *) output;
+
+    if (aggregation.fields == 0) {
+        *it++ = MSGPACK_FIXMAP | NO_KEYS;
+        it += encode_msgpack_key(it, ID_KEY_NAME, ID_KEY_NAME_LENGTH);
+        it += encode_msgpack_uint(it, record->id);
+        it += encode_msgpack_key(it, VALUES_KEY_NAME, VALUES_KEY_NAME_LENGTH);
+        if (record->count < MSGPACK_FIXARRAY_LIMIT) {
+            *it++ = MSGPACK_FIXARRAY | record->count;
+        } else {
+            *it++ = MSGPACK_ARRAY16;
+            *it++ = (uint8_t) (record->count >> 8);
+            *it++ = (uint8_t) record->count;
+        }
+        for (uint_least64_t i = 0; i < record->count; ++i)
+            it += encode_msgpack_uint(it, record->payload[i]);
+    } else {
+        *it++ = MSGPACK_FIXMAP | (1 + __builtin_popcount(aggregation.fields));
+        it += encode_msgpack_key(it, ID_KEY_NAME, ID_KEY_NAME_LENGTH);
+        it += encode_msgpack_uint(it, record->id);
+        const uint_least64_t *payload = record->payload;
+        for (unsigned field = 0; field < NO_FIELDS; ++field) {
+            if (!(aggregation.fields & (1u << field)))
+                continue;
+            it += encode_msgpack_key(it, field_names[field], strlen(field_names[field]));
+            it += encode_msgpack_uint(it, record_field(record, field, &payload));
+        }
+    }
+    return it - (uint8_t *) output;
+}
+
+/**
+ * Appends node to the queue, wait-free.
+ * @param stream — stream to append to
+ * @param record — node to append
+ */
+static void queue_push(struct output_stream *stream, struct output_record *record) {
+    atomic_store_explicit(&record->next, NULL, memory_order_relaxed);
+    /* Sequentially consistent, so output thread about to sleep either sees the node or is woken up */
+    struct output_record *previous = atomic_exchange(&stream->queue.head, record);
+    atomic_store_explicit(&previous->next, record, memory_order_release);
+}
+
+/**
+ * Removes node from the queue, called only by output thread.
+ * @param stream — stream to remove from
+ * @return oldest node, or @p NULL if queue is empty or producer is in the middle of push
+ */
+static struct output_record *queue_pop(struct output_stream *stream) {
+    struct output_record *tail = stream->queue.tail;
+    struct output_record *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    /* Skip stub node */
+    if (tail == &stream->queue.stub) {
+        if (next == NULL) return NULL;
+        stream->queue.tail = tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        stream->queue.tail = next;
+        return tail;
+    }
+
+    /* Tail is the last node, it may be taken only with stub pushed behind it */
+    if (tail != atomic_load_explicit(&stream->queue.head, memory_order_acquire)) return NULL;
+    queue_push(stream, &stream->queue.stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        stream->queue.tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/**
+ * Writes whole buffer to a descriptor.
+ * @param fd — descriptor to write to
+ * @param buffer — bytes to write
+ * @param size — number of bytes
+ */
+static void write_all(int fd, const char *buffer, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, buffer, size);
+        if (written < 0 && errno == EINTR) continue;
+        ERROR_CHECK(written);
+        buffer += written;
+        size -= written;
+    }
+}
+
+/**
+ * Times, at which an aggregate in output buffer was received and removed from hashtable.
+ */
+struct output_stamp {
+    uint_least64_t received, updated;
+};
+
+/**
+ * Writes formatted aggregates of a stream, once @ref output_barrier lets them out, then publishes complete ones.
+ * Latencies of timed aggregates are recorded once written, with a single clock read per write.
+ * @param stream — stream to write
+ * @param buffer — formatted aggregates
+ * @param size — size of @p buffer
+ * @param records — number of aggregates in @p buffer
+ * @param stamps — times of timed aggregates in @p buffer
+ * @param timed — number of timed aggregates
+ */
+static void stream_write(struct output_stream *stream, const char *buffer, size_t size, size_t records,
+                         const struct output_stamp *stamps, size_t timed) {
+    if (output_barrier != NULL)
+        output_barrier();
+    write_all(stream->fd, buffer, size);
+    if (timed > 0) {
+        uint_least64_t written = latency_now();
+        for (size_t i = 0; i < timed; ++i) {
+            latency_record(LATENCY_WRITE, written - stamps[i].updated);
+            latency_record(LATENCY_TOTAL, written - stamps[i].received);
+        }
+    }
+    if (stream == &aggregates && output_publish != NULL)
+        output_publish(buffer, size, records);
+}
+
+/**
+ * Returns current time of monotonic clock.
+ * @return time in milliseconds
+ */
+static uint_least64_t now_ms() {
+    struct timespec now;
+    ERROR_CHECK(clock_gettime(CLOCK_MONOTONIC, &now));
+    return (uint_least64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Waits for new aggregates, at most @p timeout_ms.
+ * @param stream — stream to wait for
+ * @param timeout_ms — max time to wait
+ */
+static void output_wait(struct output_stream *stream, unsigned timeout_ms) {
+    struct timespec deadline;
+    ERROR_CHECK(clock_gettime(CLOCK_REALTIME, &deadline));
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    ERROR_CHECK(pthread_mutex_lock(&stream->mutex));
+    atomic_store(&stream->sleeping, true);
+
+    /* Recheck after announcing sleep, pushes before it would be missed otherwise */
+    struct output_record *next = atomic_load_explicit(&stream->queue.tail->next, memory_order_acquire);
+    if (next == NULL && stream->queue.tail == atomic_load(&stream->queue.head) && !atomic_load(&stream->stopping)) {
+        int error = pthread_cond_timedwait(&stream->wakeup, &stream->mutex, &deadline);
+        if (error != 0 && error != ETIMEDOUT) {
+            errno = error;
+            ERROR("pthread_cond_timedwait");
+        }
+    }
+
+    atomic_store(&stream->sleeping, false);
+    ERROR_CHECK(pthread_mutex_unlock(&stream->mutex));
+}
+
+/**
+ * Formats queued aggregates into output buffer, writes it once full,
+ * after flush interval, or after every aggregate in line mode.
+ * @param stream_ptr — pointer to stream to write
+ * @return @p NULL after @ref output_shutdown
+ */
+static void *output_thread(void *stream_ptr) {
+    struct output_stream *stream = stream_ptr;
+    char *buffer;
+    NULL_CHECK(buffer = malloc(config.buffer_size));
+    size_t size = 0, records = 0, timed = 0;
+    uint_least64_t first_pending = 0;
+
+    /* Every formatted aggregate takes at least 8 bytes, so buffer never holds more timed ones */
+    struct output_stamp *stamps = NULL;
+    if (latency_enabled && stream == &aggregates) {
+        NULL_CHECK(stamps = malloc((config.buffer_size / 8 + 1) * sizeof(struct output_stamp)));
+    }
+
+    for (;;) {
+        struct output_record *record = queue_pop(stream);
+
+        if (record == &stream->marker) {
+            /* Everything queued before the marker is formatted, write it at once */
+            if (size > 0) {
+                stream_write(stream, buffer, size, records, stamps, timed);
+                size = records = timed = 0;
+            }
+            ERROR_CHECK(pthread_mutex_lock(&stream->mutex));
+            stream->synced = true;
+            ERROR_CHECK(pthread_cond_broadcast(&stream->synced_cond));
+            ERROR_CHECK(pthread_mutex_unlock(&stream->mutex));
+            continue;
+        }
+        if (record != NULL) {
+            if (size == 0)
+                first_pending = now_ms();
+            size += format_record(buffer + size, record);
+            ++records;
+            if (stamps != NULL && record->received != 0)
+                stamps[timed++] = (struct output_stamp) {record->received, record->updated};
+            pool_free(&record_pool, record);
+
+            if (config.line_mode || config.buffer_size - size < MAX_RECORD_LENGTH) {
+                stream_write(stream, buffer, size, records, stamps, timed);
+                size = records = timed = 0;
+            }
+            continue;
+        }
+
+        /* Queue is empty, flush pending aggregates once they waited long enough */
+        bool stop = atomic_load(&stream->stopping);
+        if (size > 0 && (stop || now_ms() - first_pending >= config.flush_interval_ms)) {
+            stream_write(stream, buffer, size, records, stamps, timed);
+            size = records = timed = 0;
+        }
+        if (stop) break;
+
+        output_wait(stream, size > 0 ? config.flush_interval_ms : 1000);
+    }
+
+    free(stamps);
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Starts thread of a stream.
+ * @param stream — stream to start
+ * @param fd — descriptor written by stream
+ */
+static void stream_start(struct output_stream *stream, int fd) {
+    stream->fd = fd;
+    atomic_init(&stream->queue.stub.next, NULL);
+    atomic_init(&stream->queue.head, &stream->queue.stub);
+    stream->queue.tail = &stream->queue.stub;
+    atomic_init(&stream->sleeping, false);
+    atomic_init(&stream->stopping, false);
+    ERROR_CHECK(pthread_mutex_init(&stream->mutex, NULL));
+    ERROR_CHECK(pthread_cond_init(&stream->wakeup, NULL));
+    stream->synced = false;
+    ERROR_CHECK(pthread_cond_init(&stream->synced_cond, NULL));
+
+    NON_ZERO_CHECK(pthread_create(&stream->thread, NULL, output_thread, stream));
+}
+
+/**
+ * Starts output thread writing to stdout.
+ * @param output_config — output configuration
+ * @param aggregation_config — aggregation policy of emitted entries
+ * @param barrier — called before every write, waits until aggregates may be written, @p NULL if they always may
+ * @param publish — called after every write of complete aggregates with written buffer, size and number of aggregates,
+ * @p NULL if they are not published
+ */
+void init_output(const struct output_config *output_config, const struct aggregation_config *aggregation_config,
+                 void (*barrier)(), void (*publish)(const char *, size_t, size_t)) {
+    config = *output_config;
+    output_barrier = barrier;
+    output_publish = publish;
+    aggregation = *aggregation_config;
+    format_record = config.format == OUTPUT_MSGPACK ? format_msgpack_record : format_text_record;
+    pool_init(&record_pool, "records", sizeof(struct output_record) +
+                                       aggregation_payload_words(&aggregation) * sizeof(uint_least64_t));
+    stream_start(&aggregates, STDOUT_FILENO);
+}
+
+/**
+ * Starts output thread writing evicted aggregates, in the same format as complete ones.
+ * Has to be called after @ref init_output.
+ * @param path — file to append evicted aggregates to
+ */
+void init_eviction_output(const char *path) {
+    int fd;
+    ERROR_CHECK(fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644));
+    stream_start(&evictions, fd);
+}
+
+/**
+ * Wakes output thread after push, only if it sleeps.
+ * @param stream — started stream
+ */
+static void stream_wake(struct output_stream *stream) {
+    if (atomic_load(&stream->sleeping)) {
+        ERROR_CHECK(pthread_mutex_lock(&stream->mutex));
+        ERROR_CHECK(pthread_cond_signal(&stream->wakeup));
+        ERROR_CHECK(pthread_mutex_unlock(&stream->mutex));
+    }
+}
+
+/**
+ * Queues aggregate for output.
+ * @param stream — started stream
+ * @param entry — entry, copied before return
+ * @param received — time, at which message completing aggregate was received, zero if not measured
+ * @param updated — time, at which aggregate was removed from hashtable
+ */
+static void stream_emit(struct output_stream *stream, const struct entry_t *entry,
+                        uint_least64_t received, uint_least64_t updated) {
+    struct output_record *record;
+    NULL_CHECK(record = pool_alloc(&record_pool));
+    record->id = entry->id;
+    record->count = entry->count;
+    record->received = received;
+    record->updated = updated;
+    memcpy(record->payload, entry->payload, aggregation_payload_words(&aggregation) * sizeof(uint_least64_t));
+    queue_push(stream, record);
+    stream_wake(stream);
+}
+
+/**
+ * Queues completed aggregate for output.
+ * @param entry — completed entry, copied before return
+ */
+void output_emit(const struct entry_t *entry) {
+    stream_emit(&aggregates, entry, 0, 0);
+}
+
+/**
+ * Queues completed aggregate for output, recording its latencies once written.
+ * @param entry — completed entry, copied before return
+ * @param received — time, at which message completing aggregate was received
+ * @param updated — time, at which aggregate was removed from hashtable
+ */
+void output_emit_timed(const struct entry_t *entry, uint_least64_t received, uint_least64_t updated) {
+    stream_emit(&aggregates, entry, received, updated);
+}
+
+/**
+ * Queues evicted aggregate for output, if eviction output is enabled.
+ * @param entry — evicted entry, copied before return
+ */
+void output_evicted(const struct entry_t *entry) {
+    if (evictions.fd >= 0)
+        stream_emit(&evictions, entry, 0, 0);
+}
+
+/**
+ * Waits until every complete aggregate queued before the call is written and published.
+ * Queue is FIFO, so a marker pushed behind them reaches output thread only after them.
+ * Callers have to be serialized, as the stream has a single marker.
+ */
+void output_sync() {
+    ERROR_CHECK(pthread_mutex_lock(&aggregates.mutex));
+    aggregates.synced = false;
+    ERROR_CHECK(pthread_mutex_unlock(&aggregates.mutex));
+    queue_push(&aggregates, &aggregates.marker);
+    stream_wake(&aggregates);
+
+    ERROR_CHECK(pthread_mutex_lock(&aggregates.mutex));
+    while (!aggregates.synced) {
+        NON_ZERO_CHECK(pthread_cond_wait(&aggregates.synced_cond, &aggregates.mutex));
+    }
+    ERROR_CHECK(pthread_mutex_unlock(&aggregates.mutex));
+}
+
+/**
+ * Writes every queued aggregate and stops thread of a stream.
+ * @param stream — stream to stop
+ */
+static void stream_stop(struct output_stream *stream) {
+    if (stream->fd < 0) return;
+    atomic_store(&stream->stopping, true);
+    ERROR_CHECK(pthread_mutex_lock(&stream->mutex));
+    ERROR_CHECK(pthread_cond_signal(&stream->wakeup));
+    ERROR_CHECK(pthread_mutex_unlock(&stream->mutex));
+    NON_ZERO_CHECK(pthread_join(stream->thread, NULL));
+}
+
+/**
+ * Writes every queued aggregate and stops output threads.
+ */
+void output_shutdown() {
+    stream_stop(&evictions);
+    stream_stop(&aggregates);
+}
@@ -0,0 +1,111 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Interface for output of completed aggregates.
+ * Aggregates are handed off through lock-free queue to a dedicated thread,
+ * which formats them into large buffers and writes them to stdout,
+ * as text lines or as binary messagepack records.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+#include "hashtable.h"
+#include "aggregator.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Default size of output buffer.
+ */
+#define DEFAULT_OUTPUT_BUFFER_SIZE (64 * 1024)
+/**
+ * Default max time, for which formatted aggregate waits in output buffer.
+ */
+#define DEFAULT_FLUSH_INTERVAL_MS 10
+/**
+ * Max length of single formatted aggregate, in any format.
+ */
+#define MAX_RECORD_LENGTH (32 + (MAX_VALUES_THRESHOLD + 1) * 22)
+
+/**
+ * Completed aggregate, node of output queue.
+ */
+struct output_record {
+    struct output_record *_Atomic next;
+    uint_least64_t id;
+    uint_least64_t count;
+    /** Times, at which message completing aggregate was received and aggregate removed from hashtable, zero if not measured. */
+    uint_least64_t received, updated;
+    /** Entry payload, laid out by aggregation policy. */
+    uint_least64_t payload[];
+};
+
+/**
+ * Formats of aggregates.
+ */
+enum output_format {
+    /** Lines like `id: X, values: a, b, c` or `id: X, count: c, sum: s`. */
+    OUTPUT_TEXT,
+    /** Messagepack maps like `{"id": X, "values": [a, b, c]}` or `{"id": X, "count": c, "sum": s}`, without separators. */
+    OUTPUT_MSGPACK
+};
+
+/**
+ * Output configuration.
+ */
+struct output_config {
+    enum output_format format;
+    /** Size of output buffer, at least @ref MAX_RECORD_LENGTH. */
+    size_t buffer_size;
+    /** Max time, for which formatted aggregate waits in output buffer. */
+    unsigned flush_interval_ms;
+    /** Whether every aggregate is written as soon as it is formatted. */
+    bool line_mode;
+};
+
+void init_output(const struct output_config *config, const struct aggregation_config *aggregation,
+                 void (*barrier)(), void (*publish)(const char *, size_t, size_t));
+
+void init_eviction_output(const char *path);
+
+void output_emit(const struct entry_t *entry);
+
+void output_emit_timed(const struct entry_t *entry, uint_least64_t received, uint_least64_t updated);
+
+void output_evicted(const struct entry_t *entry);
+
+void output_sync();
+
+void output_shutdown();
+
+size_t format_u64(char *output, uint_least64_t value);
+
+size_t format_text_record(char *output, const struct output_record *record);
+
+size_t format_msgpack_record(char *output, const struct output_record *record);
+
+#endif /* _OUTPUT_H_ */
@@ -0,0 +1,447 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Implementation of memory arenas and fixed-size object pools.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _GNU_SOURCE
+
+#include "pool.h"
+#include "error.h"
+
+#include <sys/mman.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+/**
+ * Huge page backing of new arenas.
+ */
+static enum hugepages_mode hugepages = HUGEPAGES_OFF;
+
+/**
+ * Arena statistics – currently and at most mapped bytes, bytes backed by @p MAP_HUGETLB.
+ */
+static atomic_size_t mapped, mapped_peak, mapped_hugetlb;
+/**
+ * Arenas mapped with @p MAP_HUGETLB, so their unmapping is subtracted from @ref mapped_hugetlb.
+ * Only arenas spanning huge pages get there, so there are few of them.
+ */
+static void **hugetlb_arenas;
+static size_t hugetlb_count, hugetlb_capacity;
+static pthread_mutex_t hugetlb_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Registry of initialized pools, guarded by @ref pools_mutex.
+ */
+static struct pool *pools = NULL;
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Selects huge page backing of arenas, has to be called before any allocation.
+ * @param mode — huge page backing
+ */
+void init_arenas(enum hugepages_mode mode) {
+    hugepages = mode;
+}
+
+/**
+ * Rounds arena size up to the page size it will be mapped with.
+ * @param bytes — requested size
+ * @param huge — whether arena is mapped with huge pages
+ * @return size of mapping
+ */
+static size_t arena_size(size_t bytes, bool huge) {
+    size_t page = huge ? HUGE_PAGE_SIZE : (size_t) sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) / page * page;
+}
+
+/**
+ * Adds new arena to statistics.
+ * @param size — size of mapping
+ */
+static void arena_account(size_t size) {
+    size_t now = atomic_fetch_add_explicit(&mapped, size, memory_order_relaxed) + size;
+    size_t peak = atomic_load_explicit(&mapped_peak, memory_order_relaxed);
+    while (peak < now && !atomic_compare_exchange_weak(&mapped_peak, &peak, now));
+}
+
+/**
+ * Records arena mapped with @p MAP_HUGETLB.
+ * @param memory — arena
+ * @param bytes — size of arena
+ */
+static void hugetlb_register(void *memory, size_t bytes) {
+    ERROR_CHECK(pthread_mutex_lock(&hugetlb_mutex));
+    if (hugetlb_count == hugetlb_capacity) {
+        hugetlb_capacity = hugetlb_capacity > 0 ? 2 * hugetlb_capacity : 16;
+        NULL_CHECK(hugetlb_arenas = realloc(hugetlb_arenas, hugetlb_capacity * sizeof(void *)));
+    }
+    hugetlb_arenas[hugetlb_count++] = memory;
+    ERROR_CHECK(pthread_mutex_unlock(&hugetlb_mutex));
+    atomic_fetch_add_explicit(&mapped_hugetlb, arena_size(bytes, true), memory_order_relaxed);
+}
+
+/**
+ * Forgets arena, if it was mapped with @p MAP_HUGETLB.
+ * @param memory — arena about to be unmapped
+ * @param bytes — size of arena
+ */
+static void hugetlb_unregister(void *memory, size_t bytes) {
+    ERROR_CHECK(pthread_mutex_lock(&hugetlb_mutex));
+    for (size_t i = 0; i < hugetlb_count; ++i) {
+        if (hugetlb_arenas[i] == memory) {
+            hugetlb_arenas[i] = hugetlb_arenas[--hugetlb_count];
+            atomic_fetch_sub_explicit(&mapped_hugetlb, arena_size(bytes, true), memory_order_relaxed);
+            break;
+        }
+    }
+    ERROR_CHECK(pthread_mutex_unlock(&hugetlb_mutex));
+}
+
+/**
+ * Maps zeroed arena of at least @p bytes.
+ * Huge pages are used only for arenas spanning at least one huge page.
+ * @param bytes — size of arena
+ * @return arena, or @p NULL on failure
+ */
+void *arena_map(size_t bytes) {
+    void *memory = MAP_FAILED;
+    bool huge = bytes >= HUGE_PAGE_SIZE;
+
+    if (huge && hugepages == HUGEPAGES_HUGETLB) {
+        memory = mmap(NULL, arena_size(bytes, true), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED)
+            hugetlb_register(memory, bytes);
+        else
+            diagnostic("arena: No huge pages left, falling back to regular pages.\n");
+    }
+
+    if (memory == MAP_FAILED) {
+        memory = mmap(NULL, arena_size(bytes, huge), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) return NULL;
+
+        /* Advise only, kernel may ignore it */
+        if (huge && hugepages == HUGEPAGES_THP)
+            madvise(memory, arena_size(bytes, true), MADV_HUGEPAGE);
+    }
+
+    arena_account(arena_size(bytes, huge));
+    return memory;
+}
+
+/**
+ * Maps part of a file as arena, which pages are read on first access and copied on first write.
+ * Changes are never written back, arena is unmapped by @ref arena_unmap like any other.
+ * @param fd — file to map
+ * @param offset — page aligned position of arena in @p fd
+ * @param bytes — size of arena
+ * @return arena, or @p NULL on failure
+ */
+void *arena_map_file(int fd, off_t offset, size_t bytes) {
+    /* Mapped with the size arena_unmap expects, pages past the end of file are never accessed */
+    bool huge = bytes >= HUGE_PAGE_SIZE;
+    void *memory = mmap(NULL, arena_size(bytes, huge), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+    if (memory == MAP_FAILED) return NULL;
+
+    arena_account(arena_size(bytes, huge));
+    return memory;
+}
+
+/**
+ * Unmaps arena returned by @ref arena_map.
+ * @param memory — arena
+ * @param bytes — size passed to @ref arena_map
+ */
+void arena_unmap(void *memory, size_t bytes) {
+    bool huge = bytes >= HUGE_PAGE_SIZE;
+    if (huge && hugepages == HUGEPAGES_HUGETLB)
+        hugetlb_unregister(memory, bytes);
+    ERROR_CHECK(munmap(memory, arena_size(bytes, huge)));
+    atomic_fetch_sub_explicit(&mapped, arena_size(bytes, huge), memory_order_relaxed);
+}
+
+/**
+ * Publishes number of objects in per-thread cache, only its owner changes it.
+ * @param cache — cache of calling thread
+ * @param count — number of objects in cache
+ */
+static void cache_set_count(struct pool_cache *cache, size_t count) {
+    atomic_store_explicit(&cache->count, count, memory_order_relaxed);
+}
+
+/**
+ * Gets number of objects in per-thread cache.
+ * @param cache — cache of calling thread
+ * @return number of objects in cache
+ */
+static size_t cache_count(struct pool_cache *cache) {
+    return atomic_load_explicit(&cache->count, memory_order_relaxed);
+}
+
+/**
+ * Moves up to @p count objects from @p head list to shared free list.
+ * @param pool — owner of objects
+ * @param cache — cache to take objects from
+ * @param count — number of objects to move
+ */
+static void pool_flush(struct pool *pool, struct pool_cache *cache, size_t count) {
+    if (count == 0) return;
+
+    /* Detach first count objects */
+    struct pool_object *first = cache->head, *last = first;
+    for (size_t i = 1; i < count; ++i)
+        last = last->next;
+    cache->head = last->next;
+
+    ERROR_CHECK(pthread_mutex_lock(&pool->mutex));
+    cache_set_count(cache, cache_count(cache) - count);
+    last->next = pool->free_list;
+    pool->free_list = first;
+    pool->free_count += count;
+    ERROR_CHECK(pthread_mutex_unlock(&pool->mutex));
+
+    atomic_fetch_add_explicit(&pool->flushes, 1, memory_order_relaxed);
+}
+
+/**
+ * Returns objects of exiting thread to the shared free list.
+ * @param cache_ptr[owner] — per-thread cache
+ */
+static void pool_cache_destroy(void *cache_ptr) {
+    struct pool_cache *cache = cache_ptr;
+    struct pool *pool = cache->pool;
+    pool_flush(pool, cache, cache_count(cache));
+
+    ERROR_CHECK(pthread_mutex_lock(&pool->mutex));
+    struct pool_cache **link = &pool->caches;
+    while (*link != cache)
+        link = &(*link)->next_cache;
+    *link = cache->next_cache;
+    ERROR_CHECK(pthread_mutex_unlock(&pool->mutex));
+    free(cache);
+}
+
+/**
+ * Initializes empty pool, registers it for statistics.
+ * @param pool[out] — pool to initialize
+ * @param name — name of pool in statistics
+ * @param object_size — size of every object
+ */
+void pool_init(struct pool *pool, const char *name, size_t object_size) {
+    pool->name = name;
+    /* Objects have to hold free list link and keep its alignment */
+    if (object_size < sizeof(struct pool_object))
+        object_size = sizeof(struct pool_object);
+    pool->object_size = (object_size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+
+    ERROR_CHECK(pthread_mutex_init(&pool->mutex, NULL));
+    pool->free_list = NULL;
+    pool->free_count = 0;
+    pool->caches = NULL;
+    NON_ZERO_CHECK(pthread_key_create(&pool->cache_key, pool_cache_destroy));
+    atomic_init(&pool->carved, 0);
+    atomic_init(&pool->refills, 0);
+    atomic_init(&pool->flushes, 0);
+
+    ERROR_CHECK(pthread_mutex_lock(&pools_mutex));
+    pool->next_pool = pools;
+    pools = pool;
+    ERROR_CHECK(pthread_mutex_unlock(&pools_mutex));
+}
+
+/**
+ * Refills empty per-thread cache from shared free list, or from a new arena.
+ * @param pool — pool to refill from
+ * @param cache — empty cache
+ * @return @p false on allocation failure, @p true otherwise
+ */
+static bool pool_refill(struct pool *pool, struct pool_cache *cache) {
+    atomic_fetch_add_explicit(&pool->refills, 1, memory_order_relaxed);
+
+    /* Take batch of shared objects */
+    size_t taken = 0;
+    ERROR_CHECK(pthread_mutex_lock(&pool->mutex));
+    while (pool->free_list != NULL && taken < POOL_BATCH) {
+        struct pool_object *object = pool->free_list;
+        pool->free_list = object->next;
+        --pool->free_count;
+
+        object->next = cache->head;
+        cache->head = object;
+        ++taken;
+    }
+    cache_set_count(cache, taken);
+    ERROR_CHECK(pthread_mutex_unlock(&pool->mutex));
+    if (taken > 0) return true;
+
+    /* Carve new arena, it is never returned to the system, objects larger than a chunk get one each */
+    size_t count = POOL_CHUNK_SIZE / pool->object_size;
+    if (count == 0)
+        count = 1;
+    char *chunk = arena_map(count * pool->object_size);
+    ZERO_RETURN(chunk);
+    for (size_t i = 0; i < count; ++i) {
+        struct pool_object *object = (struct pool_object *) (chunk + i * pool->object_size);
+        object->next = cache->head;
+        cache->head = object;
+    }
+    atomic_fetch_add_explicit(&pool->carved, count, memory_order_relaxed);
+    cache_set_count(cache, count);
+
+    /* Share surplus above single batch */
+    if (count > POOL_BATCH)
+        pool_flush(pool, cache, count - POOL_BATCH);
+    return true;
+}
+
+/**
+ * Finds per-thread cache of a pool, creates it on first use.
+ * @param pool — pool
+ * @return cache of calling thread
+ */
+static struct pool_cache *pool_cache(struct pool *pool) {
+    struct pool_cache *cache = pthread_getspecific(pool->cache_key);
+    if (cache == NULL) {
+        NULL_CHECK(cache = malloc(sizeof(struct pool_cache)));
+        cache->pool = pool;
+        cache->head = NULL;
+        atomic_init(&cache->count, 0);
+        NON_ZERO_CHECK(pthread_setspecific(pool->cache_key, cache));
+
+        ERROR_CHECK(pthread_mutex_lock(&pool->mutex));
+        cache->next_cache = pool->caches;
+        pool->caches = cache;
+        ERROR_CHECK(pthread_mutex_unlock(&pool->mutex));
+    }
+    return cache;
+}
+
+/**
+ * Allocates object, in most cases from per-thread cache only.
+ * @param pool — pool to allocate from
+ * @return uninitialized object, or @p NULL on allocation failure
+ */
+void *pool_alloc(struct pool *pool) {
+    struct pool_cache *cache = pool_cache(pool);
+    if (cache->head == NULL && !pool_refill(pool, cache))
+        return NULL;
+
+    struct pool_object *object = cache->head;
+    cache->head = object->next;
+    cache_set_count(cache, cache_count(cache) - 1);
+    return object;
+}
+
+/**
+ * Returns object to per-thread cache, moves surplus to shared free list.
+ * @param pool — owner of @p object
+ * @param object — object returned by @ref pool_alloc, possibly from other thread
+ */
+void pool_free(struct pool *pool, void *object) {
+    struct pool_cache *cache = pool_cache(pool);
+    struct pool_object *freed = object;
+    freed->next = cache->head;
+    cache->head = freed;
+
+    size_t count = cache_count(cache) + 1;
+    cache_set_count(cache, count);
+    if (count >= 2 * POOL_BATCH)
+        pool_flush(pool, cache, POOL_BATCH);
+}
+
+/**
+ * Counts objects of a pool in use – carved ones less the ones on shared free list and in per-thread caches.
+ * Caches change meanwhile, so the count is approximate.
+ * @param pool — pool
+ * @return number of allocated objects, not freed yet
+ */
+static size_t pool_in_use(struct pool *pool) {
+    ERROR_CHECK(pthread_mutex_lock(&pool->mutex));
+    size_t idle = pool->free_count;
+    for (struct pool_cache *cache = pool->caches; cache != NULL; cache = cache->next_cache)
+        idle += cache_count(cache);
+    ERROR_CHECK(pthread_mutex_unlock(&pool->mutex));
+
+    size_t carved = atomic_load(&pool->carved);
+    return carved > idle ? carved - idle : 0;
+}
+
+/**
+ * Prints statistics of arenas and every pool in Prometheus text format.
+ * @param output — stream to print to
+ */
+void allocator_stats_print(FILE *output) {
+    fprintf(output, "# HELP aggregation_arena_mapped_bytes Memory mapped by arenas.\n"
+                    "# TYPE aggregation_arena_mapped_bytes gauge\n"
+                    "aggregation_arena_mapped_bytes %zu\n"
+                    "# HELP aggregation_arena_mapped_peak_bytes Peak of memory mapped by arenas.\n"
+                    "# TYPE aggregation_arena_mapped_peak_bytes gauge\n"
+                    "aggregation_arena_mapped_peak_bytes %zu\n"
+                    "# HELP aggregation_arena_hugetlb_bytes Memory currently mapped by arenas in huge pages.\n"
+                    "# TYPE aggregation_arena_hugetlb_bytes gauge\n"
+                    "aggregation_arena_hugetlb_bytes %zu\n",
+            atomic_load(&mapped), atomic_load(&mapped_peak), atomic_load(&mapped_hugetlb));
+
+    static const char *const pool_metrics[][3] = {
+            {"aggregation_pool_object_bytes", "gauge", "Size of pool objects."},
+            {"aggregation_pool_carved_total", "counter", "Objects carved from arenas."},
+            {"aggregation_pool_shared_free", "gauge", "Objects on shared free list."},
+            {"aggregation_pool_in_use", "gauge", "Objects allocated and not freed, approximate."},
+            {"aggregation_pool_refills_total", "counter", "Refills of per-thread caches from shared free list."},
+            {"aggregation_pool_flushes_total", "counter", "Flushes of per-thread caches to shared free list."}
+    };
+    ERROR_CHECK(pthread_mutex_lock(&pools_mutex));
+    for (size_t metric = 0; metric < sizeof(pool_metrics) / sizeof(pool_metrics[0]); ++metric) {
+        fprintf(output, "# HELP %s %s\n# TYPE %s %s\n", pool_metrics[metric][0], pool_metrics[metric][2],
+                pool_metrics[metric][0], pool_metrics[metric][1]);
+
+        for (struct pool *pool = pools; pool != NULL; pool = pool->next_pool) {
+            size_t value;
+            switch (metric) {
+                case 0:
+                    value = pool->object_size;
+                    break;
+                case 1:
+                    value = atomic_load(&pool->carved);
+                    break;
+                case 2:
+                    ERROR_CHECK(pthread_mutex_lock(&pool->mutex));
+                    value = pool->free_count;
+                    ERROR_CHECK(pthread_mutex_unlock(&pool->mutex));
+                    break;
+                case 3:
+                    value = pool_in_use(pool);
+                    break;
+                case 4:
+                    value = atomic_load(&pool->refills);
+                    break;
+                default:
+                    value = atomic_load(&pool->flushes);
+            }
+            fprintf(output, "%s{pool=\"%s\"} %zu\n", pool_metrics[metric][0], pool->name, value);
+        }
+    }
+    ERROR_CHECK(pthread_mutex_unlock(&pools_mutex));
+}
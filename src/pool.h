@@ -0,0 +1,120 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Interface for memory arenas and fixed-size object pools.
+ * Arenas are anonymous mappings, optionally backed by huge pages, or private mappings of files.
+ * Pools carve objects out of arenas and keep freed objects on free lists,
+ * with a small per-thread cache in front of the shared one.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+ * Size of huge page assumed by arenas.
+ */
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+/**
+ * Size of arena mapped by a pool, when it runs out of objects.
+ */
+#define POOL_CHUNK_SIZE (256 * 1024)
+/**
+ * Number of objects moved at once between per-thread cache and shared free list.
+ */
+#define POOL_BATCH 32
+
+/**
+ * Huge page backing of arenas.
+ */
+enum hugepages_mode {
+    /** Regular pages only. */
+    HUGEPAGES_OFF,
+    /** Transparent huge pages, requested by @p madvise. */
+    HUGEPAGES_THP,
+    /** Reserved huge pages, @p MAP_HUGETLB, regular pages if none left. */
+    HUGEPAGES_HUGETLB
+};
+
+/**
+ * Free object, linked through its own memory.
+ */
+struct pool_object {
+    struct pool_object *next;
+};
+
+/**
+ * Pool of fixed-size objects.
+ */
+struct pool {
+    const char *name;
+    size_t object_size;
+    /** Guards @p free_list, @p free_count and @p caches. */
+    pthread_mutex_t mutex;
+    struct pool_object *free_list;
+    size_t free_count;
+    /** Per-thread caches, for statistics. */
+    struct pool_cache *caches;
+    /** Per-thread @ref pool_cache. */
+    pthread_key_t cache_key;
+
+    /** Statistics. */
+    atomic_size_t carved, refills, flushes;
+    /** Next pool in registry of all pools, for statistics. */
+    struct pool *next_pool;
+};
+
+/**
+ * Per-thread free list of a pool.
+ */
+struct pool_cache {
+    struct pool *pool;
+    struct pool_object *head;
+    /** Written only by owning thread, read by statistics. */
+    atomic_size_t count;
+    /** Next cache of the same pool. */
+    struct pool_cache *next_cache;
+};
+
+void init_arenas(enum hugepages_mode mode);
+
+void *arena_map(size_t bytes);
+
+void *arena_map_file(int fd, off_t offset, size_t bytes);
+
+void arena_unmap(void *memory, size_t bytes);
+
+void pool_init(struct pool *pool, const char *name, size_t object_size);
+
+void *pool_alloc(struct pool *pool);
+
+void pool_free(struct pool *pool, void *object);
+
+void allocator_stats_print(FILE *output);
+
+#endif /* _POOL_H_ */
@@ -20,6 +20,13 @@
  * @file
  * Implementation for limited part of messagepack format.
  * Sufficient to handle messages like `{"id": uint8_t – uint64_t, "value": uint8_t – uint64_t}`.
+ * Accepted messages are maps of any size and key order, holding keys `"id"` and `"value"`
+ * exactly once, as str of any width. Values of other keys, of any type, are skipped.
+ * Id and value are positive fixnums, uint8 – uint64 or non-negative int8 – int64.
+ * Messages laid out like the ones of most encoders – fixmap, fixstr `"id"`, int, fixstr `"value"`,
+ * int – are recognized by a fast path, any other layout is decoded byte by byte.
+ * Runs of such messages are decoded by a vectorized kernel, chosen at runtime, up to the first
+ * message laid out differently.
  *
  * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
  * @date 10.05.2019
@@ -27,126 +34,827 @@
 
 #include "protocol.h"
 #include "error.h"
-#include "input.h"
 
-#include <netinet/in.h>
+#include <stdatomic.h>
+
+/* Vectorized kernels need x86 intrinsics and runtime detection of processor features */
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define BULK_KERNELS
+#endif
 
 /**
- * Reads and parses int from @p sock.
- * @param sock[buf] — sock to read from
- * @param result[out] — output to read into
- * @return @p true on success, @p false otherwise – disconnect or invalid header
+ * Canonical message prefix – fixmap header and key `"id"` – compared as a single word.
  */
-bool read_msgpack_int(int sock, struct msgpack_int *result) {
-    /* Read variable number of bytes, switching on result->kind header */
-    switch (result->kind) {
-        case MSGPACK_UINT8:
-            ZERO_RETURN(buffered_read_all(sock, &result->value.ui8,
-                                          sizeof(result->value.ui8)) == sizeof(result->value.ui8));
-            break;
+static const uint8_t canonical_prefix[sizeof(uint32_t)] = {
+        MSGPACK_FIXMAP | NO_KEYS, MSGPACK_STRING | ID_KEY_NAME_LENGTH, 'i', 'd'
+};
+/**
+ * Canonical value key.
+ */
+static const uint8_t canonical_value_key[1 + VALUE_KEY_NAME_LENGTH] = {
+        MSGPACK_STRING | VALUE_KEY_NAME_LENGTH, 'v', 'a', 'l', 'u', 'e'
+};
+/**
+ * Shortest canonical message, with fixnum id and value.
+ */
+#define MIN_CANONICAL_LENGTH (sizeof(canonical_prefix) + 1 + sizeof(canonical_value_key) + 1)
 
-        case MSGPACK_UINT16:
-            ZERO_RETURN(buffered_read_all(sock, &result->value.ui16,
-                                          sizeof(result->value.ui16)) == sizeof(result->value.ui16));
-            result->value.ui16 = ntohs(result->value.ui16);
-            break;
+/**
+ * Names of known keys, in order of @ref decoder_key.
+ */
+static const struct {
+    const char *name;
+    size_t length;
+} key_names[] = {
+        {ID_KEY_NAME, ID_KEY_NAME_LENGTH},
+        {VALUE_KEY_NAME, VALUE_KEY_NAME_LENGTH}
+};
 
-        case MSGPACK_UINT32:
-            ZERO_RETURN(buffered_read_all(sock, &result->value.ui32,
-                                          sizeof(result->value.ui32)) == sizeof(result->value.ui32));
-            result->value.ui32 = ntohl(result->value.ui32);
-            break;
+/**
+ * Calculates payload size of messagepack int.
+ * @param header — int header
+ * @return number of payload bytes, zero for positive fixnum, @ref DECODE_INVALID for other headers,
+ * including negative fixnum
+ */
+static int msgpack_int_length(uint8_t header) {
+    /* Positive fixnum is encoded in the header */
+    if (!(header & MSGPACK_UINT8_FIXNUM_MASK)) return 0;
+    /* Both uint8 – uint64 and int8 – int64 headers hold payload size in two lowest bits */
+    if (header >= MSGPACK_UINT8 && header <= MSGPACK_INT64) return 1 << (header & 3);
+    return DECODE_INVALID;
+}
 
-        case MSGPACK_UINT64:
-            ZERO_RETURN(buffered_read_all(sock, &result->value.ui64,
-                                          sizeof(result->value.ui64)) == sizeof(result->value.ui64));
-            result->value.ui64 = ntohll(result->value.ui64);
+/**
+ * Decodes non-negative messagepack int from memory.
+ * @param data — bytes starting at int header
+ * @param size — number of available bytes
+ * @param result[out] — decoded value
+ * @return number of consumed bytes, zero if int is incomplete, negative or not an int
+ */
+size_t decode_msgpack_int(const uint8_t *data, size_t size, uint_least64_t *result) {
+    if (size < 1) return 0;
+
+    int length = msgpack_int_length(data[0]);
+    if (length == DECODE_INVALID) return 0;
+    if (length == 0) {
+        *result = data[0];
+        return 1;
+    }
+    if (size < 1 + (size_t) length) return 0;
+    /* Signed ints are accepted unless negative */
+    if (data[0] >= MSGPACK_INT8 && (data[1] & MSGPACK_UINT8_FIXNUM_MASK)) return 0;
+
+    /* Big-endian payload */
+    *result = 0;
+    for (int i = 1; i <= length; ++i)
+        *result = (*result << 8) | data[i];
+    return 1 + length;
+}
+
+/**
+ * Decodes message in canonical layout, which is expected to lie in @p data as a whole.
+ * @param data — bytes starting at message
+ * @param size — number of available bytes
+ * @param result[out] — decoded message
+ * @return number of consumed bytes, zero if @p data doesn't start with a whole canonical message,
+ * which is then left to @ref decoder_step
+ */
+static size_t decode_canonical(const uint8_t *data, size_t size, struct message *result) {
+    uint32_t prefix, expected;
+    size_t offset, length;
+
+    if (size < MIN_CANONICAL_LENGTH) return 0;
+    memcpy(&prefix, data, sizeof(prefix));
+    memcpy(&expected, canonical_prefix, sizeof(expected));
+    if (prefix != expected) return 0;
+    offset = sizeof(prefix);
+
+    length = decode_msgpack_int(data + offset, size - offset, &result->id);
+    if (length == 0) return 0;
+    offset += length;
+
+    if (size - offset < sizeof(canonical_value_key) ||
+        memcmp(data + offset, canonical_value_key, sizeof(canonical_value_key)) != 0)
+        return 0;
+    offset += sizeof(canonical_value_key);
+
+    length = decode_msgpack_int(data + offset, size - offset, &result->value);
+    if (length == 0) return 0;
+    return offset + length;
+}
+
+/**
+ * Bulk kernels read this many bytes at every message, more than the longest canonical message.
+ */
+#define BULK_WINDOW 32
+/**
+ * Number of messages of the same layout checked at once.
+ */
+#define BULK_RUN 4
+
+/**
+ * Kernel decoding a run of whole canonical messages, up to the first other message.
+ * @param data — bytes starting at message
+ * @param size — number of available bytes
+ * @param messages[out] — decoded messages
+ * @param max — capacity of @p messages
+ * @param count[out] — number of decoded messages
+ * @return number of consumed bytes
+ */
+typedef size_t (*bulk_kernel)(const uint8_t *data, size_t size, struct message *messages, size_t max,
+                              size_t *count);
+
+/**
+ * Kernel without bulk decoding, every message is left to @ref decode_canonical.
+ */
+static size_t decode_bulk_scalar(const uint8_t *data, size_t size, struct message *messages, size_t max,
+                                 size_t *count) {
+    (void) data, (void) size, (void) messages, (void) max;
+    *count = 0;
+    return 0;
+}
+
+#ifdef BULK_KERNELS
+
+/**
+ * Fixed bytes of canonical message – prefix and value key – following id with @p length payload bytes.
+ */
+#define SKELETON(length) { \
+        MSGPACK_FIXMAP | NO_KEYS, MSGPACK_STRING | ID_KEY_NAME_LENGTH, 'i', 'd', \
+        [5 + (length)] = MSGPACK_STRING | VALUE_KEY_NAME_LENGTH, 'v', 'a', 'l', 'u', 'e' \
+}
+#define SKELETON_MASK(length) (0xfu | 0x3fu << (5 + (length)))
+
+/**
+ * Fixed bytes of canonical message and bit masks of their positions, by payload size of id.
+ */
+static const uint8_t skeletons[MSGPACK_MAX_UINT_LENGTH][BULK_WINDOW] __attribute__((aligned(BULK_WINDOW))) = {
+        [0] = SKELETON(0), [1] = SKELETON(1), [2] = SKELETON(2), [4] = SKELETON(4), [8] = SKELETON(8)
+};
+static const uint32_t skeleton_masks[MSGPACK_MAX_UINT_LENGTH] = {
+        [0] = SKELETON_MASK(0), [1] = SKELETON_MASK(1), [2] = SKELETON_MASK(2),
+        [4] = SKELETON_MASK(4), [8] = SKELETON_MASK(8)
+};
+
+/**
+ * Calculates payload size of messagepack int without branches, valid only for int headers.
+ * @param header — int header
+ * @return number of payload bytes, in range of @ref skeletons for any header
+ */
+static inline unsigned bulk_int_length(uint8_t header) {
+    /* Zero for positive fixnum, two lowest bits hold payload size of uint8 – uint64 and int8 – int64 */
+    return (header >> 7u) << (header & 3u);
+}
+
+/**
+ * Checks that int is a positive fixnum, uint8 – uint64 or non-negative int8 – int64.
+ * @param data — bytes starting at int header
+ * @return @p true if int is valid, @p false otherwise
+ */
+static inline bool bulk_int_valid(const uint8_t *data) {
+    uint8_t header = data[0];
+    return (header < MSGPACK_UINT8_FIXNUM_MASK) | ((uint8_t) (header - MSGPACK_UINT8) < 4) |
+           (((uint8_t) (header - MSGPACK_INT8) < 4) & (data[1] < MSGPACK_UINT8_FIXNUM_MASK));
+}
+
+/**
+ * Reads valid messagepack int, along with following bytes, which have to be readable.
+ * @param data — bytes starting at int header
+ * @param length — payload size of int
+ * @return value of int
+ */
+static inline uint_least64_t bulk_int(const uint8_t *data, unsigned length) {
+    uint64_t payload;
+    memcpy(&payload, data + 1, sizeof(payload));
+    /* Big-endian payload is followed by bytes of the next fields, which are shifted out */
+    payload = __builtin_bswap64(payload) >> ((64 - 8 * length) & 63);
+    return length > 0 ? payload : data[0];
+}
+
+/**
+ * Expected bytes of messages in a run of the same layout.
+ */
+struct bulk_run {
+    /** Fixed bytes of the layout, and headers of ints other than fixnums. */
+    uint8_t expected[BULK_WINDOW] __attribute__((aligned(BULK_WINDOW)));
+    /** Bit masks of positions of expected bytes, and of bytes which highest bit has to be clear. */
+    uint32_t equal_mask, sign_mask;
+};
+
+/**
+ * Compares fixed bytes of canonical message in two 16-byte halves of the window.
+ * @param data — @ref BULK_WINDOW bytes starting at message
+ * @param expected — expected bytes, aligned to @ref BULK_WINDOW
+ * @param signs[out] — highest bits of bytes of the window
+ * @return bit mask of bytes of the window equal to expected ones
+ */
+static inline uint32_t bulk_compare_sse2(const uint8_t *data, const uint8_t *expected, uint32_t *signs) {
+    __m128i low = _mm_loadu_si128((const __m128i *) data);
+    __m128i high = _mm_loadu_si128((const __m128i *) data + 1);
+    *signs = (uint32_t) _mm_movemask_epi8(low) | (uint32_t) _mm_movemask_epi8(high) << 16;
+    low = _mm_cmpeq_epi8(low, _mm_load_si128((const __m128i *) expected));
+    high = _mm_cmpeq_epi8(high, _mm_load_si128((const __m128i *) expected + 1));
+    return (uint32_t) _mm_movemask_epi8(low) | (uint32_t) _mm_movemask_epi8(high) << 16;
+}
+
+/**
+ * Compares fixed bytes of canonical message in the whole window at once.
+ * @param data — @ref BULK_WINDOW bytes starting at message
+ * @param expected — expected bytes, aligned to @ref BULK_WINDOW
+ * @param signs[out] — highest bits of bytes of the window
+ * @return bit mask of bytes of the window equal to expected ones
+ */
+__attribute__((target("avx2")))
+static inline uint32_t bulk_compare_avx2(const uint8_t *data, const uint8_t *expected, uint32_t *signs) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i *) data);
+    *signs = (uint32_t) _mm256_movemask_epi8(bytes);
+    return (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_load_si256((const __m256i *) expected)));
+}
+
+/**
+ * Sets expected bytes of run to the layout of a canonical message.
+ * Fixnums have to be fixnums again, other ints have to have the same header, and be non-negative.
+ * @param run[out] — run to set
+ * @param message — valid canonical message
+ * @param id_length — payload size of id
+ */
+static inline void bulk_run_init(struct bulk_run *run, const uint8_t *message, unsigned id_length) {
+    const unsigned headers[] = {sizeof(canonical_prefix),
+                                sizeof(canonical_prefix) + 1 + id_length + sizeof(canonical_value_key)};
+    memcpy(run->expected, skeletons[id_length], BULK_WINDOW);
+    run->equal_mask = skeleton_masks[id_length];
+    run->sign_mask = 0;
+    for (unsigned i = 0; i < sizeof(headers) / sizeof(headers[0]); ++i) {
+        uint8_t header = message[headers[i]];
+        if (header < MSGPACK_UINT8_FIXNUM_MASK) {
+            run->sign_mask |= 1u << headers[i];
+            continue;
+        }
+        run->expected[headers[i]] = header;
+        run->equal_mask |= 1u << headers[i];
+        if (header >= MSGPACK_INT8)
+            run->sign_mask |= 1u << (headers[i] + 1);
+    }
+}
+
+/**
+ * Reads message, which layout was checked.
+ * @param message — @ref BULK_WINDOW bytes starting at message
+ * @param id_length — payload size of id
+ * @param value_length — payload size of value
+ * @param result[out] — decoded message
+ */
+static inline void bulk_read(const uint8_t *message, unsigned id_length, unsigned value_length,
+                             struct message *result) {
+    const uint8_t *id = message + sizeof(canonical_prefix);
+    result->id = bulk_int(id, id_length);
+    result->value = bulk_int(id + 1 + id_length + sizeof(canonical_value_key), value_length);
+}
+
+/**
+ * Decodes a run of whole canonical messages, shared by vectorized kernels.
+ * Layout of a message is found from its int headers, then all its fixed bytes are compared at once.
+ * Messages usually share the layout of the previous ones, so then @ref BULK_RUN of them at a time
+ * are only compared with it – positions of messages don't depend on each other, and their checks
+ * run in parallel. Ints are read as big-endian words, so mixed int widths cost no mispredicted branches.
+ * @param data — bytes starting at message
+ * @param size — number of available bytes
+ * @param messages[out] — decoded messages
+ * @param max — capacity of @p messages
+ * @param count[out] — number of decoded messages
+ * @param avx2 — whether bytes are compared by AVX2 instead of SSE2
+ * @return number of consumed bytes, the rest starts with a message of other layout,
+ * or is shorter than @ref BULK_WINDOW
+ */
+static inline __attribute__((always_inline))
+size_t decode_bulk(const uint8_t *data, size_t size, struct message *messages, size_t max, size_t *count,
+                   bool avx2) {
+    size_t offset = 0, decoded = 0, previous = 0;
+    struct bulk_run run;
+
+    while (decoded < max && size - offset >= BULK_WINDOW) {
+        const uint8_t *message = data + offset;
+        const uint8_t *id = message + sizeof(canonical_prefix);
+        unsigned id_length = bulk_int_length(*id);
+        const uint8_t *value = id + 1 + id_length + sizeof(canonical_value_key);
+        unsigned value_length = bulk_int_length(*value);
+        size_t length = MIN_CANONICAL_LENGTH + id_length + value_length;
+
+        uint32_t signs, equal = avx2 ? bulk_compare_avx2(message, skeletons[id_length], &signs)
+                                     : bulk_compare_sse2(message, skeletons[id_length], &signs);
+        if (!(((equal & skeleton_masks[id_length]) == skeleton_masks[id_length]) &
+              bulk_int_valid(id) & bulk_int_valid(value)))
             break;
+        bulk_read(message, id_length, value_length, &messages[decoded++]);
+        offset += length;
 
+        /* Runs are expected only after two messages of the same length */
+        if (length != previous) {
+            previous = length;
+            continue;
+        }
+        bulk_run_init(&run, message, id_length);
+        while (max - decoded >= BULK_RUN && size - offset >= (BULK_RUN - 1) * length + BULK_WINDOW) {
+            bool same = true;
+            for (unsigned i = 0; i < BULK_RUN; ++i) {
+                equal = avx2 ? bulk_compare_avx2(data + offset + i * length, run.expected, &signs)
+                             : bulk_compare_sse2(data + offset + i * length, run.expected, &signs);
+                same &= ((equal & run.equal_mask) == run.equal_mask) & ((signs & run.sign_mask) == 0);
+            }
+            if (!same) break;
+            for (unsigned i = 0; i < BULK_RUN; ++i)
+                bulk_read(data + offset + i * length, id_length, value_length, &messages[decoded++]);
+            offset += BULK_RUN * length;
+        }
+    }
+    *count = decoded;
+    return offset;
+}
+
+/**
+ * Kernel comparing fixed bytes with SSE2, available on every x86-64 processor.
+ */
+static size_t decode_bulk_sse2(const uint8_t *data, size_t size, struct message *messages, size_t max,
+                               size_t *count) {
+    return decode_bulk(data, size, messages, max, count, false);
+}
+
+/**
+ * Kernel comparing fixed bytes with AVX2.
+ */
+__attribute__((target("avx2")))
+static size_t decode_bulk_avx2(const uint8_t *data, size_t size, struct message *messages, size_t max,
+                               size_t *count) {
+    return decode_bulk(data, size, messages, max, count, true);
+}
+
+#endif /* BULK_KERNELS */
+
+static size_t decode_bulk_resolve(const uint8_t *data, size_t size, struct message *messages, size_t max,
+                                  size_t *count);
+
+/**
+ * Selected kernel, chosen by the first call unless selected explicitly.
+ */
+static _Atomic bulk_kernel bulk_decoder = decode_bulk_resolve;
+
+/**
+ * Checks whether processor and build support given kernel.
+ * @param kernel — kernel to check
+ * @return @p true if @p kernel can be selected, @p false otherwise
+ */
+bool decode_kernel_supported(enum decode_kernel kernel) {
+    switch (kernel) {
+        case DECODE_SCALAR:
+            return true;
+#ifdef BULK_KERNELS
+        case DECODE_SSE2:
+            return true;
+        case DECODE_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
         default:
-            /* We don't accept signed ints */
-            if (result->kind & MSGPACK_UINT8_FIXNUM_MASK) return false;
-            /* Fixnum is encoded in the header */
-            result->value.ui8 = result->kind;
+            return false;
     }
-    return true;
 }
 
 /**
- * Converts messagepack int to uint_least64_t.
- * @param x — to convert
- * @return converted @p x
+ * Selects kernel decoding runs of canonical messages in every decoder, eg. for benchmarks.
+ * @param kernel — supported kernel
+ */
+void decode_kernel_select(enum decode_kernel kernel) {
+    bulk_kernel selected = decode_bulk_scalar;
+#ifdef BULK_KERNELS
+    if (kernel == DECODE_SSE2)
+        selected = decode_bulk_sse2;
+    else if (kernel == DECODE_AVX2)
+        selected = decode_bulk_avx2;
+#endif
+    atomic_store_explicit(&bulk_decoder, selected, memory_order_relaxed);
+}
+
+/**
+ * Selects the fastest supported kernel, then decodes with it.
+ */
+static size_t decode_bulk_resolve(const uint8_t *data, size_t size, struct message *messages, size_t max,
+                                  size_t *count) {
+    enum decode_kernel kernel = DECODE_AVX2;
+    while (!decode_kernel_supported(kernel))
+        --kernel;
+    decode_kernel_select(kernel);
+    return atomic_load_explicit(&bulk_decoder, memory_order_relaxed)(data, size, messages, max, count);
+}
+
+/**
+ * Initializes decoder, to expect beginning of a message.
+ * @param decoder[out] — decoder to initialize
+ */
+void decoder_init(struct decoder *decoder) {
+    decoder->state = DECODER_MAP_HEADER;
+    decoder->remaining = 0;
+}
+
+/**
+ * Moves decoder to big-endian length of @p bytes bytes.
+ * @param decoder — decoder at header followed by length
+ * @param bytes — size of length
+ * @param state — state reading the length
+ * @return @ref DECODE_INCOMPLETE
  */
-uint_least64_t msgpack_int_value(struct msgpack_int x) {
-    switch (x.kind) {
+static int decoder_length(struct decoder *decoder, uint8_t bytes, enum decoder_state state) {
+    decoder->length = 0;
+    decoder->remaining = bytes;
+    decoder->state = state;
+    return DECODE_INCOMPLETE;
+}
+
+/**
+ * Finishes map entry, and the message after its last entry.
+ * @param decoder — decoder after value of map entry
+ * @return @ref DECODE_INVALID if message lacks any field, @p 1 if it is complete,
+ * @ref DECODE_INCOMPLETE otherwise
+ */
+static int decoder_entry_done(struct decoder *decoder) {
+    if (--decoder->entries > 0) {
+        decoder->state = DECODER_KEY_HEADER;
+        return DECODE_INCOMPLETE;
+    }
+    decoder->state = DECODER_MAP_HEADER;
+    return decoder->seen == ((1 << KEY_ID) | (1 << KEY_VALUE)) ? 1 : DECODE_INVALID;
+}
+
+/**
+ * Starts message of @p entries map entries.
+ * @param decoder — decoder after map header
+ * @param entries — size of the map
+ * @return @ref DECODE_INVALID if map is too small, @ref DECODE_INCOMPLETE otherwise
+ */
+static int decoder_map_start(struct decoder *decoder, uint_least64_t entries) {
+    if (entries < NO_KEYS) return DECODE_INVALID;
+    decoder->entries = (uint32_t) entries;
+    decoder->seen = 0;
+    decoder->state = DECODER_KEY_HEADER;
+    return DECODE_INCOMPLETE;
+}
+
+/**
+ * Finishes skipped object, and the map entry once nothing is left to skip.
+ * @param decoder — decoder after the last byte of skipped object
+ * @return status of @ref decoder_entry_done, or @ref DECODE_INCOMPLETE
+ */
+static int decoder_skipped(struct decoder *decoder) {
+    if (decoder->skip == 0) return decoder_entry_done(decoder);
+    decoder->state = DECODER_SKIP_HEADER;
+    return DECODE_INCOMPLETE;
+}
+
+/**
+ * Skips elements of a container.
+ * @param decoder — decoder after container header
+ * @param objects — number of keys and values of the container
+ * @return status of @ref decoder_skipped
+ */
+static int decoder_skip_objects(struct decoder *decoder, uint_least64_t objects) {
+    decoder->skip += objects;
+    return decoder_skipped(decoder);
+}
+
+/**
+ * Skips payload of an object.
+ * @param decoder — decoder after object header
+ * @param bytes — size of payload
+ * @return status of @ref decoder_skipped
+ */
+static int decoder_skip_bytes(struct decoder *decoder, uint_least64_t bytes) {
+    if (bytes == 0) return decoder_skipped(decoder);
+    decoder->length = bytes;
+    decoder->state = DECODER_SKIP_PAYLOAD;
+    return DECODE_INCOMPLETE;
+}
+
+/**
+ * Feeds header of skipped object to decoder.
+ * @param decoder — decoder at header of skipped object
+ * @param byte — object header
+ * @return @ref DECODE_INVALID on invalid header, status of skipping otherwise
+ */
+static int decoder_skip_header(struct decoder *decoder, uint8_t byte) {
+    --decoder->skip;
+    /* Fixnums */
+    if (byte < MSGPACK_FIXMAP || byte >= MSGPACK_NEGATIVE_FIXNUM)
+        return decoder_skipped(decoder);
+    if (byte < MSGPACK_FIXARRAY)
+        return decoder_skip_objects(decoder, 2 * (byte & MSGPACK_FIX_LENGTH_MASK));
+    if (byte < MSGPACK_STRING)
+        return decoder_skip_objects(decoder, byte & MSGPACK_FIX_LENGTH_MASK);
+    if (byte < MSGPACK_NIL)
+        return decoder_skip_bytes(decoder, byte & MSGPACK_FIXSTR_LENGTH_MASK);
+
+    decoder->skipped = SKIP_BYTES;
+    switch (byte) {
+        case MSGPACK_NIL:
+        case MSGPACK_FALSE:
+        case MSGPACK_TRUE:
+            return decoder_skipped(decoder);
+        case MSGPACK_FLOAT32:
+            return decoder_skip_bytes(decoder, sizeof(uint32_t));
+        case MSGPACK_FLOAT64:
+            return decoder_skip_bytes(decoder, sizeof(uint64_t));
+        case MSGPACK_UINT8:
         case MSGPACK_UINT16:
-            return x.value.ui16;
         case MSGPACK_UINT32:
-            return x.value.ui32;
         case MSGPACK_UINT64:
-            return x.value.ui64;
+        case MSGPACK_INT8:
+        case MSGPACK_INT16:
+        case MSGPACK_INT32:
+        case MSGPACK_INT64:
+            return decoder_skip_bytes(decoder, msgpack_int_length(byte));
+        case MSGPACK_BIN8:
+        case MSGPACK_STR8:
+            return decoder_length(decoder, sizeof(uint8_t), DECODER_SKIP_LENGTH);
+        case MSGPACK_BIN16:
+        case MSGPACK_STR16:
+            return decoder_length(decoder, sizeof(uint16_t), DECODER_SKIP_LENGTH);
+        case MSGPACK_BIN32:
+        case MSGPACK_STR32:
+            return decoder_length(decoder, sizeof(uint32_t), DECODER_SKIP_LENGTH);
+        case MSGPACK_ARRAY16:
+        case MSGPACK_ARRAY32:
+            decoder->skipped = SKIP_ARRAY;
+            return decoder_length(decoder, byte == MSGPACK_ARRAY16 ? sizeof(uint16_t) : sizeof(uint32_t),
+                                  DECODER_SKIP_LENGTH);
+        case MSGPACK_MAP16:
+        case MSGPACK_MAP32:
+            decoder->skipped = SKIP_MAP;
+            return decoder_length(decoder, byte == MSGPACK_MAP16 ? sizeof(uint16_t) : sizeof(uint32_t),
+                                  DECODER_SKIP_LENGTH);
+        case MSGPACK_EXT8:
+        case MSGPACK_EXT16:
+        case MSGPACK_EXT32:
+            decoder->skipped = SKIP_EXT;
+            return decoder_length(decoder, 1 << (byte - MSGPACK_EXT8), DECODER_SKIP_LENGTH);
         default:
-            /* Fixint or one byte int with header */
-            return x.value.ui8;
+            /* Type byte and 1 – 16 bytes of fixext */
+            if (byte >= MSGPACK_FIXEXT1 && byte <= MSGPACK_FIXEXT16)
+                return decoder_skip_bytes(decoder, 1 + (1 << (byte - MSGPACK_FIXEXT1)));
+            /* Header never used by messagepack */
+            return DECODE_INVALID;
+    }
+}
+
+/**
+ * Finishes key of map entry.
+ * @param decoder — decoder after the last byte of key
+ * @return @ref DECODE_INVALID on repeated known key, @ref DECODE_INCOMPLETE otherwise
+ */
+static int decoder_key_done(struct decoder *decoder) {
+    if (decoder->key == KEY_UNKNOWN) {
+        decoder->skip = 1;
+        decoder->state = DECODER_SKIP_HEADER;
+        return DECODE_INCOMPLETE;
     }
+    if (decoder->seen & (1 << decoder->key)) return DECODE_INVALID;
+    decoder->seen |= 1 << decoder->key;
+    decoder->state = DECODER_INT_HEADER;
+    return DECODE_INCOMPLETE;
 }
 
 /**
- * Reads and parse messagepack packet from @p sock.
- * @param sock[buf] — sock to read from
- * @param result[out] — output to read into
- * @return @p true on success, @p false otherwise – disconnect or invalid headers
+ * Starts key name, which may be known only if its length matches.
+ * @param decoder — decoder after key header and length
+ * @param length — length of key name
+ * @return status of @ref decoder_key_done for empty key, @ref DECODE_INCOMPLETE otherwise
  */
-bool read_packet(int sock, struct msgpack_packet *result) {
-    /* Read, parse, validate fixmap header */
-    ZERO_RETURN(buffered_read_all(sock, &result->map_header,
-                                  sizeof(result->map_header)) == sizeof(result->map_header));
-    ZERO_RETURN(result->map_header == (MSGPACK_FIXMAP | NO_KEYS));
+static int decoder_key_start(struct decoder *decoder, uint_least64_t length) {
+    decoder->key = KEY_UNKNOWN;
+    for (int key = KEY_ID; key < KEY_UNKNOWN; ++key) {
+        if (length == key_names[key].length)
+            decoder->key = key;
+    }
+    if (length == 0) return decoder_key_done(decoder);
+    decoder->length = length;
+    decoder->state = DECODER_KEY;
+    return DECODE_INCOMPLETE;
+}
+
+/**
+ * Returns field of message, which value follows current key.
+ * @param decoder — decoder after known key
+ * @return field of @p decoder->message
+ */
+static uint_least64_t *decoder_field(struct decoder *decoder) {
+    return decoder->key == KEY_ID ? &decoder->message.id : &decoder->message.value;
+}
+
+/**
+ * Feeds single byte to decoder.
+ * @param decoder — decoder in the middle of a message
+ * @param byte — next byte of the stream
+ * @return @ref DECODE_INVALID, @p 1 if byte completes a message, @ref DECODE_INCOMPLETE otherwise
+ */
+static int decoder_step(struct decoder *decoder, uint8_t byte) {
+    switch (decoder->state) {
+        case DECODER_MAP_HEADER:
+            if ((byte & ~MSGPACK_FIX_LENGTH_MASK) == MSGPACK_FIXMAP)
+                return decoder_map_start(decoder, byte & MSGPACK_FIX_LENGTH_MASK);
+            if (byte == MSGPACK_MAP16 || byte == MSGPACK_MAP32)
+                return decoder_length(decoder, byte == MSGPACK_MAP16 ? sizeof(uint16_t) : sizeof(uint32_t),
+                                      DECODER_MAP_LENGTH);
+            return DECODE_INVALID;
+
+        case DECODER_KEY_HEADER:
+            if ((byte & ~MSGPACK_FIXSTR_LENGTH_MASK) == MSGPACK_STRING)
+                return decoder_key_start(decoder, byte & MSGPACK_FIXSTR_LENGTH_MASK);
+            if (byte >= MSGPACK_STR8 && byte <= MSGPACK_STR32)
+                return decoder_length(decoder, 1 << (byte - MSGPACK_STR8), DECODER_KEY_LENGTH);
+            /* Key of other type is never a known one, skip it along with its value */
+            decoder->skip = 2;
+            return decoder_skip_header(decoder, byte);
+
+        case DECODER_MAP_LENGTH:
+        case DECODER_KEY_LENGTH:
+        case DECODER_SKIP_LENGTH:
+            decoder->length = (decoder->length << 8) | byte;
+            if (--decoder->remaining > 0) break;
+            if (decoder->state == DECODER_MAP_LENGTH)
+                return decoder_map_start(decoder, decoder->length);
+            if (decoder->state == DECODER_KEY_LENGTH)
+                return decoder_key_start(decoder, decoder->length);
+            switch (decoder->skipped) {
+                case SKIP_ARRAY:
+                    return decoder_skip_objects(decoder, decoder->length);
+                case SKIP_MAP:
+                    return decoder_skip_objects(decoder, 2 * decoder->length);
+                case SKIP_EXT:
+                    return decoder_skip_bytes(decoder, decoder->length + 1);
+                default:
+                    return decoder_skip_bytes(decoder, decoder->length);
+            }
+
+        case DECODER_KEY:
+            /* Mismatched byte turns known key into an unknown one */
+            if (decoder->key != KEY_UNKNOWN &&
+                byte != (uint8_t) key_names[decoder->key].name[key_names[decoder->key].length - decoder->length])
+                decoder->key = KEY_UNKNOWN;
+            if (--decoder->length == 0) return decoder_key_done(decoder);
+            break;
+
+        case DECODER_INT_HEADER: {
+            int length = msgpack_int_length(byte);
+            if (length == DECODE_INVALID) return DECODE_INVALID;
+            if (length == 0) {
+                *decoder_field(decoder) = byte;
+                return decoder_entry_done(decoder);
+            }
+            *decoder_field(decoder) = 0;
+            decoder->remaining = length;
+            decoder->state = byte >= MSGPACK_INT8 ? DECODER_INT_SIGN : DECODER_INT_PAYLOAD;
+            break;
+        }
+
+        case DECODER_INT_SIGN:
+            if (byte & MSGPACK_UINT8_FIXNUM_MASK) return DECODE_INVALID;
+            decoder->state = DECODER_INT_PAYLOAD;
+            /* fall through */
+        case DECODER_INT_PAYLOAD:
+            *decoder_field(decoder) = (*decoder_field(decoder) << 8) | byte;
+            if (--decoder->remaining == 0) return decoder_entry_done(decoder);
+            break;
 
-    /* Read, parse, validate id section */
-    ZERO_RETURN(buffered_read_all(sock, &result->id_key.kind,
-                                  sizeof(result->id_key.kind)) == sizeof(result->id_key.kind));
-    ZERO_RETURN(result->id_key.kind == (MSGPACK_STRING | ID_KEY_NAME_LENGTH));
+        case DECODER_SKIP_HEADER:
+            return decoder_skip_header(decoder, byte);
 
-    ZERO_RETURN(buffered_read_all(sock, result->id_key.value,
-                                  ID_KEY_NAME_LENGTH) == ID_KEY_NAME_LENGTH);
-    result->id_key.value[ID_KEY_NAME_LENGTH] = '\0';
-    ZERO_RETURN(strcmp(result->id_key.value, ID_KEY_NAME) == 0);
+        case DECODER_SKIP_PAYLOAD:
+            if (--decoder->length == 0) return decoder_skipped(decoder);
+            break;
 
-    ZERO_RETURN(buffered_read_all(sock, &result->id_value.kind,
-                                  sizeof(result->id_value.kind)) == sizeof(result->id_value.kind));
-    ZERO_RETURN(read_msgpack_int(sock, &result->id_value));
+        case DECODER_INVALID:
+            return DECODE_INVALID;
+    }
+    return DECODE_INCOMPLETE;
+}
 
-    /* Read, parse, validate value section */
-    ZERO_RETURN(buffered_read_all(sock, &result->value_key.kind,
-                                  sizeof(result->value_key.kind)) == sizeof(result->value_key.kind));
-    ZERO_RETURN(result->value_key.kind == (MSGPACK_STRING | VALUE_KEY_NAME_LENGTH));
+/**
+ * Decodes as many messages as possible from contiguous span of a stream.
+ * Canonical messages lying in @p data as a whole are decoded in place, other ones,
+ * and a message split at the end of @p data, are fed to @p decoder,
+ * which completes split message in the next call.
+ * Decoding stops at invalid data, messages preceding it are still returned.
+ * @param decoder — decoder of the stream
+ * @param data — next bytes of the stream
+ * @param size — number of bytes in @p data
+ * @param messages[out] — decoded messages
+ * @param max — capacity of @p messages
+ * @param count[out] — number of decoded messages
+ * @return number of consumed bytes, less than @p size only if @p max messages
+ * were decoded or @ref decoder_failed
+ */
+size_t decode_messages(struct decoder *decoder, const uint8_t *data, size_t size,
+                       struct message *messages, size_t max, size_t *count) {
+    size_t offset = 0;
+    *count = 0;
 
-    ZERO_RETURN(buffered_read_all(sock, result->value_key.value,
-                                  VALUE_KEY_NAME_LENGTH) == VALUE_KEY_NAME_LENGTH);
-    result->value_key.value[VALUE_KEY_NAME_LENGTH] = '\0';
-    ZERO_RETURN(strcmp(result->value_key.value, VALUE_KEY_NAME) == 0);
+    while (offset < size && *count < max) {
+        if (decoder->state == DECODER_MAP_HEADER) {
+            /* Vectorized path – run of whole canonical messages */
+            size_t decoded;
+            offset += atomic_load_explicit(&bulk_decoder, memory_order_relaxed)(
+                    data + offset, size - offset, messages + *count, max - *count, &decoded);
+            if (decoded > 0) {
+                *count += decoded;
+                continue;
+            }
 
-    ZERO_RETURN(buffered_read_all(sock, &result->value_value.kind,
-                                  sizeof(result->value_value.kind)) == sizeof(result->value_value.kind));
-    ZERO_RETURN(read_msgpack_int(sock, &result->value_value));
+            /* Fast path – whole canonical message in buffer */
+            size_t length = decode_canonical(data + offset, size - offset, &messages[*count]);
+            if (length > 0) {
+                offset += length;
+                ++*count;
+                continue;
+            }
+        } else if (decoder->state == DECODER_SKIP_PAYLOAD && decoder->length > 1) {
+            /* Skip all available payload but the last byte, which finishes skipped object */
+            size_t skipped = decoder->length - 1 < size - offset ? decoder->length - 1 : size - offset;
+            decoder->length -= skipped;
+            offset += skipped;
+            continue;
+        }
 
-    return true;
+        /* Other layouts and messages split between buffers are decoded byte by byte */
+        switch (decoder_step(decoder, data[offset])) {
+            case DECODE_INVALID:
+                decoder->state = DECODER_INVALID;
+                return offset;
+            case DECODE_INCOMPLETE:
+                break;
+            default:
+                messages[(*count)++] = decoder->message;
+        }
+        ++offset;
+    }
+    return offset;
 }
 
 /**
- * Calls @ref read_packet, rewrites it to @ref message.
- * @param sock[buf] — sock to read from
- * @param result[out] — output to rewrite @ref read_packet result
- * @return @p true on success, @p false otherwise – on disconnect or invalid data
+ * Checks whether decoded stream contained invalid data.
+ * @param decoder — decoder of the stream
+ * @return @p true if no further message can be decoded, @p false otherwise
  */
-bool next_message(int sock, struct message *result) {
-    /* Read message from sock */
-    struct msgpack_packet packet;
-    ZERO_RETURN(read_packet(sock, &packet));
+bool decoder_failed(const struct decoder *decoder) {
+    return decoder->state == DECODER_INVALID;
+}
 
-    /* Convert to message struct */
-    result->id = msgpack_int_value(packet.id_value);
-    result->value = msgpack_int_value(packet.value_value);
-    return true;
-}
\ No newline at end of file
+/**
+ * Checks whether decoder is between messages, so decoded bytes held no partial message.
+ * @param decoder — decoder of the stream
+ * @return @p true if the last decoded message is complete, @p false if it is not or data was invalid
+ */
+bool decoder_idle(const struct decoder *decoder) {
+    return decoder->state == DECODER_MAP_HEADER;
+}
+
+/**
+ * Encodes unsigned int in the shortest messagepack form.
+ * @param output[out] — place for at least @ref MSGPACK_MAX_UINT_LENGTH bytes
+ * @param value — value to encode
+ * @return number of written bytes
+ */
+size_t encode_msgpack_uint(uint8_t *output, uint_least64_t value) {
+    size_t length;
+    if (value < MSGPACK_UINT8_FIXNUM_MASK) {
+        /* Fixnum is encoded in the header */
+        output[0] = (uint8_t) value;
+        return 1;
+    } else if (value <= UINT8_MAX) {
+        output[0] = MSGPACK_UINT8;
+        length = sizeof(uint8_t);
+    } else if (value <= UINT16_MAX) {
+        output[0] = MSGPACK_UINT16;
+        length = sizeof(uint16_t);
+    } else if (value <= UINT32_MAX) {
+        output[0] = MSGPACK_UINT32;
+        length = sizeof(uint32_t);
+    } else {
+        output[0] = MSGPACK_UINT64;
+        length = sizeof(uint64_t);
+    }
+
+    /* Big-endian payload */
+    for (size_t i = length; i > 0; --i, value >>= 8)
+        output[i] = (uint8_t) value;
+    return 1 + length;
+}
+
+/**
+ * Encodes fixstr key.
+ * @param output[out] — place for at least @p length + 1 bytes
+ * @param name — key name
+ * @param length — length of @p name, less than 32
+ * @return number of written bytes
+ */
+size_t encode_msgpack_key(uint8_t *output, const char *name, size_t length) {
+    output[0] = MSGPACK_STRING | length;
+    memcpy(output + 1, name, length);
+    return 1 + length;
+}
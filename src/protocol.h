@@ -20,6 +20,7 @@
  * @file
  * Interface for limited part of messagepack format.
  * Sufficient to handle messages like `{"id": uint8_t – uint64_t, "value": uint8_t – uint64_t}`.
+ * Messages are decoded straight from receive buffers, by resumable @ref decoder.
  *
  * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
  * @date 10.05.2019
@@ -30,29 +31,77 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 #define MSGPACK_FIXMAP 0x80
+#define MSGPACK_FIXARRAY 0x90
 #define MSGPACK_STRING 0xa0
-
+#define MSGPACK_FIXARRAY_LIMIT 16
+#define MSGPACK_FIX_LENGTH_MASK 0x0f
+#define MSGPACK_FIXSTR_LENGTH_MASK 0x1f
+#define MSGPACK_NEGATIVE_FIXNUM 0xe0
+
+#define MSGPACK_NIL 0xc0
+#define MSGPACK_FALSE 0xc2
+#define MSGPACK_TRUE 0xc3
+#define MSGPACK_BIN8 0xc4
+#define MSGPACK_BIN16 0xc5
+#define MSGPACK_BIN32 0xc6
+#define MSGPACK_EXT8 0xc7
+#define MSGPACK_EXT16 0xc8
+#define MSGPACK_EXT32 0xc9
+#define MSGPACK_FLOAT32 0xca
+#define MSGPACK_FLOAT64 0xcb
 #define MSGPACK_UINT8 0xcc
 #define MSGPACK_UINT16 0xcd
 #define MSGPACK_UINT32 0xce
 #define MSGPACK_UINT64 0xcf
+#define MSGPACK_INT8 0xd0
+#define MSGPACK_INT16 0xd1
+#define MSGPACK_INT32 0xd2
+#define MSGPACK_INT64 0xd3
+#define MSGPACK_FIXEXT1 0xd4
+#define MSGPACK_FIXEXT16 0xd8
+#define MSGPACK_STR8 0xd9
+#define MSGPACK_STR16 0xda
+#define MSGPACK_STR32 0xdb
+#define MSGPACK_ARRAY16 0xdc
+#define MSGPACK_ARRAY32 0xdd
+#define MSGPACK_MAP16 0xde
+#define MSGPACK_MAP32 0xdf
+
 #define MSGPACK_UINT8_FIXNUM_MASK 0x80
+#define MSGPACK_MAX_UINT_LENGTH 9
 
 #define ID_KEY_NAME "id"
 #define ID_KEY_NAME_LENGTH 2
 #define VALUE_KEY_NAME "value"
 #define VALUE_KEY_NAME_LENGTH 5
-#define MAX_KEY_NAME_LENGTH 5
+#define VALUES_KEY_NAME "values"
+#define VALUES_KEY_NAME_LENGTH 6
 #define NO_KEYS 2
 
 /**
- * Converts 64bit integer byte order from network to host.
+ * Number of messages decoded at once by connection handlers.
+ */
+#define MESSAGES_BATCH 64
+
+/**
+ * Results of decoding, other than number of consumed bytes.
+ */
+#define DECODE_INCOMPLETE 0
+#define DECODE_INVALID (-1)
+
+/**
+ * Kernels decoding runs of whole canonical messages, chosen at runtime.
  */
-#define ntohll(x) \
-    ((1==ntohl(1)) ? (x) : \
-    ((uint_least64_t)ntohl((x) & 0xFFFFFFFF) << 32) | ntohl((x) >> 32))
+enum decode_kernel {
+    /** No bulk decoding, every message takes scalar fast path. */
+    DECODE_SCALAR,
+    DECODE_SSE2,
+    DECODE_AVX2
+};
 
 /**
  * High-level message format.
@@ -63,50 +112,90 @@ struct message {
 };
 
 /**
- * Messagepack available int types.
+ * Position of @ref decoder in a message.
  */
-union ints {
-    uint8_t ui8;
-    uint16_t ui16;
-    uint32_t ui32;
-    uint_least64_t ui64;
+enum decoder_state {
+    DECODER_MAP_HEADER,
+    /** Reading number of entries of map16 or map32. */
+    DECODER_MAP_LENGTH,
+    DECODER_KEY_HEADER,
+    /** Reading length of str8 – str32 key. */
+    DECODER_KEY_LENGTH,
+    DECODER_KEY,
+    DECODER_INT_HEADER,
+    /** First payload byte of signed int, which has to be non-negative. */
+    DECODER_INT_SIGN,
+    DECODER_INT_PAYLOAD,
+    /** Skipping value of unknown key, or unknown key along with its value. */
+    DECODER_SKIP_HEADER,
+    DECODER_SKIP_LENGTH,
+    DECODER_SKIP_PAYLOAD,
+    /** Stream contained invalid data, final state. */
+    DECODER_INVALID
 };
 
 /**
- * Messagepack int type with header.
+ * Key of map entry being decoded, and bit of @ref decoder::seen.
  */
-struct msgpack_int {
-    uint8_t kind;
-    union ints value;
+enum decoder_key {
+    KEY_ID,
+    KEY_VALUE,
+    KEY_UNKNOWN
 };
 
 /**
- * Messagepack string type with header.
+ * Kind of skipped object, which length is being read.
  */
-struct msgpack_string {
-    uint8_t kind;
-    char value[MAX_KEY_NAME_LENGTH + 1];
+enum decoder_skip {
+    SKIP_BYTES,
+    /** Ext payload is preceded by a type byte. */
+    SKIP_EXT,
+    SKIP_ARRAY,
+    SKIP_MAP
 };
 
 /**
- * Messagepack packet of the form `{"id": uint8_t – uint_least64_t, "value": uint8_t – uint_least64_t}`.
+ * Resumable decoder of a message stream.
+ * Keeps state of a message split between receive buffers, so no byte is read twice.
+ * Skipped values are counted, instead of kept on a stack, so nesting depth is unlimited.
  */
-struct msgpack_packet {
-    uint8_t map_header;
+struct decoder {
+    enum decoder_state state;
+    /** Number of remaining bytes of length or int payload. */
+    uint8_t remaining;
+    /** Key of current map entry, @ref decoder_key. */
+    uint8_t key;
+    /** Keys of current message seen so far, a bit per @ref decoder_key. */
+    uint8_t seen;
+    /** Kind of object, which length is being read, @ref decoder_skip. */
+    uint8_t skipped;
+    /** Number of remaining map entries. */
+    uint32_t entries;
+    /** Length being read, then number of remaining bytes of key name or skipped payload. */
+    uint_least64_t length;
+    /** Number of skipped objects, which headers were not read yet. */
+    uint_least64_t skip;
+    /** Partially decoded message. */
+    struct message message;
+};
 
-    struct msgpack_string id_key;
-    struct msgpack_int id_value;
+void decoder_init(struct decoder *decoder);
 
-    struct msgpack_string value_key;
-    struct msgpack_int value_value;
-};
+size_t decode_messages(struct decoder *decoder, const uint8_t *data, size_t size,
+                       struct message *messages, size_t max, size_t *count);
+
+bool decoder_failed(const struct decoder *decoder);
+
+bool decoder_idle(const struct decoder *decoder);
+
+bool decode_kernel_supported(enum decode_kernel kernel);
 
-bool read_msgpack_int(int sock, struct msgpack_int *result);
+void decode_kernel_select(enum decode_kernel kernel);
 
-uint_least64_t msgpack_int_value(struct msgpack_int x);
+size_t decode_msgpack_int(const uint8_t *data, size_t size, uint_least64_t *result);
 
-bool read_packet(int sock, struct msgpack_packet *result);
+size_t encode_msgpack_uint(uint8_t *output, uint_least64_t value);
 
-bool next_message(int sock, struct message *result);
+size_t encode_msgpack_key(uint8_t *output, const char *name, size_t length);
 
 #endif /* _PROTOCOL_H_ */
\ No newline at end of file
@@ -0,0 +1,462 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Implementation of publishing of completed aggregates to subscribers.
+ * Batches written by output thread are copied once into the ring, a single publisher thread
+ * sends them to every subscriber straight from the ring, with edge-triggered epoll.
+ * Subscriber sends ranges ending at batch boundaries, so it always receives whole aggregates,
+ * and is checked for lag only between ranges. Bytes are overwritten once the ring wraps around,
+ * regardless of subscribers, so the rest of the range of a lagging subscriber is copied aside,
+ * and subscriber, which range got overwritten anyway, is disconnected.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _GNU_SOURCE
+
+#include "publish.h"
+#include "metrics.h"
+#include "pool.h"
+#include "error.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Published batch, entry of @ref batches.
+ */
+struct batch {
+    /** Position of the first byte of the batch, in bytes published so far. */
+    uint_least64_t position;
+    /** Number of aggregates published before the batch. */
+    uint_least64_t records;
+};
+
+/**
+ * Connection of a subscriber, accessed only by publisher thread.
+ */
+struct subscriber {
+    int sock;
+    /** Whether socket would block, until it becomes writable. */
+    bool blocked;
+    /** Whether connection was closed by subscriber. */
+    bool closed;
+    /** Whether the rest of the range is sent from @p spill instead of the ring. */
+    bool spilled;
+    /** Position of the next byte to send, and of the end of range being sent, which is a batch boundary. */
+    uint_least64_t cursor, range_end;
+    /** Number of aggregates published before @p cursor, valid at the end of range, and before @p range_end. */
+    uint_least64_t records, range_records;
+    /** Copy of the rest of the range starting at @p spill_position, allocated on first use. */
+    char *spill;
+    uint_least64_t spill_position;
+    struct subscriber *next;
+};
+
+/**
+ * Publishing configuration, set by @ref init_publish.
+ */
+static struct publish_config config;
+/**
+ * Ring of published bytes, byte at position p is stored at p modulo ring size.
+ */
+static char *ring;
+/**
+ * Listening socket of subscribers, and eventfd waking publisher thread after every batch.
+ */
+static int listen_sock, wake_fd;
+/**
+ * Positions of published bytes and aggregates, and recent batches – changed by output thread,
+ * read by publisher thread under @ref batches_mutex.
+ */
+static pthread_mutex_t batches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint_least64_t head, published_records, batches_count;
+static struct batch batches[PUBLISH_BATCHES];
+/**
+ * Number of subscribers, nothing is copied to the ring without them.
+ */
+static _Atomic unsigned subscribers_count;
+/**
+ * Position, up to which every subscriber was sent the ring, for shutdown.
+ */
+static _Atomic uint_least64_t served;
+/**
+ * Connections of subscribers, list owned by publisher thread.
+ */
+static struct subscriber *subscribers;
+static struct pool subscriber_pool;
+
+/**
+ * Wakes publisher thread.
+ */
+static void publish_wake() {
+    uint64_t one = 1;
+    ERROR_CHECK(write(wake_fd, &one, sizeof(one)));
+}
+
+/**
+ * Appends formatted aggregates to the ring and wakes publisher thread, called only by output thread.
+ * Bytes are copied before the batch is published, publisher never reads past @ref head.
+ * @param buffer — whole formatted aggregates
+ * @param size — size of @p buffer, at most batch size
+ * @param records — number of aggregates in @p buffer
+ */
+void publish(const char *buffer, size_t size, size_t records) {
+    if (atomic_load_explicit(&subscribers_count, memory_order_relaxed) == 0) return;
+
+    size_t offset = head & (config.ring_size - 1);
+    size_t first = size < config.ring_size - offset ? size : config.ring_size - offset;
+    memcpy(ring + offset, buffer, first);
+    memcpy(ring, buffer + first, size - first);
+
+    ERROR_CHECK(pthread_mutex_lock(&batches_mutex));
+    batches[batches_count++ % PUBLISH_BATCHES] = (struct batch) {.position = head, .records = published_records};
+    head += size;
+    published_records += records;
+    ERROR_CHECK(pthread_mutex_unlock(&batches_mutex));
+    publish_wake();
+}
+
+/**
+ * Finds the oldest remembered batch starting at or after given position.
+ * @param position — position in published bytes
+ * @param found[out] — found batch, or end of published bytes if there is none
+ */
+static void batch_from(uint_least64_t position, struct batch *found) {
+    uint_least64_t low = batches_count > PUBLISH_BATCHES ? batches_count - PUBLISH_BATCHES : 0;
+    uint_least64_t high = batches_count;
+
+    /* Batches are sorted by position */
+    while (low < high) {
+        uint_least64_t middle = low + (high - low) / 2;
+        if (batches[middle % PUBLISH_BATCHES].position < position)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (low < batches_count)
+        *found = batches[low % PUBLISH_BATCHES];
+    else
+        *found = (struct batch) {.position = head, .records = published_records};
+}
+
+/**
+ * Checks if bytes from given position on are still in the ring, including batch written meanwhile.
+ * @param position — position in published bytes
+ * @return @p true if writer may have overwritten the byte at @p position, @p false otherwise
+ */
+static bool overwritten(uint_least64_t position) {
+    return head + config.batch_size - position > config.ring_size;
+}
+
+/**
+ * Copies the rest of the range aside, so that writer can overwrite it in the ring.
+ * Range is shorter than two batches, as it ends at the first boundary a batch after its start.
+ * @param subscriber — subscriber in the middle of a range
+ * @return @p false if the rest was overwritten before it was copied, @p true otherwise
+ */
+static bool subscriber_spill(struct subscriber *subscriber) {
+    if (subscriber->spill == NULL) {
+        NULL_CHECK(subscriber->spill = malloc(2 * config.batch_size));
+    }
+
+    size_t offset = subscriber->cursor & (config.ring_size - 1);
+    size_t length = subscriber->range_end - subscriber->cursor;
+    size_t first = length < config.ring_size - offset ? length : config.ring_size - offset;
+    memcpy(subscriber->spill, ring + offset, first);
+    memcpy(subscriber->spill + first, ring, length - first);
+
+    /* Copy is valid only if writer has not reached it meanwhile */
+    ERROR_CHECK(pthread_mutex_lock(&batches_mutex));
+    bool corrupted = overwritten(subscriber->cursor);
+    ERROR_CHECK(pthread_mutex_unlock(&batches_mutex));
+    subscriber->spilled = !corrupted;
+    subscriber->spill_position = subscriber->cursor;
+    return !corrupted;
+}
+
+/**
+ * Chooses the next range to send to subscriber, once previous one was sent,
+ * skipping batches or disconnecting subscriber lagging more than half of the ring behind.
+ * Subscriber lagging as much in the middle of a range is disconnected, or has the rest copied aside.
+ * @param subscriber — subscriber to plan for
+ * @return @p false if subscriber should be disconnected, @p true otherwise
+ */
+static bool subscriber_plan(struct subscriber *subscriber) {
+    bool connected = true, spill = false;
+    ERROR_CHECK(pthread_mutex_lock(&batches_mutex));
+
+    if (subscriber->cursor != subscriber->range_end) {
+        /* Rest of the range has to be sent as it is */
+        if (overwritten(subscriber->cursor))
+            connected = subscriber->spilled;
+        else if (!subscriber->spilled && head - subscriber->cursor > config.ring_size / 2)
+            connected = spill = config.lag_policy == LAG_DROP;
+    } else if (head - subscriber->cursor > config.ring_size / 2) {
+        if (config.lag_policy == LAG_DISCONNECT) {
+            connected = false;
+        } else {
+            /* Resume at a quarter of the ring behind the head */
+            struct batch resumed;
+            batch_from(head - config.ring_size / 4, &resumed);
+            metrics_add(METRIC_PUBLISH_DROPPED, resumed.records - subscriber->records);
+            subscriber->cursor = subscriber->range_end = resumed.position;
+            subscriber->records = subscriber->range_records = resumed.records;
+        }
+    }
+
+    if (connected && subscriber->cursor == subscriber->range_end && subscriber->cursor != head) {
+        struct batch end;
+        batch_from(subscriber->cursor + config.batch_size, &end);
+        subscriber->range_end = end.position;
+        subscriber->range_records = end.records;
+    }
+
+    ERROR_CHECK(pthread_mutex_unlock(&batches_mutex));
+    if (spill)
+        connected = subscriber_spill(subscriber);
+    if (!connected)
+        metrics_add(METRIC_PUBLISH_DISCONNECTS, 1);
+    return connected;
+}
+
+/**
+ * Sends planned range straight from the ring, or from its copy, until it is sent or socket would block.
+ * @param subscriber — subscriber with planned range
+ * @return @p false if subscriber should be disconnected, @p true otherwise
+ */
+static bool subscriber_send(struct subscriber *subscriber) {
+    while (!subscriber->blocked && subscriber->cursor != subscriber->range_end) {
+        size_t offset = subscriber->cursor & (config.ring_size - 1);
+        size_t length = subscriber->range_end - subscriber->cursor;
+        size_t first = length < config.ring_size - offset ? length : config.ring_size - offset;
+        struct iovec parts[2] = {{.iov_base = ring + offset, .iov_len = first},
+                                 {.iov_base = ring, .iov_len = length - first}};
+        if (subscriber->spilled) {
+            parts[0].iov_base = subscriber->spill + (subscriber->cursor - subscriber->spill_position);
+            first = length;
+        }
+        struct msghdr message = {.msg_iov = parts, .msg_iovlen = length > first ? 2 : 1};
+
+        ssize_t sent = sendmsg(subscriber->sock, &message, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            subscriber->blocked = true;
+            break;
+        }
+        if (sent < 0) return false;
+
+        /* Writer may have reached sent bytes meanwhile */
+        bool corrupted = false;
+        if (!subscriber->spilled) {
+            ERROR_CHECK(pthread_mutex_lock(&batches_mutex));
+            corrupted = overwritten(subscriber->cursor);
+            ERROR_CHECK(pthread_mutex_unlock(&batches_mutex));
+        }
+        if (corrupted) {
+            metrics_add(METRIC_PUBLISH_DISCONNECTS, 1);
+            return false;
+        }
+
+        metrics_add(METRIC_PUBLISH_BYTES, sent);
+        subscriber->cursor += sent;
+        if (subscriber->cursor == subscriber->range_end) {
+            subscriber->records = subscriber->range_records;
+            subscriber->spilled = false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Sends every subscriber what it lacks, closes failed, closed and disconnected subscribers.
+ */
+static void publish_serve() {
+    for (struct subscriber **it = &subscribers; *it != NULL;) {
+        struct subscriber *subscriber = *it;
+        bool connected = !subscriber->closed;
+        while (connected && !subscriber->blocked) {
+            connected = subscriber_plan(subscriber);
+            if (!connected || subscriber->cursor == subscriber->range_end) break;
+            connected = subscriber_send(subscriber);
+        }
+        /* Blocked subscriber is still checked for lag */
+        if (connected && subscriber->blocked)
+            connected = subscriber_plan(subscriber);
+
+        if (connected) {
+            it = &subscriber->next;
+            continue;
+        }
+        *it = subscriber->next;
+        /* Closing the last descriptor removes it from epoll set */
+        ERROR_CHECK(close(subscriber->sock));
+        free(subscriber->spill);
+        pool_free(&subscriber_pool, subscriber);
+        atomic_fetch_sub(&subscribers_count, 1);
+        diagnostic("publish: Closed subscriber.\n");
+    }
+
+    ERROR_CHECK(pthread_mutex_lock(&batches_mutex));
+    uint_least64_t position = head;
+    ERROR_CHECK(pthread_mutex_unlock(&batches_mutex));
+    for (struct subscriber *it = subscribers; it != NULL; it = it->next) {
+        if (it->cursor < position)
+            position = it->cursor;
+    }
+    atomic_store(&served, position);
+}
+
+/**
+ * Accepts pending subscribers, which receive aggregates published from now on.
+ * @param epoll_fd — epoll instance of publisher thread
+ */
+static void publish_accept(int epoll_fd) {
+    for (;;) {
+        int sock = accept(listen_sock, NULL, NULL);
+        if (sock < 0 && (errno == EINTR || errno == ECONNABORTED)) continue;
+        if (sock < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        ERROR_CHECK(sock);
+
+        set_nonblocking(sock);
+        struct subscriber *subscriber;
+        NULL_CHECK(subscriber = pool_alloc(&subscriber_pool));
+        subscriber->sock = sock;
+        subscriber->blocked = subscriber->closed = subscriber->spilled = false;
+        subscriber->spill = NULL;
+        ERROR_CHECK(pthread_mutex_lock(&batches_mutex));
+        subscriber->cursor = subscriber->range_end = head;
+        subscriber->records = subscriber->range_records = published_records;
+        atomic_fetch_add(&subscribers_count, 1);
+        ERROR_CHECK(pthread_mutex_unlock(&batches_mutex));
+        subscriber->next = subscribers;
+        subscribers = subscriber;
+
+        struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = subscriber};
+        ERROR_CHECK(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event));
+        diagnostic("publish: Accepted subscriber.\n");
+    }
+}
+
+/**
+ * Discards anything subscriber sends, notices when it closes the connection.
+ * @param subscriber — readable subscriber
+ */
+static void subscriber_drain(struct subscriber *subscriber) {
+    char discarded[256];
+    for (;;) {
+        ssize_t received = recv(subscriber->sock, discarded, sizeof(discarded), 0);
+        if (received > 0 || (received < 0 && errno == EINTR)) continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        subscriber->closed = true;
+        return;
+    }
+}
+
+/**
+ * Serves subscribers, whenever a batch is published or a subscriber becomes writable.
+ * @param unused — unused
+ * @return [noreturn]
+ */
+static void *publish_thread(void *unused) {
+    (void) unused;
+    int epoll_fd;
+    ERROR_CHECK(epoll_fd = epoll_create1(0));
+    /* Listener and eventfd are told apart from subscribers by address */
+    struct epoll_event event = {.events = EPOLLIN | EPOLLET, .data.ptr = &listen_sock};
+    ERROR_CHECK(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &event));
+    event.data.ptr = &wake_fd;
+    ERROR_CHECK(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event));
+
+    struct epoll_event events[MAX_PUBLISH_EVENTS];
+    for (;;) {
+        int ready = epoll_wait(epoll_fd, events, MAX_PUBLISH_EVENTS, -1);
+        if (ready < 0 && errno == EINTR) continue;
+        ERROR_CHECK(ready);
+
+        for (int i = 0; i < ready; ++i) {
+            if (events[i].data.ptr == &listen_sock) {
+                publish_accept(epoll_fd);
+            } else if (events[i].data.ptr == &wake_fd) {
+                uint64_t count;
+                while (read(wake_fd, &count, sizeof(count)) > 0);
+            } else {
+                struct subscriber *subscriber = events[i].data.ptr;
+                if (events[i].events & EPOLLOUT)
+                    subscriber->blocked = false;
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+                    subscriber_drain(subscriber);
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                    subscriber->closed = true;
+            }
+        }
+        publish_serve();
+    }
+}
+
+/**
+ * Opens listener of subscribers and starts publisher thread.
+ * Has to be called before output thread starts publishing.
+ * @param publish_config — publishing configuration
+ */
+void init_publish(const struct publish_config *publish_config) {
+    config = *publish_config;
+    NULL_CHECK(ring = arena_map(config.ring_size));
+    listen_sock = listener_open(&config.listener, false);
+    set_nonblocking(listen_sock);
+    ERROR_CHECK(wake_fd = eventfd(0, EFD_NONBLOCK));
+    atomic_init(&subscribers_count, 0);
+    atomic_init(&served, 0);
+    pool_init(&subscriber_pool, "subscribers", sizeof(struct subscriber));
+
+    pthread_t thread;
+    NON_ZERO_CHECK(pthread_create(&thread, NULL, publish_thread, NULL));
+    NON_ZERO_CHECK(pthread_detach(thread));
+}
+
+/**
+ * Waits until every subscriber is sent every published aggregate, at most @ref PUBLISH_SHUTDOWN_MS.
+ * Has to be called after output thread stopped.
+ */
+void publish_shutdown() {
+    if (ring == NULL) return;
+    publish_wake();
+
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 1000000};
+    for (unsigned waited = 0; waited < PUBLISH_SHUTDOWN_MS; ++waited) {
+        ERROR_CHECK(pthread_mutex_lock(&batches_mutex));
+        uint_least64_t position = head;
+        ERROR_CHECK(pthread_mutex_unlock(&batches_mutex));
+        if (atomic_load(&served) >= position) return;
+        nanosleep(&pause, NULL);
+    }
+}
@@ -0,0 +1,83 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Interface for publishing of completed aggregates to subscribers.
+ * Output thread appends formatted aggregates to a single ring, which every subscriber
+ * reads at its own cursor, so slow subscribers never hold back aggregation or output.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _PUBLISH_H_
+#define _PUBLISH_H_
+
+#include "listener.h"
+
+#include <stddef.h>
+
+/**
+ * Default size of ring of published aggregates.
+ */
+#define DEFAULT_PUBLISH_RING_SIZE (4 * 1024 * 1024)
+/**
+ * Number of the most recent batches, which starts are remembered, so lagging subscriber resumes at one of them.
+ */
+#define PUBLISH_BATCHES 4096
+/**
+ * Max number of events handled by publisher thread at once.
+ */
+#define MAX_PUBLISH_EVENTS 64
+/**
+ * Max time, for which shutdown waits until subscribers receive every published aggregate.
+ */
+#define PUBLISH_SHUTDOWN_MS 1000
+
+/**
+ * Treatment of subscribers lagging more than half of the ring behind.
+ */
+enum lag_policy {
+    /** Skip aggregates, subscriber resumes at a newer batch. */
+    LAG_DROP,
+    /** Close connection. */
+    LAG_DISCONNECT
+};
+
+/**
+ * Publishing configuration.
+ */
+struct publish_config {
+    /** Stream listener of subscribers. */
+    struct listener listener;
+    /** Size of ring, power of two, at least four batches. */
+    size_t ring_size;
+    /** Max size of a single published batch, size of output buffer. */
+    size_t batch_size;
+    enum lag_policy lag_policy;
+};
+
+void init_publish(const struct publish_config *config);
+
+void publish(const char *buffer, size_t size, size_t records);
+
+void publish_shutdown();
+
+#endif /* _PUBLISH_H_ */
@@ -0,0 +1,239 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Implementation of queries of partial aggregates.
+ * A single thread serves query connections with edge-triggered epoll.
+ * Entries are copied by @ref hashtable_read, in read section of epoch,
+ * and answered like completed aggregates in messagepack format.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _GNU_SOURCE
+
+#include "query.h"
+#include "epoch.h"
+#include "hashtable.h"
+#include "metrics.h"
+#include "output.h"
+#include "pool.h"
+#include "protocol.h"
+#include "error.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Query connection, ids not answered yet and responses not sent yet.
+ */
+struct query_connection {
+    int sock;
+    /** Whether client shut its side down, connection is closed once every id is answered. */
+    bool ended;
+    size_t request_length;
+    /** Responses are sent from @p response_start up to @p response_end. */
+    size_t response_start, response_end;
+    uint8_t request[QUERY_BUFFER_SIZE];
+    char response[QUERY_BUFFER_SIZE];
+};
+
+/**
+ * Listening socket of query thread and number of payload words of entries, set by @ref init_query.
+ */
+static int listen_sock;
+static unsigned payload_words;
+/**
+ * Query connections, allocated by query thread.
+ */
+static struct pool connection_pool;
+/**
+ * Announcement of query thread, registered by @ref query_thread.
+ */
+static struct epoch_reader *reader;
+
+/**
+ * Formats current partial aggregate of every buffered id, while responses have room for it.
+ * Ids without partial aggregate are answered with an empty one.
+ * @param connection — query connection
+ * @return @p false if request is not a sequence of ints, @p true otherwise
+ */
+static bool query_answer(struct query_connection *connection) {
+    _Alignas(struct entry_t) unsigned char entry_buffer[MAX_ENTRY_SIZE];
+    _Alignas(struct output_record) unsigned char record_buffer[sizeof(struct output_record) +
+                                                               MAX_PAYLOAD_WORDS * sizeof(uint_least64_t)];
+    struct entry_t *entry = (struct entry_t *) entry_buffer;
+    struct output_record *record = (struct output_record *) record_buffer;
+    size_t position = 0;
+    unsigned answered = 0, retries = 0;
+
+    epoch_enter(reader);
+    while (connection->response_end + MAX_RECORD_LENGTH <= QUERY_BUFFER_SIZE) {
+        size_t length = decode_msgpack_int(connection->request + position,
+                                           connection->request_length - position, &record->id);
+        if (length == 0) break;
+        position += length;
+
+        if (hashtable_read(hashtable_shard(record->id), record->id, entry, &retries)) {
+            record->count = entry->count;
+            memcpy(record->payload, entry->payload, payload_words * sizeof(uint_least64_t));
+        } else {
+            record->count = 0;
+            memset(record->payload, 0, payload_words * sizeof(uint_least64_t));
+        }
+        connection->response_end += format_msgpack_record(connection->response + connection->response_end, record);
+        ++answered;
+    }
+    epoch_exit(reader);
+    metrics_add(METRIC_QUERIES, answered);
+    metrics_add(METRIC_QUERY_RETRIES, retries);
+
+    /* Longest int is complete, unless it is not an int at all */
+    if (connection->request_length - position >= MSGPACK_MAX_UINT_LENGTH &&
+        connection->response_end + MAX_RECORD_LENGTH <= QUERY_BUFFER_SIZE)
+        return false;
+    memmove(connection->request, connection->request + position, connection->request_length - position);
+    connection->request_length -= position;
+    return true;
+}
+
+/**
+ * Sends buffered responses, until socket would block.
+ * @param connection — query connection
+ * @return @p false on failure, @p true otherwise
+ */
+static bool query_send(struct query_connection *connection) {
+    while (connection->response_start < connection->response_end) {
+        ssize_t sent = send(connection->sock, connection->response + connection->response_start,
+                            connection->response_end - connection->response_start, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (sent < 0) return false;
+        connection->response_start += sent;
+    }
+    connection->response_start = connection->response_end = 0;
+    return true;
+}
+
+/**
+ * Answers requests until socket would block, as required by edge-triggered epoll.
+ * Request is read only once previous responses are sent, so slow client can't make server buffer unboundedly.
+ * @param connection — query connection
+ * @return @p false if connection should be closed, @p true otherwise
+ */
+static bool query_serve(struct query_connection *connection) {
+    for (;;) {
+        if (!query_answer(connection) || !query_send(connection))
+            return false;
+        if (connection->response_end > 0)
+            return true;
+        if (connection->ended)
+            return false;
+
+        ssize_t received = recv(connection->sock, connection->request + connection->request_length,
+                                QUERY_BUFFER_SIZE - connection->request_length, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (received < 0) return false;
+        if (received == 0)
+            connection->ended = true;
+        connection->request_length += received;
+    }
+}
+
+/**
+ * Accepts pending query connections and registers them in epoll instance.
+ * @param epoll_fd — epoll instance of query thread
+ */
+static void query_accept(int epoll_fd) {
+    for (;;) {
+        int sock = accept(listen_sock, NULL, NULL);
+        if (sock < 0 && (errno == EINTR || errno == ECONNABORTED)) continue;
+        if (sock < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        ERROR_CHECK(sock);
+
+        set_nonblocking(sock);
+        struct query_connection *connection;
+        NULL_CHECK(connection = pool_alloc(&connection_pool));
+        connection->sock = sock;
+        connection->ended = false;
+        connection->request_length = connection->response_start = connection->response_end = 0;
+
+        struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = connection};
+        ERROR_CHECK(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event));
+        diagnostic("query: Accepted connection.\n");
+    }
+}
+
+/**
+ * Serves query connections.
+ * @param unused — unused
+ * @return [noreturn]
+ */
+static void *query_thread(void *unused) {
+    (void) unused;
+    reader = epoch_register();
+
+    int epoll_fd;
+    ERROR_CHECK(epoll_fd = epoll_create1(0));
+    struct epoll_event event = {.events = EPOLLIN | EPOLLET, .data.ptr = NULL};
+    ERROR_CHECK(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &event));
+
+    struct epoll_event events[MAX_QUERY_EVENTS];
+    for (;;) {
+        int ready = epoll_wait(epoll_fd, events, MAX_QUERY_EVENTS, -1);
+        if (ready < 0 && errno == EINTR) continue;
+        ERROR_CHECK(ready);
+
+        for (int i = 0; i < ready; ++i) {
+            struct query_connection *connection = events[i].data.ptr;
+            if (connection == NULL) {
+                query_accept(epoll_fd);
+            } else if (!query_serve(connection)) {
+                /* Closing the last descriptor removes it from epoll set */
+                ERROR_CHECK(close(connection->sock));
+                pool_free(&connection_pool, connection);
+                diagnostic("query: Closed connection.\n");
+            }
+        }
+    }
+}
+
+/**
+ * Starts query thread listening on @p listener.
+ * Has to be called after hashtable is initialized and restored, partial aggregates are read without locks since.
+ * @param listener — stream listener of query connections
+ * @param aggregation — aggregation policy, layout of entries
+ */
+void init_query(const struct listener *listener, const struct aggregation_config *aggregation) {
+    listen_sock = listener_open(listener, false);
+    set_nonblocking(listen_sock);
+    payload_words = aggregation_payload_words(aggregation);
+    pool_init(&connection_pool, "query connections", sizeof(struct query_connection));
+
+    pthread_t thread;
+    NON_ZERO_CHECK(pthread_create(&thread, NULL, query_thread, NULL));
+    NON_ZERO_CHECK(pthread_detach(thread));
+}
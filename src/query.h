@@ -0,0 +1,47 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Interface for queries of partial aggregates.
+ * Clients send messagepack ints, each an id, and receive current partial aggregate of every id,
+ * read without locks, so queries never stall aggregation.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _QUERY_H_
+#define _QUERY_H_
+
+#include "aggregator.h"
+#include "listener.h"
+
+/**
+ * Size of request and response buffers of a query connection.
+ */
+#define QUERY_BUFFER_SIZE (64 * 1024)
+/**
+ * Max number of events handled by query thread at once.
+ */
+#define MAX_QUERY_EVENTS 64
+
+void init_query(const struct listener *listener, const struct aggregation_config *aggregation);
+
+#endif /* _QUERY_H_ */
@@ -0,0 +1,131 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Implementation of offline replay of capture files.
+ * Every file is a separate input, as if sent over its own connection, taken by the next free worker.
+ * With a single worker files are replayed in order, and output is deterministic.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _GNU_SOURCE
+
+#include "replay.h"
+#include "input.h"
+#include "metrics.h"
+#include "stats.h"
+#include "error.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Capture files, and index of the next one not taken by a worker.
+ */
+static char *const *replay_paths;
+static unsigned replay_count;
+static _Atomic unsigned next_path;
+
+/**
+ * Maps capture file and feeds it to a new input, which owns its descriptor.
+ * @param path — capture file
+ */
+static void replay_file(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) < 0) {
+        fprintf(stderr, "replay: Can't open %s: %s.\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    struct input *in = input_open_provided(fd);
+    size_t size = (size_t) status.st_size;
+    if (size > 0) {
+        const uint8_t *data;
+        if ((data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+            ERROR("mmap");
+        }
+        madvise((void *) data, size, MADV_SEQUENTIAL);
+        if (input_deliver(in, data, size) == INPUT_CLOSED)
+            fprintf(stderr, "replay: %s contains invalid message, the rest of it is skipped.\n", path);
+        ERROR_CHECK(munmap((void *) data, size));
+    }
+    input_close(in);
+}
+
+/**
+ * Replays files until every one is taken.
+ * @param unused — unused
+ * @return @p NULL
+ */
+static void *replay_worker(void *unused) {
+    (void) unused;
+    for (unsigned i; (i = atomic_fetch_add(&next_path, 1)) < replay_count;)
+        replay_file(replay_paths[i]);
+    return NULL;
+}
+
+/**
+ * Replays capture files, prints their size and replay rate to stderr, then shuts down
+ * as on @p SIGTERM – takes the final snapshot and writes pending output.
+ * @param paths — capture files
+ * @param count — number of @p paths
+ * @param workers — number of files replayed in parallel
+ * @return [noreturn]
+ */
+void run_replay(char *const *paths, unsigned count, unsigned workers) {
+    replay_paths = paths;
+    replay_count = count;
+    atomic_init(&next_path, 0);
+    if (workers > count)
+        workers = count;
+
+    struct timespec start, end;
+    ERROR_CHECK(clock_gettime(CLOCK_MONOTONIC, &start));
+    pthread_t *threads;
+    NULL_CHECK(threads = calloc(workers, sizeof(pthread_t)));
+    for (unsigned i = 0; i < workers; ++i) {
+        NON_ZERO_CHECK(pthread_create(&threads[i], NULL, replay_worker, NULL));
+    }
+    for (unsigned i = 0; i < workers; ++i) {
+        NON_ZERO_CHECK(pthread_join(threads[i], NULL));
+    }
+    ERROR_CHECK(clock_gettime(CLOCK_MONOTONIC, &end));
+    free(threads);
+
+    uint_least64_t counters[NO_METRICS];
+    metrics_read(counters);
+    double seconds = (double) (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "replay: %u files, %llu messages, %llu bytes in %.3f s, %.0f messages/s.\n", count,
+            (unsigned long long) counters[METRIC_MESSAGES], (unsigned long long) counters[METRIC_BYTES], seconds,
+            seconds > 0 ? counters[METRIC_MESSAGES] / seconds : 0.0);
+
+    graceful_shutdown();
+}
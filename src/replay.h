@@ -0,0 +1,35 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Interface for offline replay of capture files – raw messagepack streams, as received by the server.
+ * Files are mapped and decoded by the same input path as connections, at full speed,
+ * so replay reproduces online output, and measures parsing and aggregation without network.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+void run_replay(char *const *paths, unsigned count, unsigned workers);
+
+#endif /* _REPLAY_H_ */
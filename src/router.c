@@ -0,0 +1,255 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Implementation of message routing between cores.
+ * Shard @p i is owned by core @p i modulo number of cores, so every core owns
+ * the same number of shards, if there are at least as many shards as cores.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "router.h"
+#include "aggregator.h"
+#include "metrics.h"
+#include "latency.h"
+#include "error.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/**
+ * Every core, set by @ref init_router.
+ */
+static struct core *cores;
+static unsigned core_count;
+/**
+ * Index of core owning every shard.
+ */
+static unsigned *shard_owners;
+/**
+ * Core of the calling thread, set by @ref router_attach.
+ */
+static _Thread_local struct core *local_core;
+
+/**
+ * Creates cores, their rings and assigns shards to them.
+ * Has to be called before @ref init_aggregator, which may wake cores at any time.
+ * @param count — number of cores
+ * @param shards — number of hashtable shards, at least @p count
+ */
+void init_router(unsigned count, unsigned shards) {
+    core_count = count;
+    NON_ZERO_CHECK(posix_memalign((void **) &cores, CACHE_LINE_SIZE, count * sizeof(struct core)));
+    NULL_CHECK(shard_owners = calloc(shards, sizeof(unsigned)));
+
+    for (unsigned i = 0; i < count; ++i) {
+        struct core *core = &cores[i];
+        core->index = i;
+        ERROR_CHECK(core->wake_fd = eventfd(0, EFD_NONBLOCK));
+        atomic_init(&core->sleeping, false);
+
+        NULL_CHECK(core->inbox = calloc(count, sizeof(struct ring *)));
+        for (unsigned from = 0; from < count; ++from) {
+            if (from == i) continue;
+            struct ring *ring;
+            NON_ZERO_CHECK(posix_memalign((void **) &ring, CACHE_LINE_SIZE, sizeof(struct ring)));
+            atomic_init(&ring->head, 0);
+            atomic_init(&ring->tail, 0);
+            ring->cached_head = ring->cached_tail = 0;
+            core->inbox[from] = ring;
+        }
+        NULL_CHECK(core->outbox = calloc(count, sizeof(struct route_batch)));
+        NULL_CHECK(core->shards = calloc(shards / count + 1, sizeof(unsigned)));
+        core->shard_count = 0;
+        core->sealed = false;
+    }
+
+    for (unsigned shard = 0; shard < shards; ++shard) {
+        struct core *owner = &cores[shard % count];
+        shard_owners[shard] = owner->index;
+        owner->shards[owner->shard_count++] = shard;
+    }
+}
+
+/**
+ * Binds calling thread to a core.
+ * @param index — index of core, less than number of cores
+ * @return eventfd, which becomes readable when core is woken
+ */
+int router_attach(unsigned index) {
+    local_core = &cores[index];
+    return local_core->wake_fd;
+}
+
+/**
+ * Wakes a core from @p epoll_wait.
+ * @param core — core to wake
+ */
+static void router_wake(struct core *core) {
+    uint64_t one = 1;
+    ERROR_CHECK(write(core->wake_fd, &one, sizeof(one)));
+}
+
+/**
+ * Forwards pending batch to its core, waiting while the ring is full.
+ * Target may itself wait for a full ring to this core, so inbox is drained meanwhile.
+ * @param to — index of target core
+ */
+static void router_forward(unsigned to) {
+    struct route_batch *batch = &local_core->outbox[to];
+    struct core *target = &cores[to];
+    struct ring *ring = target->inbox[local_core->index];
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    while (tail + batch->count - ring->cached_head > RING_SIZE) {
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail + batch->count - ring->cached_head <= RING_SIZE) break;
+        metrics_add(METRIC_RING_FULL, 1);
+        if (!router_drain())
+            sched_yield();
+    }
+    for (size_t i = 0; i < batch->count; ++i)
+        ring->messages[(tail + i) & (RING_SIZE - 1)] = batch->messages[i];
+    if (latency_enabled) {
+        for (size_t i = 0; i < batch->count; ++i)
+            ring->received[(tail + i) & (RING_SIZE - 1)] = batch->received[i];
+    }
+    atomic_store_explicit(&ring->tail, tail + batch->count, memory_order_release);
+    metrics_add(METRIC_FORWARDED, batch->count);
+    batch->count = 0;
+
+    /* Pairs with @ref router_sleep – either target sees the batch, or we see it sleeping */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&target->sleeping, memory_order_relaxed) &&
+        atomic_exchange_explicit(&target->sleeping, false, memory_order_relaxed))
+        router_wake(target);
+}
+
+/**
+ * Aggregates messages of own shards, queues other ones for their cores.
+ * Consumer of connection inputs of core threads.
+ * @param messages — decoded messages
+ * @param count — number of @p messages
+ */
+void router_route(const struct message *messages, size_t count) {
+    struct core *core = local_core;
+    for (size_t i = 0; i < count; ++i) {
+        unsigned owner = shard_owners[hashtable_shard_index(messages[i].id)];
+        if (owner == core->index) {
+            if (!core->sealed)
+                aggregate(&messages[i]);
+            continue;
+        }
+        struct route_batch *batch = &core->outbox[owner];
+        batch->received[batch->count] = latency_received;
+        batch->messages[batch->count++] = messages[i];
+        if (batch->count == ROUTE_BATCH)
+            router_forward(owner);
+    }
+}
+
+/**
+ * Forwards every pending batch, even if not full.
+ */
+void router_flush() {
+    for (unsigned to = 0; to < core_count; ++to) {
+        if (local_core->outbox[to].count > 0)
+            router_forward(to);
+    }
+}
+
+/**
+ * Aggregates every message forwarded to calling core, in place, timed from their receipt by forwarding core.
+ * @return @p true if any message was aggregated
+ */
+bool router_drain() {
+    bool drained = false;
+    uint_least64_t received = latency_received;
+    for (unsigned from = 0; from < core_count; ++from) {
+        struct ring *ring = local_core->inbox[from];
+        if (ring == NULL) continue;
+
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        if (head == ring->cached_tail) {
+            ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+            if (head == ring->cached_tail) continue;
+        }
+        /* Sealed core keeps draining, so cores forwarding to it never wait */
+        for (; head != ring->cached_tail && !local_core->sealed; ++head) {
+            if (latency_enabled)
+                latency_received = ring->received[head & (RING_SIZE - 1)];
+            aggregate(&ring->messages[head & (RING_SIZE - 1)]);
+        }
+        head = ring->cached_tail;
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+        drained = true;
+    }
+    latency_received = received;
+    return drained;
+}
+
+/**
+ * Announces that calling core is about to sleep, unless anything was forwarded to it meanwhile.
+ * @return @p true if core may sleep until woken, @p false if inbox is not empty
+ */
+bool router_sleep() {
+    atomic_store(&local_core->sleeping, true);
+    for (unsigned from = 0; from < core_count; ++from) {
+        struct ring *ring = local_core->inbox[from];
+        if (ring != NULL && atomic_load(&ring->tail) != atomic_load_explicit(&ring->head, memory_order_relaxed)) {
+            atomic_store_explicit(&local_core->sleeping, false, memory_order_relaxed);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Announces that calling core stopped sleeping, so it needs no wakeups.
+ */
+void router_awake() {
+    atomic_store_explicit(&local_core->sleeping, false, memory_order_relaxed);
+}
+
+/**
+ * Maintains every shard owned by calling core, see @ref aggregator_maintain.
+ * Once the final snapshot copied them, core is sealed and its shards no longer change.
+ */
+void router_maintain() {
+    if (local_core->sealed) return;
+    for (unsigned i = 0; i < local_core->shard_count; ++i) {
+        if (!aggregator_maintain(local_core->shards[i]))
+            local_core->sealed = true;
+    }
+}
+
+/**
+ * Wakes every core, so it maintains its shards, called by housekeeping thread.
+ */
+void router_wake_all() {
+    for (unsigned i = 0; i < core_count; ++i)
+        router_wake(&cores[i]);
+}
@@ -0,0 +1,112 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Interface of message routing between cores, which own disjoint sets of hashtable shards.
+ * Every core aggregates messages of its own shards without locks, and forwards other ones
+ * in batches over single-producer single-consumer rings, one for every pair of cores.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _ROUTER_H_
+#define _ROUTER_H_
+
+#include "protocol.h"
+#include "hashtable.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Number of messages forwarded to another core at once.
+ */
+#define ROUTE_BATCH 64
+/**
+ * Capacity of a ring between two cores in messages, power of two.
+ */
+#define RING_SIZE 1024
+
+/**
+ * Single-producer single-consumer ring of messages.
+ * Indexes are free-running, each side caches the other one's index on its own cache line.
+ */
+struct ring {
+    /** Next message to consume, and producer index last seen by consumer. */
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t head;
+    size_t cached_tail;
+    /** Next free slot, and consumer index last seen by producer. */
+    _Alignas(CACHE_LINE_SIZE) _Atomic size_t tail;
+    size_t cached_head;
+    _Alignas(CACHE_LINE_SIZE) struct message messages[RING_SIZE];
+    /** Times, at which messages were received, copied only if latencies are measured. */
+    uint_least64_t received[RING_SIZE];
+};
+
+/**
+ * Messages waiting to be forwarded to another core.
+ */
+struct route_batch {
+    size_t count;
+    struct message messages[ROUTE_BATCH];
+    uint_least64_t received[ROUTE_BATCH];
+};
+
+/**
+ * State of a core, used only by its thread, except for @p sleeping and rings.
+ */
+struct core {
+    unsigned index;
+    /** Eventfd waking the core, when it sleeps. */
+    int wake_fd;
+    /** Whether core is about to sleep, and has to be woken after forwarding to it. */
+    _Atomic bool sleeping;
+    /** Rings from every core to this one, @p NULL for itself. */
+    struct ring **inbox;
+    /** Messages waiting to be forwarded to every core. */
+    struct route_batch *outbox;
+    /** Indexes of shards owned by the core. */
+    unsigned *shards;
+    unsigned shard_count;
+    /** Whether shards of the core were copied by the final snapshot, so messages for them are dropped. */
+    bool sealed;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+void init_router(unsigned cores, unsigned shards);
+
+int router_attach(unsigned index);
+
+void router_route(const struct message *messages, size_t count);
+
+void router_flush();
+
+bool router_drain();
+
+bool router_sleep();
+
+void router_awake();
+
+void router_maintain();
+
+void router_wake_all();
+
+#endif /* _ROUTER_H_ */
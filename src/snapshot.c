@@ -0,0 +1,533 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Implementation of snapshots of partial aggregates.
+ * Shards are copied one at a time – locked shards by the thread taking snapshot, under their lock,
+ * owned shards by their owners, on request. Copies are written to a temporary file, renamed over
+ * the previous snapshot once complete, so a snapshot is never seen half written.
+ * With write-ahead log, every shard records position in the log, up to which its copy holds messages,
+ * and log before the lowest of them is removed once the snapshot is durable.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _GNU_SOURCE
+
+#include "snapshot.h"
+#include "hashtable.h"
+#include "output.h"
+#include "wal.h"
+#include "error.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * First bytes of snapshot file, with version of its format.
+ */
+#define SNAPSHOT_MAGIC "AGGRSNP2"
+/**
+ * Max logarithm of number of slots of a table read from snapshot.
+ */
+#define MAX_SNAPSHOT_CAPACITY_LOG 40
+
+/**
+ * Header of snapshot file, followed by @ref snapshot_table of every shard.
+ */
+struct snapshot_header {
+    char magic[8];
+    uint32_t shards;
+    /** Layout of entries, which has to match the configured one. */
+    uint32_t entry_size;
+    uint32_t fields;
+    /** Coarse clock, birth ticks of entries are relative to it, and length of its tick, zero if unused. */
+    uint32_t tick;
+    uint32_t tick_ms;
+    /** Wall clock time of snapshot, in milliseconds since epoch. */
+    uint64_t time_ms;
+    uint64_t entries;
+};
+
+/**
+ * Slot array of a shard in snapshot file.
+ */
+struct snapshot_table {
+    /** Position of slot array in file, multiple of @ref SNAPSHOT_ALIGNMENT. */
+    uint64_t offset;
+    uint64_t size;
+    uint64_t clock_hand;
+    uint32_t capacity_log;
+    uint32_t reserved;
+    /** Position in write-ahead log, every logged message before it is in the table, none after it. */
+    uint64_t wal_position;
+};
+
+/**
+ * Copy of a shard, waiting to be written.
+ */
+struct capture {
+    struct hashtable_image image;
+    unsigned char *data;
+    size_t capacity, bytes;
+    /** Snapshot request, which the copy answers. */
+    uint32_t epoch;
+};
+
+/**
+ * Path of snapshot file and of its next version, @p NULL if snapshots are disabled.
+ */
+static const char *snapshot_path = NULL;
+static char *temporary_path;
+/**
+ * Directory of snapshot file, synced after rename.
+ */
+static int directory_fd;
+/**
+ * Interval between periodic snapshots, zero if only the final one is taken.
+ */
+static unsigned snapshot_interval_ms;
+/**
+ * Layout of entries.
+ */
+static unsigned snapshot_fields;
+/**
+ * Requests copies of owned shards from their owners, @p NULL if shards are locked.
+ */
+static void (*snapshot_wake)();
+/**
+ * Serializes snapshots, so periodic one never overlaps the final one.
+ */
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * Copies of owned shards, one per shard, or @p NULL if shards are locked.
+ */
+static struct capture *captures = NULL;
+/**
+ * Copy of locked shard, reused for every shard.
+ */
+static struct capture staging;
+/**
+ * Tables of snapshot being written.
+ */
+static struct snapshot_table *tables;
+/**
+ * Log positions of shards of restored snapshot, @p NULL if none was restored.
+ */
+static uint_least64_t *restored_positions = NULL;
+static unsigned restored_shards = 0;
+/**
+ * Number of requests for copies of owned shards, whether the last one is final,
+ * and number of shards not copied yet.
+ */
+static _Atomic uint32_t capture_epoch;
+static _Atomic bool capture_final;
+static _Atomic unsigned captures_left;
+
+/**
+ * Returns current wall clock time.
+ * @return milliseconds since epoch
+ */
+static uint_least64_t realtime_ms() {
+    struct timespec now;
+    ERROR_CHECK(clock_gettime(CLOCK_REALTIME, &now));
+    return (uint_least64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Rounds position in snapshot file up to @ref SNAPSHOT_ALIGNMENT.
+ * @param offset — position in file
+ * @return aligned position
+ */
+static uint_least64_t snapshot_align(uint_least64_t offset) {
+    return (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+}
+
+/**
+ * Writes whole buffer at given position of file.
+ * @param fd — file to write to
+ * @param data — buffer to write
+ * @param size — size of @p data
+ * @param offset — position in file
+ * @return @p false on failure, @p true otherwise
+ */
+static bool write_at(int fd, const void *data, size_t size, off_t offset) {
+    for (const char *it = data; size > 0;) {
+        ssize_t written = pwrite(fd, it, size, offset);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0) return false;
+        it += written;
+        size -= (size_t) written;
+        offset += written;
+    }
+    return true;
+}
+
+/**
+ * Copies owned shard, if snapshot requested it since the last call.
+ * @param index — index of shard owned by the caller
+ * @return @p false if the shard was copied by the final snapshot and must no longer change, @p true otherwise
+ */
+bool snapshot_maintain(unsigned index) {
+    if (captures == NULL) return true;
+
+    struct capture *capture = &captures[index];
+    uint32_t epoch = atomic_load_explicit(&capture_epoch, memory_order_acquire);
+    if (capture->epoch == epoch) return true;
+
+    capture->epoch = epoch;
+    struct hashtable_shard *shard = hashtable_shard_at(index);
+    hashtable_write_begin(shard);
+    capture->bytes = hashtable_save(shard, &capture->image, &capture->data, &capture->capacity);
+    hashtable_write_end(shard);
+    bool final = atomic_load_explicit(&capture_final, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&captures_left, 1, memory_order_release);
+    return !final;
+}
+
+/**
+ * Requests copies of every owned shard, waits until owners make them.
+ * @param final — whether owners stop changing their shards once copied
+ */
+static void request_captures(bool final) {
+    atomic_store_explicit(&captures_left, hashtable_shard_count(), memory_order_relaxed);
+    atomic_store_explicit(&capture_final, final, memory_order_relaxed);
+    atomic_fetch_add_explicit(&capture_epoch, 1, memory_order_release);
+    snapshot_wake();
+
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 1000000};
+    while (atomic_load_explicit(&captures_left, memory_order_acquire) > 0)
+        nanosleep(&pause, NULL);
+}
+
+/**
+ * Copies every shard and replaces snapshot file, reports failure without terminating.
+ * Locked shard waits only while its slot array is copied, unless snapshot is final.
+ * @param final — whether shards stay unchanged after their copy, until exit
+ */
+static void snapshot_write(bool final) {
+    int fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "snapshot: Can't create %s: %s.\n", temporary_path, strerror(errno));
+        return;
+    }
+
+    unsigned shards = hashtable_shard_count();
+    struct snapshot_header header = {
+            .magic = SNAPSHOT_MAGIC,
+            .shards = shards,
+            .entry_size = (uint32_t) hashtable_entry_size(),
+            .fields = snapshot_fields,
+            .entries = 0
+    };
+    header.tick_ms = aggregator_clock(&header.tick);
+    header.time_ms = realtime_ms();
+    if (captures != NULL)
+        request_captures(final);
+    /* Final snapshot stops the log once, as shards it copied stay locked */
+    uint_least64_t final_position = final ? wal_pause() : 0;
+
+    /* Slot arrays follow the header, each aligned, so it can be mapped on its own */
+    uint_least64_t offset = snapshot_align(sizeof(header) + shards * sizeof(struct snapshot_table));
+    bool written = true;
+    for (unsigned i = 0; i < shards && written; ++i) {
+        struct capture *capture = captures != NULL ? &captures[i] : &staging;
+        uint_least64_t position = final_position;
+        if (captures == NULL) {
+            /* Log stops while shard is copied, so the copy holds exactly messages logged before position */
+            if (!final)
+                position = wal_pause();
+            struct hashtable_shard *shard = hashtable_shard_at(i);
+            ERROR_CHECK(pthread_mutex_lock(&shard->mutex));
+            hashtable_write_begin(shard);
+            capture->bytes = hashtable_save(shard, &capture->image, &capture->data, &capture->capacity);
+            hashtable_write_end(shard);
+            /* Final snapshot keeps shards locked until exit, so nothing completes after its copy */
+            if (!final) {
+                ERROR_CHECK(pthread_mutex_unlock(&shard->mutex));
+                wal_resume();
+            }
+        }
+
+        tables[i] = (struct snapshot_table) {
+                .offset = offset,
+                .size = capture->image.size,
+                .clock_hand = capture->image.clock_hand,
+                .capacity_log = capture->image.capacity_log,
+                .wal_position = position
+        };
+        header.entries += capture->image.size;
+        written = write_at(fd, capture->data, capture->bytes, (off_t) offset);
+        offset = snapshot_align(offset + capture->bytes);
+    }
+    /* Aggregates completed before the copies are in none of them, so positions hold only once they are written */
+    output_sync();
+    written = written && write_at(fd, &header, sizeof(header), 0) &&
+              write_at(fd, tables, shards * sizeof(struct snapshot_table), sizeof(header)) &&
+              fdatasync(fd) == 0;
+    ERROR_CHECK(close(fd));
+
+    if (!written || rename(temporary_path, snapshot_path) < 0 || fsync(directory_fd) < 0) {
+        fprintf(stderr, "snapshot: Can't write %s: %s.\n", snapshot_path, strerror(errno));
+        unlink(temporary_path);
+        return;
+    }
+    diagnostic("snapshot: Saved %" PRIu64 " entries.\n", header.entries);
+
+    /* Log before the lowest position is no longer needed, once rename of snapshot is durable */
+    uint_least64_t covered = tables[0].wal_position;
+    for (unsigned i = 1; i < shards; ++i) {
+        if (tables[i].wal_position < covered)
+            covered = tables[i].wal_position;
+    }
+    wal_truncate(covered);
+}
+
+/**
+ * Checks whether snapshot file describes valid tables of entries of configured layout.
+ * @param file — mapped snapshot file
+ * @param size — size of @p file
+ * @return @p true if tables can be read from the file
+ */
+static bool snapshot_valid(const unsigned char *file, size_t size) {
+    const struct snapshot_header *header = (const struct snapshot_header *) file;
+    if (size < sizeof(*header) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->entry_size != hashtable_entry_size() || header->fields != snapshot_fields || header->shards == 0 ||
+        (size - sizeof(*header)) / sizeof(struct snapshot_table) < header->shards)
+        return false;
+
+    const struct snapshot_table *table = (const struct snapshot_table *) (file + sizeof(*header));
+    for (unsigned i = 0; i < header->shards; ++i, ++table) {
+        if (table->capacity_log > MAX_SNAPSHOT_CAPACITY_LOG || table->size >= (uint64_t) 1 << table->capacity_log ||
+            table->offset % SNAPSHOT_ALIGNMENT != 0 || table->offset > size ||
+            (size - table->offset) >> table->capacity_log < header->entry_size)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Counts entries of a table from snapshot file, which belong to every shard.
+ * @param table — slot array in snapshot file
+ * @param capacity_log — logarithm of number of slots of @p table
+ * @param counts[in,out] — number of entries of every shard
+ */
+static void snapshot_count(const unsigned char *table, unsigned capacity_log, size_t *counts) {
+    size_t entry_size = hashtable_entry_size();
+    for (size_t i = 0; i < ((size_t) 1 << capacity_log); ++i) {
+        const struct entry_t *it = (const struct entry_t *) (table + i * entry_size);
+        if (it->distance != 0)
+            ++counts[hashtable_shard_index(it->id)];
+    }
+}
+
+/**
+ * Adds every entry of a table from snapshot file to hashtable, used if table can't be adopted as it is.
+ * @param table — slot array in snapshot file
+ * @param capacity_log — logarithm of number of slots of @p table
+ */
+static void snapshot_insert(const unsigned char *table, unsigned capacity_log) {
+    size_t entry_size = hashtable_entry_size(), mask = ((size_t) 1 << capacity_log) - 1;
+    for (size_t i = 0; i <= mask; ++i) {
+        /* Slots are visited in scattered order, as entries in slot order are sorted by hash,
+         * and would crowd the first slots of a smaller table */
+        const struct entry_t *it = (const struct entry_t *) (table + ((i * CLOCK_STRIDE) & mask) * entry_size);
+        if (it->distance == 0) continue;
+
+        struct hashtable_shard *shard = hashtable_shard(it->id);
+        ERROR_CHECK(pthread_mutex_lock(&shard->mutex));
+        struct entry_t *entry;
+        NULL_CHECK(entry = hashtable_get(shard, it->id));
+        entry->count = it->count;
+        entry->birth = it->birth;
+        memcpy(entry->payload, it->payload, entry_size - sizeof(struct entry_t));
+        ERROR_CHECK(pthread_mutex_unlock(&shard->mutex));
+    }
+}
+
+/**
+ * Restores partial aggregates from snapshot file, if it exists and matches configured layout.
+ * With the same number of shards, slot arrays are mapped from the file and copied on write,
+ * otherwise entries are inserted one by one.
+ * Runs before queries are served, so shards are modified without advancing their sequences.
+ */
+static void snapshot_load() {
+    int fd = open(snapshot_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            fprintf(stderr, "snapshot: Can't open %s: %s.\n", snapshot_path, strerror(errno));
+        return;
+    }
+    struct stat status;
+    ERROR_CHECK(fstat(fd, &status));
+    size_t size = (size_t) status.st_size;
+    const unsigned char *file = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (file == MAP_FAILED || !snapshot_valid(file, size)) {
+        fprintf(stderr, "snapshot: %s is corrupted or has different aggregation policy, ignoring it.\n",
+                snapshot_path);
+        if (file != MAP_FAILED)
+            munmap((void *) file, size);
+        ERROR_CHECK(close(fd));
+        return;
+    }
+
+    const struct snapshot_header *header = (const struct snapshot_header *) file;
+    const struct snapshot_table *tables = (const struct snapshot_table *) (file + sizeof(*header));
+    bool same_layout = header->shards == hashtable_shard_count() &&
+                       SNAPSHOT_ALIGNMENT % sysconf(_SC_PAGESIZE) == 0;
+    bool *adopted;
+    NULL_CHECK(adopted = calloc(header->shards, sizeof(bool)));
+    for (unsigned i = 0; i < header->shards && same_layout; ++i) {
+        struct hashtable_image image = {
+                .capacity_log = tables[i].capacity_log,
+                .size = tables[i].size,
+                .clock_hand = tables[i].clock_hand
+        };
+        struct hashtable_shard *shard = hashtable_shard_at(i);
+        ERROR_CHECK(pthread_mutex_lock(&shard->mutex));
+        adopted[i] = hashtable_adopt(shard, &image, fd, (off_t) tables[i].offset);
+        ERROR_CHECK(pthread_mutex_unlock(&shard->mutex));
+    }
+
+    /* Tables, which can't be adopted, are inserted entry by entry, into shards grown in advance */
+    size_t *counts;
+    NULL_CHECK(counts = calloc(hashtable_shard_count(), sizeof(size_t)));
+    for (unsigned i = 0; i < header->shards; ++i) {
+        if (!adopted[i])
+            snapshot_count(file + tables[i].offset, tables[i].capacity_log, counts);
+    }
+    for (unsigned i = 0; i < hashtable_shard_count(); ++i) {
+        struct hashtable_shard *shard = hashtable_shard_at(i);
+        ERROR_CHECK(pthread_mutex_lock(&shard->mutex));
+        if (counts[i] > 0 && !hashtable_reserve(shard, counts[i]))
+            diagnostic("snapshot: Shard %u not reserved.\n", i);
+        ERROR_CHECK(pthread_mutex_unlock(&shard->mutex));
+    }
+    for (unsigned i = 0; i < header->shards; ++i) {
+        if (!adopted[i])
+            snapshot_insert(file + tables[i].offset, tables[i].capacity_log);
+    }
+    free(counts);
+    free(adopted);
+
+    NULL_CHECK(restored_positions = calloc(header->shards, sizeof(uint_least64_t)));
+    restored_shards = header->shards;
+    for (unsigned i = 0; i < header->shards; ++i)
+        restored_positions[i] = tables[i].wal_position;
+
+    /* Entries keep aging while server is down */
+    uint_least64_t now = realtime_ms();
+    uint_least64_t downtime_ms = now > header->time_ms ? now - header->time_ms : 0;
+    for (unsigned i = 0; i < hashtable_shard_count(); ++i) {
+        struct hashtable_shard *shard = hashtable_shard_at(i);
+        ERROR_CHECK(pthread_mutex_lock(&shard->mutex));
+        aggregator_restore(shard, header->tick, header->tick_ms, downtime_ms);
+        ERROR_CHECK(pthread_mutex_unlock(&shard->mutex));
+    }
+    diagnostic("snapshot: Restored %" PRIu64 " entries.\n", header->entries);
+
+    munmap((void *) file, size);
+    ERROR_CHECK(close(fd));
+}
+
+/**
+ * Takes periodic snapshots.
+ * @param unused — unused
+ * @return never returns
+ */
+static void *snapshot_thread(void *unused) {
+    (void) unused;
+    for (;;) {
+        struct timespec interval = {
+                .tv_sec = snapshot_interval_ms / 1000,
+                .tv_nsec = (long) (snapshot_interval_ms % 1000) * 1000000
+        };
+        while (nanosleep(&interval, &interval) < 0) {
+            if (errno != EINTR) {
+                ERROR("nanosleep");
+            }
+        }
+
+        ERROR_CHECK(pthread_mutex_lock(&snapshot_mutex));
+        snapshot_write(false);
+        ERROR_CHECK(pthread_mutex_unlock(&snapshot_mutex));
+    }
+    return NULL;
+}
+
+/**
+ * Restores partial aggregates from snapshot file, replays write-ahead log after it, starts taking periodic snapshots.
+ * Has to be called after @ref init_aggregator and @ref init_wal, if log is enabled, before any message is aggregated.
+ * @param path — snapshot file
+ * @param interval_ms — time between snapshots, zero if only the final one is taken
+ * @param aggregation — aggregation policy, which determines layout of entries
+ * @param wake — requests maintenance of owned shards, see @ref init_aggregator, @p NULL if shards are locked
+ */
+void init_snapshots(const char *path, unsigned interval_ms, const struct aggregation_config *aggregation,
+                    void (*wake)()) {
+    ERROR_CHECK(pthread_mutex_lock(&snapshot_mutex));
+    snapshot_path = path;
+    NULL_CHECK(temporary_path = malloc(strlen(path) + sizeof(".tmp")));
+    strcat(strcpy(temporary_path, path), ".tmp");
+    char *directory;
+    NULL_CHECK(directory = strdup(path));
+    ERROR_CHECK(directory_fd = open(dirname(directory), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    free(directory);
+    snapshot_interval_ms = interval_ms;
+    snapshot_fields = aggregation->fields;
+    snapshot_wake = wake;
+    NULL_CHECK(tables = calloc(hashtable_shard_count(), sizeof(struct snapshot_table)));
+
+    snapshot_load();
+    wal_recover(restored_positions, restored_shards);
+    free(restored_positions);
+
+    atomic_init(&capture_epoch, 0);
+    atomic_init(&capture_final, false);
+    atomic_init(&captures_left, 0);
+    if (wake != NULL) {
+        NULL_CHECK(captures = calloc(hashtable_shard_count(), sizeof(struct capture)));
+    }
+    if (interval_ms > 0) {
+        pthread_t thread;
+        NON_ZERO_CHECK(pthread_create(&thread, NULL, snapshot_thread, NULL));
+        NON_ZERO_CHECK(pthread_detach(thread));
+    }
+    ERROR_CHECK(pthread_mutex_unlock(&snapshot_mutex));
+}
+
+/**
+ * Takes the final snapshot before exit, after which shards no longer change.
+ * Snapshots stay disabled afterwards, so no periodic one replaces it.
+ */
+void snapshot_shutdown() {
+    ERROR_CHECK(pthread_mutex_lock(&snapshot_mutex));
+    if (snapshot_path != NULL)
+        snapshot_write(true);
+}
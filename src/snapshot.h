@@ -0,0 +1,53 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Interface for snapshots of partial aggregates, which survive restart.
+ * Snapshot is a binary file with slot arrays of every shard, taken periodically and at shutdown,
+ * one shard at a time. On startup slot arrays are mapped from it, so server is ready at once.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "aggregator.h"
+
+#include <stdbool.h>
+
+/**
+ * Default time between snapshots.
+ */
+#define DEFAULT_SNAPSHOT_INTERVAL_MS 10000
+/**
+ * Alignment of slot arrays in snapshot file, so they can be mapped.
+ */
+#define SNAPSHOT_ALIGNMENT 4096
+
+void init_snapshots(const char *path, unsigned interval_ms, const struct aggregation_config *aggregation,
+                    void (*wake)());
+
+bool snapshot_maintain(unsigned index);
+
+void snapshot_shutdown();
+
+#endif /* _SNAPSHOT_H_ */
@@ -0,0 +1,105 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Implementation of runtime statistics and graceful shutdown.
+ * Signals are accepted synchronously by a dedicated thread, so statistics
+ * are printed and output is flushed outside of signal handler context.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "stats.h"
+#include "pool.h"
+#include "metrics.h"
+#include "latency.h"
+#include "aggregator.h"
+#include "output.h"
+#include "publish.h"
+#include "snapshot.h"
+#include "error.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+/**
+ * Prints every statistic in Prometheus text format.
+ * @param output — stream to print to
+ */
+void stats_print(FILE *output) {
+    metrics_print(output);
+    latency_print(output);
+    aggregator_stats_print(output);
+    allocator_stats_print(output);
+    fflush(output);
+}
+
+/**
+ * Takes the final snapshot, writes pending output and terminates.
+ * Concurrent callers wait for the first one, which never returns.
+ * @return [noreturn]
+ */
+void graceful_shutdown() {
+    static pthread_mutex_t shutdown_mutex = PTHREAD_MUTEX_INITIALIZER;
+    ERROR_CHECK(pthread_mutex_lock(&shutdown_mutex));
+    snapshot_shutdown();
+    output_shutdown();
+    publish_shutdown();
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * Waits for signals – prints statistics to stderr on @p SIGUSR1,
+ * takes the final snapshot, writes pending output and terminates on the other ones.
+ * @param set_ptr — pointer to signal set
+ * @return [noreturn]
+ */
+static void *signal_thread(void *set_ptr) {
+    for (int signal;;) {
+        NON_ZERO_CHECK(sigwait(set_ptr, &signal));
+        if (signal == SIGUSR1) {
+            stats_print(stderr);
+        } else {
+            diagnostic("signal-thread: Terminating on signal %d.\n", signal);
+            graceful_shutdown();
+        }
+    }
+}
+
+/**
+ * Blocks @p SIGUSR1, @p SIGINT and @p SIGTERM, starts thread accepting them.
+ * Has to be called before other threads start, so they inherit signal mask.
+ */
+void start_signal_thread() {
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    NON_ZERO_CHECK(pthread_sigmask(SIG_BLOCK, &set, NULL));
+
+    pthread_t thread;
+    pthread_attr_t detached_attr;
+    NON_ZERO_CHECK(pthread_attr_init(&detached_attr));
+    NON_ZERO_CHECK(pthread_attr_setdetachstate(&detached_attr, PTHREAD_CREATE_DETACHED));
+    NON_ZERO_CHECK(pthread_create(&thread, &detached_attr, signal_thread, &set));
+}
@@ -0,0 +1,403 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Implementation of io_uring based connection handling, on raw system calls.
+ * Connections are never polled – completions of multishot receives carry received bytes
+ * in provided buffers, which are decoded in place and returned to the kernel in batches.
+ * All submissions prepared while handling a batch of completions are made by a single
+ * @p io_uring_enter, which also waits for the next batch.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include "input.h"
+#include "pool.h"
+#include "error.h"
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+/* Multishot receive and provided buffer rings need kernel headers of Linux 6.0 */
+#ifdef IORING_RECV_MULTISHOT
+
+/**
+ * User data of accept completions is index of the listener, below @ref MAX_LISTENERS,
+ * other completions carry their @ref input.
+ */
+#define ACCEPT_TAGS MAX_LISTENERS
+/**
+ * Group of provided buffers of every ring.
+ */
+#define BUFFER_GROUP 0
+
+/**
+ * Ring of a worker, with its queues mapped from the kernel.
+ */
+struct uring {
+    int fd;
+    /** Mapping of both queues, and of submission queue entries. */
+    void *queues;
+    size_t queues_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    _Atomic unsigned *sq_head, *sq_tail;
+    unsigned sq_mask, sq_entries;
+    /** Tail including prepared entries, published by @ref uring_enter. */
+    unsigned sq_prepared;
+
+    _Atomic unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buffer_ring;
+    uint8_t *buffers;
+    /** Tail including returned buffers, published after every batch of completions. */
+    uint16_t buffer_tail;
+};
+
+/**
+ * Listeners of workers, set by @ref run_uring_loops.
+ */
+static const struct listener *uring_listeners;
+static unsigned uring_listeners_count;
+
+/**
+ * Returns buffer to the kernel, once the tail is published.
+ * @param ring — ring of the worker
+ * @param id — index of returned buffer
+ */
+static void uring_buffer_add(struct uring *ring, uint16_t id) {
+    struct io_uring_buf *buffer = &ring->buffer_ring->bufs[ring->buffer_tail & (URING_BUFFERS - 1)];
+    buffer->addr = (uintptr_t) (ring->buffers + (size_t) id * URING_BUFFER_SIZE);
+    buffer->len = URING_BUFFER_SIZE;
+    buffer->bid = id;
+    ++ring->buffer_tail;
+}
+
+/**
+ * Publishes buffers returned since the last call.
+ * @param ring — ring of the worker
+ */
+static void uring_buffers_publish(struct uring *ring) {
+    atomic_store_explicit((_Atomic uint16_t *) &ring->buffer_ring->tail, ring->buffer_tail, memory_order_release);
+}
+
+/**
+ * Releases every resource of a ring.
+ * @param ring — initialized ring
+ */
+static void uring_free(struct uring *ring) {
+    arena_unmap(ring->buffers, (size_t) URING_BUFFERS * URING_BUFFER_SIZE);
+    arena_unmap(ring->buffer_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->queues, ring->queues_size);
+    close(ring->fd);
+}
+
+/**
+ * Creates ring, maps its queues and registers its provided buffers.
+ * Has to be called by the only thread submitting to the ring.
+ * @param ring[out] — ring to initialize
+ * @return @p false if kernel doesn't support any of the features, @p true otherwise
+ */
+static bool uring_init(struct uring *ring) {
+    struct io_uring_params params = {
+            .flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+            .cq_entries = URING_CQ_ENTRIES
+    };
+    ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        /* Single issuer and deferred task running are only hints, missing before Linux 6.1 */
+        params = (struct io_uring_params) {.flags = IORING_SETUP_CQSIZE, .cq_entries = URING_CQ_ENTRIES};
+        ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+        if (ring->fd < 0) return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        return false;
+    }
+
+    /* Both queues share a single mapping */
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->queues_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->queues = mmap(NULL, ring->queues_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->queues == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        ERROR("io_uring mmap");
+    }
+
+    char *queues = ring->queues;
+    ring->sq_head = (_Atomic unsigned *) (queues + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned *) (queues + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (queues + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_prepared = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    /* Submission array maps every slot to entry of the same index, once for all */
+    unsigned *sq_array = (unsigned *) (queues + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; ++i)
+        sq_array[i] = i;
+
+    ring->cq_head = (_Atomic unsigned *) (queues + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned *) (queues + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (queues + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (queues + params.cq_off.cqes);
+
+    /* Provided buffers, ring of their descriptors has to be page aligned */
+    NULL_CHECK(ring->buffer_ring = arena_map(URING_BUFFERS * sizeof(struct io_uring_buf)));
+    NULL_CHECK(ring->buffers = arena_map((size_t) URING_BUFFERS * URING_BUFFER_SIZE));
+    struct io_uring_buf_reg registration = {
+            .ring_addr = (uintptr_t) ring->buffer_ring,
+            .ring_entries = URING_BUFFERS,
+            .bgid = BUFFER_GROUP
+    };
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        uring_free(ring);
+        return false;
+    }
+    ring->buffer_tail = 0;
+    for (uint16_t id = 0; id < URING_BUFFERS; ++id)
+        uring_buffer_add(ring, id);
+    uring_buffers_publish(ring);
+    return true;
+}
+
+/**
+ * Submits every prepared entry and waits for completions.
+ * @param ring — ring of the worker
+ * @param wait — number of completions to wait for
+ */
+static void uring_enter(struct uring *ring, unsigned wait) {
+    atomic_store_explicit(ring->sq_tail, ring->sq_prepared, memory_order_release);
+    unsigned submit = ring->sq_prepared - atomic_load_explicit(ring->sq_head, memory_order_acquire);
+
+    long result;
+    do {
+        result = syscall(__NR_io_uring_enter, ring->fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0,
+                         NULL, 0);
+    } while (result < 0 && errno == EINTR);
+    /* Completion queue is full, entries stay prepared until completions are handled */
+    if (result < 0 && (errno == EBUSY || errno == EAGAIN)) return;
+    ERROR_CHECK(result);
+}
+
+/**
+ * Prepares submission queue entry, submitting the prepared ones if queue is full.
+ * @param ring — ring of the worker
+ * @return zeroed entry
+ */
+static struct io_uring_sqe *uring_prepare(struct uring *ring) {
+    if (ring->sq_prepared - atomic_load_explicit(ring->sq_head, memory_order_acquire) == ring->sq_entries)
+        uring_enter(ring, 0);
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_prepared++ & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/**
+ * Prepares multishot accept of listening socket.
+ * @param ring — ring of the worker
+ * @param listen_sock — listening socket of the worker
+ * @param tag — index of the listener
+ */
+static void uring_accept(struct uring *ring, int listen_sock, unsigned tag) {
+    struct io_uring_sqe *sqe = uring_prepare(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = tag;
+}
+
+/**
+ * Prepares multishot receive of a connection into provided buffers.
+ * @param ring — ring of the worker
+ * @param in — input of the connection
+ */
+static void uring_receive(struct uring *ring, struct input *in) {
+    struct io_uring_sqe *sqe = uring_prepare(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = in->sock;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = (uintptr_t) in;
+}
+
+/**
+ * Handles completion of accept, re-arming it once it is no longer multishot.
+ * Errors other than connection reset before accept terminate, like in the other models,
+ * as re-armed accept would fail again at once, e.g. with @p EMFILE.
+ * @param ring — ring of the worker
+ * @param cqe — completion
+ * @param listen_socks — listening sockets of the worker, indexed by tag of the completion
+ */
+static void uring_accepted(struct uring *ring, const struct io_uring_cqe *cqe, const int *listen_socks) {
+    if (cqe->res >= 0) {
+        uring_receive(ring, input_open_provided(cqe->res));
+        diagnostic("uring: Accepted client connection.\n");
+    } else if (cqe->res != -EAGAIN && cqe->res != -EWOULDBLOCK && cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+        errno = -cqe->res;
+        ERROR("accept");
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        uring_accept(ring, listen_socks[cqe->user_data], (unsigned) cqe->user_data);
+}
+
+/**
+ * Handles completion of receive – decodes received bytes and returns their buffer.
+ * Invalid data shuts connection down, which ends its receive, the final completion of receive closes it.
+ * @param ring — ring of the worker
+ * @param cqe — completion
+ */
+static void uring_received(struct uring *ring, const struct io_uring_cqe *cqe) {
+    struct input *in = (struct input *) (uintptr_t) cqe->user_data;
+
+    if (cqe->res > 0) {
+        uint16_t id = (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (input_deliver(in, ring->buffers + (size_t) id * URING_BUFFER_SIZE, (size_t) cqe->res) == INPUT_CLOSED)
+            shutdown(in->sock, SHUT_RDWR);
+        uring_buffer_add(ring, id);
+    }
+    if (cqe->flags & IORING_CQE_F_MORE) return;
+
+    /* Receive ended, because it ran out of buffers or completion queue space, or on disconnect */
+    if ((cqe->res > 0 || cqe->res == -ENOBUFS) && !decoder_failed(&in->decoder)) {
+        uring_receive(ring, in);
+    } else {
+        input_close(in);
+        diagnostic("uring: Closed connection.\n");
+    }
+}
+
+/**
+ * Serves connections of a worker, accepted on its own tcp sockets, and on unix sockets by the first worker.
+ * @param index_ptr — index of the worker
+ * @return [noreturn]
+ */
+static void *uring_loop(void *index_ptr) {
+    unsigned index = (unsigned) (uintptr_t) index_ptr;
+    struct uring ring;
+    if (!uring_init(&ring)) {
+        ERROR("io_uring setup");
+    }
+    int listen_socks[ACCEPT_TAGS];
+    for (unsigned i = 0; i < uring_listeners_count; ++i) {
+        if (listener_is_datagram(&uring_listeners[i]) || !listener_owned(&uring_listeners[i], index)) continue;
+        listen_socks[i] = listener_open(&uring_listeners[i], true);
+        uring_accept(&ring, listen_socks[i], i);
+    }
+
+    for (;;) {
+        uring_enter(&ring, 1);
+
+        unsigned head = atomic_load_explicit(ring.cq_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(ring.cq_tail, memory_order_acquire);
+        for (; head != tail; ++head) {
+            const struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+            if (cqe->user_data < ACCEPT_TAGS)
+                uring_accepted(&ring, cqe, listen_socks);
+            else
+                uring_received(&ring, cqe);
+        }
+        atomic_store_explicit(ring.cq_head, head, memory_order_release);
+        uring_buffers_publish(&ring);
+    }
+}
+
+/**
+ * Checks whether kernel supports every feature used, by creating and destroying a ring.
+ * @return @p true if io_uring backend can be used
+ */
+bool uring_supported() {
+    struct uring ring;
+    ZERO_RETURN(uring_init(&ring));
+    uring_free(&ring);
+    return true;
+}
+
+/**
+ * Starts @p workers io_uring workers, calling thread becomes the first one.
+ * Datagram listeners are not served by workers.
+ * @param listeners — listeners to open
+ * @param count — number of listeners
+ * @param workers — number of workers
+ * @return [noreturn]
+ */
+void run_uring_loops(const struct listener *listeners, unsigned count, unsigned workers) {
+    uring_listeners = listeners;
+    uring_listeners_count = count;
+
+    pthread_t thread;
+    pthread_attr_t detached_attr;
+    NON_ZERO_CHECK(pthread_attr_init(&detached_attr));
+    NON_ZERO_CHECK(pthread_attr_setdetachstate(&detached_attr, PTHREAD_CREATE_DETACHED));
+    for (unsigned i = 1; i < workers; ++i) {
+        NON_ZERO_CHECK(pthread_create(&thread, &detached_attr, uring_loop, (void *) (uintptr_t) i));
+    }
+    diagnostic("main-thread: Launched %u io_uring workers.\n", workers);
+    uring_loop((void *) 0);
+}
+
+#else
+
+/**
+ * Reports io_uring backend as unsupported, kernel headers are too old.
+ * @return @p false
+ */
+bool uring_supported() {
+    return false;
+}
+
+/**
+ * Never called, as io_uring backend is unsupported.
+ * @param listeners — unused
+ * @param count — unused
+ * @param workers — unused
+ */
+void run_uring_loops(const struct listener *listeners, unsigned count, unsigned workers) {
+    (void) listeners;
+    (void) count;
+    (void) workers;
+    errno = ENOSYS;
+    ERROR("io_uring");
+}
+
+#endif
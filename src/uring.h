@@ -0,0 +1,58 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Interface for io_uring based connection handling.
+ * Every worker thread owns a ring, its own listening socket with multishot accept,
+ * and a ring of provided buffers, into which multishot receives of its connections are completed.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include "listener.h"
+
+#include <stdbool.h>
+
+/**
+ * Number of submission queue entries of every ring.
+ */
+#define URING_ENTRIES 256
+/**
+ * Number of completion queue entries of every ring.
+ */
+#define URING_CQ_ENTRIES 4096
+/**
+ * Number of provided buffers of every ring, power of two.
+ */
+#define URING_BUFFERS 256
+/**
+ * Size of every provided buffer.
+ */
+#define URING_BUFFER_SIZE 16384
+
+bool uring_supported();
+
+void run_uring_loops(const struct listener *listeners, unsigned count, unsigned workers);
+
+#endif /* _URING_H_ */
@@ -0,0 +1,520 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Implementation of write-ahead log of accepted messages.
+ * Producers copy messages to the pending batch under a mutex, the log thread swaps it with the one
+ * it has just written, once it holds enough bytes or waited long enough, writes it with a checksummed
+ * header and syncs it. Producers log and aggregate a batch under shared lock of the log, so a snapshot
+ * holding it exclusively sees every logged message aggregated, and none aggregated without being logged.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#define _GNU_SOURCE
+
+#include "wal.h"
+#include "hashtable.h"
+#include "metrics.h"
+#include "error.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Marks header of a batch in segment file, with version of its format.
+ */
+#define WAL_MAGIC 0x314c4157u
+/**
+ * Length of segment file name, hexadecimal position of its first message and extension.
+ */
+#define WAL_NAME_LENGTH (16 + sizeof(".wal"))
+
+/**
+ * Header of a batch in segment file, followed by its messages.
+ */
+struct wal_batch {
+    /** Checksum of the rest of header and of messages, detects batch torn by a crash. */
+    uint64_t checksum;
+    /** Position of the first message in the log, which numbers every logged message. */
+    uint64_t position;
+    uint32_t count;
+    uint32_t magic;
+};
+
+/**
+ * Batch of messages, laid out as in segment file.
+ */
+struct wal_buffer {
+    unsigned char *data;
+    /** Allocated bytes, and bytes used, including header. */
+    size_t capacity, size;
+};
+
+/**
+ * Directory of segment files, @p NULL if log is disabled.
+ */
+static const char *wal_directory = NULL;
+static int directory_fd;
+/**
+ * Batch size, which commits it at once, and max time a message waits for commit.
+ */
+static size_t batch_size;
+static unsigned batch_delay_ms;
+/**
+ * Aggregates logged and replayed messages.
+ */
+static void (*wal_consumer)(const struct message *, size_t);
+/**
+ * Held shared by producers while they log and aggregate a batch, exclusively by snapshot.
+ */
+static pthread_rwlock_t gate;
+/**
+ * Guards batches and positions, signals pending messages, free space and commits.
+ */
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t appended_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t durable_cond = PTHREAD_COND_INITIALIZER;
+/**
+ * Batch filled by producers, and batch being written by the log thread.
+ */
+static struct wal_buffer buffers[2];
+static struct wal_buffer *pending = &buffers[0], *committing = &buffers[1];
+/**
+ * Position after the last logged message, and after the last synced one.
+ */
+static uint_least64_t appended = 0, durable = 0;
+/**
+ * Positions of the first messages of segment files, oldest first, the last one is written.
+ */
+static pthread_mutex_t segments_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint_least64_t *segments = NULL;
+static size_t segments_count = 0, segments_capacity = 0;
+/**
+ * Written segment file and position in it.
+ */
+static int segment_fd = -1;
+static off_t segment_offset;
+
+/**
+ * Calculates checksum of 64-bit words.
+ * @param words — words to checksum
+ * @param count — number of @p words
+ * @return checksum
+ */
+static uint64_t wal_checksum(const uint64_t *words, size_t count) {
+    uint64_t sum = CLOCK_STRIDE;
+    for (size_t i = 0; i < count; ++i) {
+        sum = (sum ^ words[i]) * 0xff51afd7ed558ccd;
+        sum ^= sum >> 32;
+    }
+    return sum;
+}
+
+/**
+ * Formats name of segment file.
+ * @param name[out] — buffer of @ref WAL_NAME_LENGTH bytes
+ * @param position — position of the first message of segment
+ */
+static void segment_name(char *name, uint_least64_t position) {
+    snprintf(name, WAL_NAME_LENGTH, "%016" PRIx64 ".wal", (uint64_t) position);
+}
+
+/**
+ * Adds segment file to the list of segments.
+ * @param position — position of the first message of segment, not lower than of the last one
+ */
+static void segment_add(uint_least64_t position) {
+    ERROR_CHECK(pthread_mutex_lock(&segments_mutex));
+    if (segments_count == 0 || segments[segments_count - 1] != position) {
+        if (segments_count == segments_capacity) {
+            segments_capacity = segments_capacity > 0 ? 2 * segments_capacity : 16;
+            NULL_CHECK(segments = realloc(segments, segments_capacity * sizeof(uint_least64_t)));
+        }
+        segments[segments_count++] = position;
+    }
+    ERROR_CHECK(pthread_mutex_unlock(&segments_mutex));
+}
+
+/**
+ * Creates preallocated segment file and makes it the written one.
+ * Its blocks are allocated up front, so syncing a batch doesn't have to allocate them.
+ * @param position — position of the first message written to it
+ */
+static void segment_open(uint_least64_t position) {
+    if (segment_fd >= 0) {
+        ERROR_CHECK(close(segment_fd));
+    }
+    char name[WAL_NAME_LENGTH];
+    segment_name(name, position);
+    ERROR_CHECK(segment_fd = openat(directory_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    NON_ZERO_CHECK(posix_fallocate(segment_fd, 0, WAL_SEGMENT_SIZE));
+    ERROR_CHECK(fsync(segment_fd));
+    ERROR_CHECK(fsync(directory_fd));
+    segment_offset = 0;
+    segment_add(position);
+}
+
+/**
+ * Writes batch to the end of the log and syncs it, starts new segment once the current one is full.
+ * @param batch — batch with at least one message, its header is filled here
+ * @param position — position of its first message
+ */
+static void wal_write(struct wal_buffer *batch, uint_least64_t position) {
+    struct wal_batch *header = (struct wal_batch *) batch->data;
+    header->position = position;
+    header->count = (uint32_t) ((batch->size - sizeof(*header)) / sizeof(struct message));
+    header->magic = WAL_MAGIC;
+    header->checksum = wal_checksum((const uint64_t *) batch->data + 1, batch->size / sizeof(uint64_t) - 1);
+
+    if (segment_offset > 0 && (size_t) segment_offset + batch->size > WAL_SEGMENT_SIZE)
+        segment_open(position);
+    for (size_t done = 0; done < batch->size;) {
+        ssize_t written = pwrite(segment_fd, batch->data + done, batch->size - done, segment_offset);
+        if (written < 0 && errno == EINTR) continue;
+        ERROR_CHECK(written);
+        done += (size_t) written;
+        segment_offset += written;
+    }
+    ERROR_CHECK(fdatasync(segment_fd));
+}
+
+/**
+ * Returns absolute time after given delay, for timed waits.
+ * @param delay_ms — delay from now
+ * @return deadline on realtime clock
+ */
+static struct timespec deadline_after(unsigned delay_ms) {
+    struct timespec deadline;
+    ERROR_CHECK(clock_gettime(CLOCK_REALTIME, &deadline));
+    deadline.tv_sec += delay_ms / 1000;
+    deadline.tv_nsec += (long) (delay_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+/**
+ * Commits batches – waits for the first pending message, then until batch is large enough
+ * or the delay passes, writes it with a single sync and publishes its end as durable.
+ * @param unused — unused
+ * @return never returns
+ */
+static void *wal_thread(void *unused) {
+    (void) unused;
+    for (;;) {
+        ERROR_CHECK(pthread_mutex_lock(&wal_mutex));
+        while (pending->size == sizeof(struct wal_batch)) {
+            NON_ZERO_CHECK(pthread_cond_wait(&appended_cond, &wal_mutex));
+        }
+        struct timespec deadline = deadline_after(batch_delay_ms);
+        while (pending->size - sizeof(struct wal_batch) < batch_size) {
+            int error = pthread_cond_timedwait(&appended_cond, &wal_mutex, &deadline);
+            if (error == ETIMEDOUT) break;
+            if (error != 0) {
+                errno = error;
+                ERROR("pthread_cond_timedwait");
+            }
+        }
+
+        struct wal_buffer *batch = pending;
+        pending = committing;
+        committing = batch;
+        uint_least64_t end = appended;
+        ERROR_CHECK(pthread_cond_broadcast(&space_cond));
+        ERROR_CHECK(pthread_mutex_unlock(&wal_mutex));
+
+        size_t count = (batch->size - sizeof(struct wal_batch)) / sizeof(struct message);
+        wal_write(batch, end - count);
+        metrics_add(METRIC_WAL_COMMITS, 1);
+        metrics_add(METRIC_WAL_BYTES, batch->size);
+        batch->size = sizeof(struct wal_batch);
+
+        ERROR_CHECK(pthread_mutex_lock(&wal_mutex));
+        durable = end;
+        ERROR_CHECK(pthread_cond_broadcast(&durable_cond));
+        ERROR_CHECK(pthread_mutex_unlock(&wal_mutex));
+    }
+    return NULL;
+}
+
+/**
+ * Copies messages to the pending batch, waits while it is full.
+ * @param messages — messages to log
+ * @param count — number of @p messages
+ */
+static void wal_append(const struct message *messages, size_t count) {
+    size_t bytes = count * sizeof(struct message);
+    ERROR_CHECK(pthread_mutex_lock(&wal_mutex));
+    while (pending->size > sizeof(struct wal_batch) && pending->size + bytes > pending->capacity) {
+        NON_ZERO_CHECK(pthread_cond_wait(&space_cond, &wal_mutex));
+    }
+    if (pending->size + bytes > pending->capacity) {
+        pending->capacity = pending->size + bytes;
+        NULL_CHECK(pending->data = realloc(pending->data, pending->capacity));
+    }
+
+    /* Log thread waits either for the first message, or for a full batch */
+    size_t before = pending->size - sizeof(struct wal_batch);
+    memcpy(pending->data + pending->size, messages, bytes);
+    pending->size += bytes;
+    appended += count;
+    if (before == 0 || (before < batch_size && before + bytes >= batch_size)) {
+        ERROR_CHECK(pthread_cond_signal(&appended_cond));
+    }
+    ERROR_CHECK(pthread_mutex_unlock(&wal_mutex));
+}
+
+/**
+ * Logs batch of messages, then aggregates it. Used as consumer of input instead of aggregator.
+ * @param messages — accepted messages
+ * @param count — number of @p messages
+ */
+void wal_consume(const struct message *messages, size_t count) {
+    NON_ZERO_CHECK(pthread_rwlock_rdlock(&gate));
+    wal_append(messages, count);
+    wal_consumer(messages, count);
+    NON_ZERO_CHECK(pthread_rwlock_unlock(&gate));
+}
+
+/**
+ * Waits until every message logged so far is durable. Called before aggregates are written,
+ * so an aggregate never outlives a crash, which loses a message it is made of.
+ */
+void wal_barrier() {
+    ERROR_CHECK(pthread_mutex_lock(&wal_mutex));
+    uint_least64_t target = appended;
+    while (durable < target) {
+        NON_ZERO_CHECK(pthread_cond_wait(&durable_cond, &wal_mutex));
+    }
+    ERROR_CHECK(pthread_mutex_unlock(&wal_mutex));
+}
+
+/**
+ * Stops logging and aggregation of messages, until @ref wal_resume.
+ * @return position after the last logged message, every message before it is aggregated, zero if log is disabled
+ */
+uint_least64_t wal_pause() {
+    if (wal_directory == NULL) return 0;
+    NON_ZERO_CHECK(pthread_rwlock_wrlock(&gate));
+    ERROR_CHECK(pthread_mutex_lock(&wal_mutex));
+    uint_least64_t position = appended;
+    ERROR_CHECK(pthread_mutex_unlock(&wal_mutex));
+    return position;
+}
+
+/**
+ * Resumes logging and aggregation of messages, stopped by @ref wal_pause.
+ */
+void wal_resume() {
+    if (wal_directory != NULL) {
+        NON_ZERO_CHECK(pthread_rwlock_unlock(&gate));
+    }
+}
+
+/**
+ * Removes segment files, which hold only messages before given position, except the written one.
+ * @param position — position, before which messages are covered by a durable snapshot
+ */
+void wal_truncate(uint_least64_t position) {
+    if (wal_directory == NULL) return;
+    ERROR_CHECK(pthread_mutex_lock(&segments_mutex));
+    size_t removed = 0;
+    while (removed + 1 < segments_count && segments[removed + 1] <= position) {
+        char name[WAL_NAME_LENGTH];
+        segment_name(name, segments[removed]);
+        if (unlinkat(directory_fd, name, 0) < 0)
+            fprintf(stderr, "wal: Can't remove %s: %s.\n", name, strerror(errno));
+        ++removed;
+    }
+    memmove(segments, segments + removed, (segments_count - removed) * sizeof(uint_least64_t));
+    segments_count -= removed;
+    ERROR_CHECK(pthread_mutex_unlock(&segments_mutex));
+    if (removed > 0)
+        diagnostic("wal: Removed %zu segments.\n", removed);
+}
+
+/**
+ * Compares positions of segments, for qsort.
+ * @param a — first position
+ * @param b — second position
+ * @return negative, zero or positive, as @p a is before, at or after @p b
+ */
+static int compare_positions(const void *a, const void *b) {
+    uint_least64_t x = *(const uint_least64_t *) a, y = *(const uint_least64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Lists segment files in log directory, oldest first.
+ */
+static void segments_list() {
+    int fd;
+    ERROR_CHECK(fd = dup(directory_fd));
+    DIR *directory;
+    NULL_CHECK(directory = fdopendir(fd));
+    for (struct dirent *it; (it = readdir(directory)) != NULL;) {
+        char *end;
+        uint_least64_t position = strtoull(it->d_name, &end, 16);
+        if (end == it->d_name + 16 && strcmp(end, ".wal") == 0)
+            segment_add(position);
+    }
+    ERROR_CHECK(closedir(directory));
+    qsort(segments, segments_count, sizeof(uint_least64_t), compare_positions);
+}
+
+/**
+ * Replays valid batches of a segment file, up to the first torn or missing one.
+ * Messages covered by snapshot of their shard are skipped.
+ * @param first — position of the first message of segment
+ * @param positions — positions covered by snapshot of every shard, @p NULL if there is no snapshot
+ * @param shards — number of @p positions, power of two
+ * @param next[out] — position after the last valid message
+ * @return number of replayed messages
+ */
+static size_t segment_replay(uint_least64_t first, const uint_least64_t *positions, unsigned shards,
+                             uint_least64_t *next) {
+    char name[WAL_NAME_LENGTH];
+    segment_name(name, first);
+    int fd = openat(directory_fd, name, O_RDONLY | O_CLOEXEC);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) < 0) {
+        fprintf(stderr, "wal: Can't read %s: %s.\n", name, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    size_t size = (size_t) status.st_size;
+    const unsigned char *file = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ERROR_CHECK(close(fd));
+    if (file == MAP_FAILED) return 0;
+    madvise((void *) file, size, MADV_SEQUENTIAL);
+
+    size_t replayed = 0;
+    struct message messages[MESSAGES_BATCH];
+    size_t count = 0;
+    for (size_t offset = 0; size - offset >= sizeof(struct wal_batch);) {
+        const struct wal_batch *batch = (const struct wal_batch *) (file + offset);
+        size_t bytes = sizeof(*batch) + (size_t) batch->count * sizeof(struct message);
+        if (batch->magic != WAL_MAGIC || batch->count == 0 || bytes > size - offset ||
+            batch->position != first || batch->checksum != wal_checksum(&batch->position, bytes / sizeof(uint64_t) - 1))
+            break;
+
+        const struct message *it = (const struct message *) (batch + 1);
+        for (uint32_t i = 0; i < batch->count; ++i, ++it) {
+            if (positions != NULL && first + i < positions[hashtable_hash(it->id) & (shards - 1)])
+                continue;
+            messages[count++] = *it;
+            if (count == MESSAGES_BATCH) {
+                wal_consumer(messages, count);
+                replayed += count;
+                count = 0;
+            }
+        }
+        first += batch->count;
+        *next = first;
+        offset += bytes;
+    }
+    wal_consumer(messages, count);
+    replayed += count;
+
+    munmap((void *) file, size);
+    return replayed;
+}
+
+/**
+ * Replays messages not covered by snapshot, starts logging to a new segment after them.
+ * Has to be called once, after snapshot is restored and before any message is accepted.
+ * @param positions — positions covered by snapshot of every shard, @p NULL if there is no snapshot
+ * @param shards — number of @p positions, power of two, or zero
+ */
+void wal_recover(const uint_least64_t *positions, unsigned shards) {
+    if (wal_directory == NULL) return;
+
+    segments_list();
+    uint_least64_t next = 0;
+    size_t replayed = 0;
+    for (size_t i = 0; i < segments_count; ++i) {
+        if (segments[i] < next)
+            fprintf(stderr, "wal: Segments overlap at %" PRIu64 ".\n", (uint64_t) segments[i]);
+        /* Segment without valid batches still numbers its messages, which may have been logged */
+        next = segments[i] > next ? segments[i] : next;
+        replayed += segment_replay(segments[i], positions, shards, &next);
+    }
+    for (unsigned i = 0; i < shards; ++i) {
+        if (positions[i] > next)
+            next = positions[i];
+    }
+    if (replayed > 0)
+        fprintf(stderr, "wal: Replayed %zu messages.\n", replayed);
+
+    /* Torn end of the last segment is never appended to, logging resumes in a new one */
+    appended = durable = next;
+    segment_open(next);
+    pthread_t thread;
+    NON_ZERO_CHECK(pthread_create(&thread, NULL, wal_thread, NULL));
+    NON_ZERO_CHECK(pthread_detach(thread));
+}
+
+/**
+ * Opens log directory, messages are logged once @ref wal_recover replays the previous ones.
+ * @param directory — directory of segment files, created if missing
+ * @param size — number of bytes of messages, which commits batch at once
+ * @param delay_ms — max time a message waits for commit of its batch
+ * @param consume — aggregates messages, after they are logged
+ */
+void init_wal(const char *directory, size_t size, unsigned delay_ms,
+              void (*consume)(const struct message *messages, size_t count)) {
+    if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+        ERROR("mkdir");
+    }
+    ERROR_CHECK(directory_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    wal_directory = directory;
+    batch_size = size;
+    batch_delay_ms = delay_ms;
+    wal_consumer = consume;
+
+    /* Producers fill one batch, while the other is written, and wait only once both are full */
+    size_t capacity = sizeof(struct wal_batch) + size + MESSAGES_BATCH * sizeof(struct message);
+    for (int i = 0; i < 2; ++i) {
+        NULL_CHECK(buffers[i].data = malloc(capacity));
+        buffers[i].capacity = capacity;
+        buffers[i].size = sizeof(struct wal_batch);
+    }
+
+    /* Snapshot must not wait behind a stream of producers */
+    pthread_rwlockattr_t attributes;
+    NON_ZERO_CHECK(pthread_rwlockattr_init(&attributes));
+    NON_ZERO_CHECK(pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP));
+    NON_ZERO_CHECK(pthread_rwlock_init(&gate, &attributes));
+    NON_ZERO_CHECK(pthread_rwlockattr_destroy(&attributes));
+}
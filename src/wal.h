@@ -0,0 +1,68 @@
+/*
+    Simple key-value aggregation concurrent server.
+    Copyright (C) 2019  Piotr Krzywicki
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Interface for write-ahead log of accepted messages.
+ * Messages are appended to an in-memory batch before they are aggregated, batches are written
+ * to preallocated segment files and synced once per batch, by a dedicated thread. Aggregates reach
+ * output only after every message accepted before them is durable. On startup messages not covered
+ * by the snapshot are replayed, segments covered by a newer snapshot are removed.
+ *
+ * @author Piotr Krzywicki <krzywicki.ptr@gmail.com>
+ * @date 17.10.2026
+ */
+
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include "protocol.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Default number of bytes of messages, which commits batch before its delay passes.
+ */
+#define DEFAULT_WAL_BATCH_SIZE (256 * 1024)
+/**
+ * Default max time, for which accepted message waits for its batch to be committed.
+ */
+#define DEFAULT_WAL_BATCH_DELAY_MS 2
+/**
+ * Size, to which segment files are preallocated. Segment holding a larger batch grows.
+ */
+#define WAL_SEGMENT_SIZE (64 * 1024 * 1024)
+
+void init_wal(const char *directory, size_t batch_size, unsigned batch_delay_ms,
+              void (*consume)(const struct message *messages, size_t count));
+
+void wal_recover(const uint_least64_t *positions, unsigned shards);
+
+void wal_consume(const struct message *messages, size_t count);
+
+uint_least64_t wal_pause();
+
+void wal_resume();
+
+void wal_truncate(uint_least64_t position);
+
+void wal_barrier();
+
+#endif /* _WAL_H_ */